@@ -0,0 +1,200 @@
+// Microbenchmark for the PRINT run decoder (src/decode.c).
+// Replays a stream of PRINT commands through every implementation the cpu supports, checks that all of them
+// produce exactly the same canvas as the scalar one, also for a split screen region, and prints the cost per command.
+// The same stream as text lines (src/text.c) goes through every newline scanner and has to draw the same canvas.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "decode.h"
+#include "text.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define NUM_CMDS (1 << 20)
+#define CHUNK_CMDS 128 // like DRAW_LIMIT in connection.c
+#define ROUNDS 20
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// mostly inside the canvas, some outside, and every 64th command is a GET to end the run
+static unsigned char *make_stream(void) {
+    unsigned char *cmds = malloc((size_t)NUM_CMDS * 8);
+    unsigned int state = 12345;
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        unsigned char *c = &cmds[i * 8];
+        unsigned int x = xorshift(&state) % (WIDTH + WIDTH / 16);
+        unsigned int y = xorshift(&state) % (HEIGHT + HEIGHT / 16);
+        unsigned int color = xorshift(&state);
+        c[0] = i % 64 == 63 ? 'G' : 'P';
+        c[1] = x & 0xff;
+        c[2] = x >> 8;
+        c[3] = y & 0xff;
+        c[4] = y >> 8;
+        c[5] = color & 0xff;
+        c[6] = (color >> 8) & 0xff;
+        c[7] = (color >> 16) & 0xff;
+    }
+    return cmds;
+}
+
+static const struct print_area whole = { WIDTH, HEIGHT, WIDTH, 0 };
+// the bottom right quarter, as a client in split screen mode
+static const struct print_area quarter = { WIDTH / 2, HEIGHT / 2, WIDTH, WIDTH / 2 + WIDTH * (HEIGHT / 2) };
+
+// the same loop as the PRINT branch of connection_step. pixels == NULL only decodes.
+static size_t replay(decode_print_fn fn, const struct print_area *a, const unsigned char *cmds, unsigned int *pixels) {
+    struct print_batch batch;
+    size_t drawn = 0;
+    size_t i = 0;
+    while (i < NUM_CMDS) {
+        if (cmds[i * 8] != 'P') {
+            i += 1;
+            continue;
+        }
+        size_t max_cmds = NUM_CMDS - i < CHUNK_CMDS ? NUM_CMDS - i : CHUNK_CMDS;
+        size_t n = fn(&cmds[i * 8], max_cmds, a, &batch);
+        for (size_t j = 0; pixels != NULL && j < batch.n; j++) {
+            pixels[batch.index[j]] = batch.color[j];
+        }
+        drawn += batch.n;
+        i += n;
+    }
+    return drawn;
+}
+
+// the stream as text lines, "PX x y rrggbb\n" and "PX x y\n" for the GETs
+static unsigned char *make_text_stream(const unsigned char *cmds, size_t *len) {
+    char *text = malloc((size_t)NUM_CMDS * 24);
+    size_t n = 0;
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        const unsigned char *c = &cmds[i * 8];
+        unsigned int x = c[1] | (c[2] << 8);
+        unsigned int y = c[3] | (c[4] << 8);
+        if (c[0] == 'P') {
+            n += sprintf(text + n, "PX %u %u %02x%02x%02x\n", x, y, c[5], c[6], c[7]);
+        } else {
+            n += sprintf(text + n, "PX %u %u\n", x, y);
+        }
+    }
+    *len = n;
+    return (unsigned char *)text;
+}
+
+// the same loop as connection_step_text
+static size_t replay_text(text_scan_fn scan, const struct print_area *a, const unsigned char *text, size_t len,
+        unsigned int *pixels) {
+    struct print_batch batch;
+    struct text_cmd cmd;
+    size_t drawn = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        text_parse(text + pos, len - pos, &cmd);
+        if (cmd.type != TEXT_PX_SET) {
+            pos += cmd.length;
+            continue;
+        }
+        size_t used;
+        text_print_run_with(scan, text + pos, len - pos, CHUNK_CMDS, 0, 0, a, &batch, &used);
+        for (size_t j = 0; pixels != NULL && j < batch.n; j++) {
+            pixels[batch.index[j]] = batch.color[j];
+        }
+        drawn += batch.n;
+        pos += used;
+    }
+    return drawn;
+}
+
+int main(void) {
+    const struct {
+        const char *name;
+        decode_print_fn fn;
+    } impls[] = {
+        { "scalar", decode_print_scalar },
+        { "sse4.1", decode_print_sse41 },
+        { "avx2", decode_print_avx2 },
+    };
+    unsigned char *cmds = make_stream();
+    size_t canvas_size = (size_t)WIDTH * HEIGHT * sizeof(unsigned int);
+    unsigned int *reference = calloc(1, canvas_size);
+    unsigned int *reference_quarter = calloc(1, canvas_size);
+    unsigned int *pixels = malloc(canvas_size);
+    replay(decode_print_scalar, &whole, cmds, reference);
+    replay(decode_print_scalar, &quarter, cmds, reference_quarter);
+
+    int failed = 0;
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+        if (!decode_cpu_supports(impls[k].fn)) {
+            printf("%-8s not supported\n", impls[k].name);
+            continue;
+        }
+        memset(pixels, 0, canvas_size);
+        replay(impls[k].fn, &quarter, cmds, pixels);
+        int same = memcmp(pixels, reference_quarter, canvas_size) == 0;
+        memset(pixels, 0, canvas_size);
+        size_t drawn = replay(impls[k].fn, &whole, cmds, pixels);
+        same &= memcmp(pixels, reference, canvas_size) == 0;
+        failed |= !same;
+
+        unsigned long long start = now_ns();
+        for (int r = 0; r < ROUNDS; r++) {
+            replay(impls[k].fn, &whole, cmds, NULL);
+        }
+        double ns_decode = (double)(now_ns() - start) / ((double)ROUNDS * NUM_CMDS);
+        start = now_ns();
+        for (int r = 0; r < ROUNDS; r++) {
+            replay(impls[k].fn, &whole, cmds, pixels);
+        }
+        double ns_total = (double)(now_ns() - start) / ((double)ROUNDS * NUM_CMDS);
+        printf("%-8s decode %5.2f ns/command, decode+draw %5.2f ns/command, %zu pixels drawn, canvas %s\n",
+                impls[k].name, ns_decode, ns_total, drawn, same ? "identical" : "DIFFERS");
+    }
+
+    const struct {
+        const char *name;
+        text_scan_fn fn;
+    } scanners[] = {
+        { "generic", text_scan_generic },
+        { "sse2", text_scan_sse2 },
+        { "avx2", text_scan_avx2 },
+    };
+    size_t text_len;
+    unsigned char *text = make_text_stream(cmds, &text_len);
+    for (size_t k = 0; k < sizeof(scanners) / sizeof(scanners[0]); k++) {
+        if (!text_cpu_supports(scanners[k].fn)) {
+            printf("text %-8s not supported\n", scanners[k].name);
+            continue;
+        }
+        memset(pixels, 0, canvas_size);
+        size_t drawn = replay_text(scanners[k].fn, &whole, text, text_len, pixels);
+        int same = memcmp(pixels, reference, canvas_size) == 0;
+        failed |= !same;
+        unsigned long long start = now_ns();
+        for (int r = 0; r < ROUNDS; r++) {
+            replay_text(scanners[k].fn, &whole, text, text_len, NULL);
+        }
+        double ns_decode = (double)(now_ns() - start) / ((double)ROUNDS * NUM_CMDS);
+        printf("text %-8s decode %5.2f ns/line, %zu pixels drawn, canvas %s\n", scanners[k].name, ns_decode, drawn,
+                same ? "identical" : "DIFFERS");
+    }
+    free(text);
+    free(cmds);
+    free(reference);
+    free(reference_quarter);
+    free(pixels);
+    return failed;
+}
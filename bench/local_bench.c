@@ -0,0 +1,251 @@
+// Throughput of the transports for local clients against a running server (see src/local.h):
+// sends the same stream of PRINT commands over tcp loopback, the unix socket and the shared memory ring, ends each
+// run with an INFO and stops the clock when its response arrives, so every command has been drawn by then.
+//
+//     server --unix-socket /tmp/pfs.sock &
+//     build/local_bench --port 1337 --unix /tmp/pfs.sock
+
+#define _GNU_SOURCE // memfd_create, F_ADD_SEALS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "local.h"
+
+#define NUM_CMDS (8 << 20)
+#define SIZE 512 // coordinates stay inside the default canvas
+#define CHUNK (64 * 1024) // bytes per write() or per advance of write_pos
+#define RING_SIZE (1 << 20)
+#define ROUNDS 3
+#define FULL_SLEEP_US 20 // a client with a full ring polls read_pos
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int xorshift(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static unsigned char *make_stream(void) {
+    unsigned char *cmds = malloc((size_t)NUM_CMDS * 8);
+    unsigned int state = 12345;
+    for (size_t i = 0; i < NUM_CMDS; i++) {
+        unsigned char *c = &cmds[i * 8];
+        unsigned int x = xorshift(&state) % SIZE;
+        unsigned int y = xorshift(&state) % SIZE;
+        unsigned int color = xorshift(&state);
+        c[0] = 'P';
+        c[1] = x & 0xff;
+        c[2] = x >> 8;
+        c[3] = y & 0xff;
+        c[4] = y >> 8;
+        c[5] = color & 0xff;
+        c[6] = (color >> 8) & 0xff;
+        c[7] = (color >> 16) & 0xff;
+    }
+    return cmds;
+}
+
+static void write_all(int fd, const unsigned char *p, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            perror("write");
+            exit(1);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+static void read_all(int fd, unsigned char *p, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+static int connect_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect tcp");
+        exit(1);
+    }
+    return fd;
+}
+
+static int connect_unix(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("connect unix");
+        exit(1);
+    }
+    return fd;
+}
+
+static const unsigned char info_cmd[8] = { 'I' };
+
+// the stream over the socket, then INFO. returns the ns until its response arrived.
+static unsigned long long run_socket(int fd, const unsigned char *cmds) {
+    unsigned char response[16];
+    unsigned long long start = now_ns();
+    for (size_t done = 0; done < (size_t)NUM_CMDS * 8; done += CHUNK) {
+        write_all(fd, cmds + done, CHUNK);
+    }
+    write_all(fd, info_cmd, sizeof(info_cmd));
+    read_all(fd, response, sizeof(response));
+    return now_ns() - start;
+}
+
+struct ring {
+    struct local_ring_header *header;
+    unsigned char *data;
+    int fd; // the socket
+};
+
+static void ring_open(struct ring *r, int fd) {
+    int memfd = memfd_create("pfs-bench-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1 || ftruncate(memfd, LOCAL_RING_HEADER_SIZE + RING_SIZE) != 0
+            || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+        perror("memfd");
+        exit(1);
+    }
+    void *p = mmap(NULL, LOCAL_RING_HEADER_SIZE + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    r->header = p;
+    r->data = (unsigned char *)p + LOCAL_RING_HEADER_SIZE;
+    r->fd = fd;
+    // MAP RING with the memfd attached
+    union {
+        struct cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { (void *)"M\0\0\0\0\0\0\0", 8 };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    if (sendmsg(fd, &msg, 0) != 8) {
+        perror("sendmsg");
+        exit(1);
+    }
+    close(memfd);
+}
+
+// copies size <= RING_SIZE bytes into the ring, waiting for space, and wakes the server if it sleeps
+static void ring_write(struct ring *r, const unsigned char *p, size_t size) {
+    unsigned long long pos = r->header->write_pos; // only written by us
+    while (pos + size - __atomic_load_n(&r->header->read_pos, __ATOMIC_ACQUIRE) > RING_SIZE) {
+        usleep(FULL_SLEEP_US);
+    }
+    size_t offset = pos % RING_SIZE;
+    size_t first = size < RING_SIZE - offset ? size : RING_SIZE - offset;
+    memcpy(r->data + offset, p, first);
+    memcpy(r->data, p + first, size - first);
+    __atomic_store_n(&r->header->write_pos, pos + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->header->server_waiting, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&r->header->server_waiting, 0, __ATOMIC_SEQ_CST)) {
+        write_all(r->fd, (const unsigned char *)"w", 1);
+    }
+}
+
+static unsigned long long run_ring(struct ring *r, const unsigned char *cmds) {
+    unsigned char response[16];
+    unsigned long long start = now_ns();
+    for (size_t done = 0; done < (size_t)NUM_CMDS * 8; done += CHUNK) {
+        ring_write(r, cmds + done, CHUNK);
+    }
+    ring_write(r, info_cmd, sizeof(info_cmd));
+    read_all(r->fd, response, sizeof(response));
+    return now_ns() - start;
+}
+
+static void report(const char *name, unsigned long long best_ns) {
+    printf("%-6s %8.1f Mpx/s %6.1f ns/px\n", name, NUM_CMDS / (best_ns / 1e3), (double)best_ns / NUM_CMDS);
+}
+
+int main(int argc, char **argv) {
+    int port = 1337;
+    const char *path = NULL;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--port") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--unix") == 0) {
+            path = argv[i + 1];
+        } else {
+            printf("usage: %s [--port n] [--unix path]\n", argv[0]);
+            return 1;
+        }
+    }
+    unsigned char *cmds = make_stream();
+    printf("%d PRINT commands, best of %d\n", NUM_CMDS, ROUNDS);
+
+    unsigned long long best = ~0ULL;
+    int fd = connect_tcp(port);
+    for (int i = 0; i < ROUNDS; i++) {
+        unsigned long long ns = run_socket(fd, cmds);
+        best = ns < best ? ns : best;
+    }
+    close(fd);
+    report("tcp", best);
+    if (path == NULL) {
+        return 0;
+    }
+
+    best = ~0ULL;
+    fd = connect_unix(path);
+    for (int i = 0; i < ROUNDS; i++) {
+        unsigned long long ns = run_socket(fd, cmds);
+        best = ns < best ? ns : best;
+    }
+    close(fd);
+    report("unix", best);
+
+    best = ~0ULL;
+    struct ring r;
+    ring_open(&r, connect_unix(path));
+    for (int i = 0; i < ROUNDS; i++) {
+        unsigned long long ns = run_ring(&r, cmds);
+        best = ns < best ? ns : best;
+    }
+    close(r.fd);
+    report("ring", best);
+    free(cmds);
+    return 0;
+}
@@ -1,23 +1,56 @@
+#define _GNU_SOURCE // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
-#include "param.h"
 #include "buffer.h"
 
-void buffer_init_malloc(struct buffer *b) {
+size_t buffer_round_capacity(size_t size) {
+    size_t capacity = sysconf(_SC_PAGESIZE);
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void buffer_map(struct buffer *b, int fd, off_t offset, unsigned char *addr, size_t capacity) {
+    if (mmap(addr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED
+            || mmap(addr + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        perror("mmap buffer");
+        exit(1); // TODO
+    }
     b->read_pos = b->write_pos = 0;
-    b->data = malloc(CONN_BUF_SIZE);
-    if (b->data == NULL) {
-        perror("malloc");
+    b->capacity = capacity;
+    b->data = addr;
+}
+
+void buffer_init(struct buffer *b, size_t capacity) {
+    int fd = memfd_create("pfs-buffer", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, capacity) != 0) {
+        perror("memfd");
+        exit(1); // TODO
+    }
+    // reserve the address range for both copies
+    unsigned char *p = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap buffer");
         exit(1); // TODO
     }
+    buffer_map(b, fd, 0, p, capacity);
+    close(fd); // the mappings keep the memory alive
 }
 
-void buffer_destroy_malloc(struct buffer *b) {
-    free(b->data);
-    b->data = NULL;
+void buffer_destroy(struct buffer *b) {
+    if (b->data != NULL) {
+        munmap(b->data, 2 * b->capacity);
+        b->data = NULL;
+    }
+}
+
+void buffer_clear(struct buffer *b) {
+    b->read_pos = b->write_pos = 0;
 }
 
 size_t buffer_size(const struct buffer *b) {
@@ -25,26 +58,16 @@ size_t buffer_size(const struct buffer *b) {
 }
 
 size_t buffer_write_space(const struct buffer *b) {
-    return CONN_BUF_SIZE - b->write_pos;
+    return b->capacity - buffer_size(b);
 }
 
-void buffer_move_front(struct buffer *b) {
-    if (b->read_pos > 0) {
-        size_t size = buffer_size(b);
-        memmove(b->data, &b->data[b->read_pos], size);
-        b->read_pos = 0;
-        b->write_pos = size;
-    }
-}
-
-int buffer_read_syscall(struct buffer *b, int fd) {
-    size_t size = buffer_size(b);
-    if (size == CONN_BUF_SIZE) {
+int buffer_read_syscall(struct buffer *b, int fd, size_t max) {
+    size_t space = buffer_write_space(b);
+    if (space == 0) {
         printf("don't call read when buffer full");
         exit(1); // TODO
     }
-    buffer_move_front(b);
-    int status = read(fd, &b->data[b->write_pos], buffer_write_space(b));
+    int status = read(fd, buffer_at(b, b->write_pos), space < max ? space : max);
     if (status > 0) {
         b->write_pos += status;
     }
@@ -57,18 +80,17 @@ int buffer_write_syscall(struct buffer *b, int fd) {
         printf("don't call write when buffer empty");
         exit(1); // TODO
     }
-    int status = write(fd, &b->data[b->read_pos], size);
+    int status = write(fd, buffer_at(b, b->read_pos), size);
     if (status > 0) {
         b->read_pos += status;
     }
-    buffer_move_front(b); // after because then we have less bytes to move
     return status;
 }
 
 const unsigned char *buffer_read_reserve(struct buffer *b, size_t size) {
     const unsigned char *p = NULL;
     if (buffer_size(b) >= size) {
-        p = &b->data[b->read_pos];
+        p = buffer_at(b, b->read_pos);
         b->read_pos += size;
     }
     return p;
@@ -77,7 +99,7 @@ const unsigned char *buffer_read_reserve(struct buffer *b, size_t size) {
 unsigned char *buffer_write_reserve(struct buffer *b, size_t size) {
     unsigned char *p = NULL;
     if (buffer_write_space(b) >= size) {
-        p = &b->data[b->write_pos];
+        p = buffer_at(b, b->write_pos);
         b->write_pos += size;
     }
     return p;
@@ -86,7 +108,7 @@ unsigned char *buffer_write_reserve(struct buffer *b, size_t size) {
 const unsigned char *buffer_read_peek(const struct buffer *b, size_t size) {
     const unsigned char *p = NULL;
     if (buffer_size(b) >= size) {
-        p = &b->data[b->read_pos];
+        p = buffer_at(b, b->read_pos);
     }
     return p;
 }
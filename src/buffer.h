@@ -1,21 +1,39 @@
 #ifndef PFS_BUFFER_H
 #define PFS_BUFFER_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
+// Ring buffer whose memory is mapped twice in a row ("magic ring"): data[i] and data[i + capacity] are the same
+// byte. Every range of up to capacity bytes starting anywhere in the ring is contiguous in memory, so reserve/peek
+// and read()/write() never have to care about wrapping around, and nothing is ever moved.
+// read_pos and write_pos only ever increase, the offset in data is pos & (capacity - 1).
 struct buffer {
     size_t read_pos;
     size_t write_pos;
-    unsigned char *data;
+    size_t capacity; // power of two and a multiple of the page size
+    unsigned char *data; // NULL if not initialized
 };
 
-void buffer_init_malloc(struct buffer *b);
-void buffer_destroy_malloc(struct buffer *b);
+// the capacity a buffer of at least size bytes gets
+size_t buffer_round_capacity(size_t size);
+void buffer_init(struct buffer *b, size_t capacity);
+void buffer_destroy(struct buffer *b);
+// maps capacity bytes of fd at offset twice to addr, which must be a reserved range of 2 * capacity bytes.
+// the memory belongs to the caller, such a buffer is not destroyed.
+void buffer_map(struct buffer *b, int fd, off_t offset, unsigned char *addr, size_t capacity);
+void buffer_clear(struct buffer *b);
 size_t buffer_size(const struct buffer *b);
 size_t buffer_write_space(const struct buffer *b);
-void buffer_move_front(struct buffer *b);
-int buffer_read_syscall(struct buffer *b, int fd);
+int buffer_read_syscall(struct buffer *b, int fd, size_t max); // reads at most max bytes
 int buffer_write_syscall(struct buffer *b, int fd);
 const unsigned char *buffer_read_reserve(struct buffer *b, size_t size);
 unsigned char *buffer_write_reserve(struct buffer *b, size_t size);
 const unsigned char *buffer_read_peek(const struct buffer *b, size_t size);
 
+// memory of the byte at position pos, contiguous for the following capacity bytes
+static inline unsigned char *buffer_at(const struct buffer *b, size_t pos) {
+    return &b->data[pos & (b->capacity - 1)];
+}
+
 #endif
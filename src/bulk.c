@@ -0,0 +1,198 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "param.h"
+#include "common.h"
+#include "canvas.h"
+#include "connection.h"
+#include "bulk.h"
+
+struct bulk_chunk {
+    unsigned char *data; // BULK_CHUNK_SIZE bytes
+    size_t size; // filled
+    size_t sent;
+    int zc_pending; // the kernel may still send from data
+    unsigned int zc_last; // number of the last zerocopy send from data
+};
+
+struct bulk_send {
+    struct bulk_chunk chunks[BULK_NUM_CHUNKS];
+    unsigned int next_fill; // chunks are filled and sent in turn
+    unsigned int next_send;
+    size_t unsent; // filled bytes of all chunks that were not sent yet
+    int zerocopy; // SO_ZEROCOPY is set on the socket
+    unsigned int zc_next; // the kernel numbers the zerocopy sends of a socket from 0
+    unsigned int zc_done; // all zerocopy sends before it completed
+};
+
+void bulk_begin(struct connection *c) {
+    if (c->bulk != NULL) {
+        return;
+    }
+    struct bulk_send *s = calloc(1, sizeof(*s));
+    // only the pages that are touched use memory, small canvases never fill a whole chunk
+    unsigned char *data = mmap(NULL, BULK_NUM_CHUNKS * BULK_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (s == NULL || data == MAP_FAILED) {
+        perror("bulk_begin");
+        exit(1); // TODO
+    }
+    for (size_t i = 0; i < BULK_NUM_CHUNKS; i++) {
+        s->chunks[i].data = data + i * BULK_CHUNK_SIZE;
+    }
+    int one = 1;
+    // not supported for unix sockets, their chunks are copied like without the option
+    s->zerocopy = params.zerocopy && c->local == NULL
+        && setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    c->bulk = s;
+}
+
+void bulk_free(struct bulk_send *s) {
+    if (s == NULL) {
+        return;
+    }
+    munmap(s->chunks[0].data, BULK_NUM_CHUNKS * BULK_CHUNK_SIZE); // the kernel holds its own references to the pages
+    free(s);
+}
+
+int bulk_busy(const struct bulk_send *s) {
+    return s->unsent > 0;
+}
+
+// takes the zerocopy completions that arrived on the error queue
+static void reap_completions(struct bulk_send *s, int fd) {
+    while (s->zc_done != s->zc_next) {
+        union {
+            struct cmsghdr align;
+            char data[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        } control;
+        struct msghdr msg = {0};
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            break; // EAGAIN: nothing more yet
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                struct sock_extended_err err;
+                memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+                if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY && err.ee_errno == 0) {
+                    s->zc_done = err.ee_data + 1; // ee_info..ee_data completed, tcp completes in order
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < BULK_NUM_CHUNKS; i++) {
+        struct bulk_chunk *k = &s->chunks[i];
+        if (k->zc_pending && (int)(s->zc_done - k->zc_last) > 0) {
+            k->zc_pending = 0;
+        }
+    }
+}
+
+int bulk_waiting(struct connection *c) {
+    struct bulk_send *s = c->bulk;
+    if (s == NULL || s->unsent > 0 || rect_iter_done(&c->multisend) || !s->chunks[s->next_fill].zc_pending) {
+        return 0;
+    }
+    reap_completions(s, c->fd);
+    return s->chunks[s->next_fill].zc_pending;
+}
+
+void bulk_fill(struct connection *c, struct metrics_counters *m) {
+    struct bulk_send *s = c->bulk;
+    while (!rect_iter_done(&c->multisend)) {
+        struct bulk_chunk *k = &s->chunks[s->next_fill];
+        if (k->zc_pending) {
+            reap_completions(s, c->fd);
+        }
+        if (k->sent < k->size || k->zc_pending) {
+            return; // all chunks are in use
+        }
+        k->size = k->sent = 0;
+        while (!rect_iter_done(&c->multisend) && k->size < BULK_CHUNK_SIZE) {
+            size_t n = rect_iter_row_left(&c->multisend);
+            if (n > (BULK_CHUNK_SIZE - k->size) / 4) {
+                n = (BULK_CHUNK_SIZE - k->size) / 4;
+            }
+            unsigned char *wp = k->data + k->size;
+            size_t inside = region_clip_span(&c->region, c->multisend.x, c->multisend.y, n);
+            canvas_get_span(c->region.x + c->multisend.x, c->region.y + c->multisend.y, inside, wp);
+            memset(wp + 4 * inside, 0, 4 * (n - inside));
+            rect_iter_advance(&c->multisend, n);
+            k->size += 4 * n;
+            m->pixels_read += n;
+        }
+        s->unsent += k->size;
+        m->bytes_out += k->size;
+        s->next_fill = (s->next_fill + 1) % BULK_NUM_CHUNKS;
+    }
+}
+
+int bulk_send(struct connection *c, struct metrics_counters *m) {
+    struct bulk_send *s = c->bulk;
+    struct iovec iov[1 + BULK_NUM_CHUNKS];
+    size_t n = 0;
+    // everything in the send buffer came before the response
+    size_t before = buffer_size(&c->sendbuf);
+    if (before > 0) {
+        iov[n].iov_base = buffer_at(&c->sendbuf, c->sendbuf.read_pos);
+        iov[n++].iov_len = before;
+    }
+    for (size_t i = 0; i < BULK_NUM_CHUNKS; i++) {
+        struct bulk_chunk *k = &s->chunks[(s->next_send + i) % BULK_NUM_CHUNKS];
+        if (k->sent == k->size) {
+            break;
+        }
+        iov[n].iov_base = k->data + k->sent;
+        iov[n++].iov_len = k->size - k->sent;
+    }
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    // the send buffer is reused right away, so it is never sent zerocopy
+    int zerocopy = s->zerocopy && before == 0;
+    ssize_t status = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+    if (status == -1 && zerocopy && errno == ENOBUFS) {
+        zerocopy = 0; // no socket memory left for the completion, copied instead
+        status = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    }
+    m->writes += 1;
+    if (IS_REAL_ERROR(status)) {
+        return CONNECTION_ERR;
+    } else if (WOULD_BLOCK(status)) {
+        c->writable = 0;
+        return CONNECTION_OK;
+    }
+    size_t done = status;
+    size_t from_buffer = done < before ? done : before;
+    c->sendbuf.read_pos += from_buffer;
+    done -= from_buffer;
+    s->unsent -= done;
+    unsigned int seq = s->zc_next;
+    if (zerocopy) {
+        s->zc_next += 1;
+    }
+    while (done > 0) {
+        struct bulk_chunk *k = &s->chunks[s->next_send];
+        size_t part = done < k->size - k->sent ? done : k->size - k->sent;
+        k->sent += part;
+        done -= part;
+        if (zerocopy) {
+            k->zc_pending = 1;
+            k->zc_last = seq;
+        }
+        if (k->sent == k->size) {
+            s->next_send = (s->next_send + 1) % BULK_NUM_CHUNKS;
+        }
+    }
+    return CONNECTION_OK;
+}
@@ -0,0 +1,39 @@
+#ifndef PFS_BULK_H
+#define PFS_BULK_H
+
+// Large RECTANGLE GET responses, only with the epoll backend. A rect of at least BULK_MIN_SIZE response bytes does
+// not go through the send buffer four bytes at a time: its rows are converted in bulk into BULK_NUM_CHUNKS output
+// buffers of the request, and every chunk is sent with writev() straight from there. A filled chunk is a snapshot
+// of its rows and never changes until it was sent, so a response of up to BULK_CHUNK_SIZE bytes (a full 512x512
+// canvas) shows the canvas at one point in time. Backpressure is per request: the next rows are only converted when
+// a chunk is free again, the rest of the rect waits in c->multisend.
+//
+// The response goes out behind what was in the send buffer when the command came, in the same writev(). Other
+// responses wait until the whole response was handed to the kernel.
+//
+// With params.zerocopy the chunks of a tcp connection are sent with MSG_ZEROCOPY: the kernel sends from the pages of
+// the chunk instead of copying them, so a chunk is only filled again once its completion arrived on the error queue
+// of the socket. Epoll reports that as EPOLLERR, which wakes the connection like any other event.
+
+#define BULK_MIN_SIZE (64 * 1024) // smaller responses go through the send buffer
+#define BULK_CHUNK_SIZE (1024 * 1024)
+#define BULK_NUM_CHUNKS 2
+
+struct connection;
+struct metrics_counters;
+struct bulk_send;
+
+// w x h pixels are requested, decode_rect put them into c->multisend
+void bulk_begin(struct connection *c);
+// frees the chunks, also while the kernel still sends from them
+void bulk_free(struct bulk_send *s);
+// some of the response was not handed to the kernel yet
+int bulk_busy(const struct bulk_send *s);
+// the response can't go on before a zerocopy completion arrives
+int bulk_waiting(struct connection *c);
+// converts the next rows of c->multisend into the free chunks
+void bulk_fill(struct connection *c, struct metrics_counters *m);
+// one writev() of the send buffer and the filled chunks, same contract as connection_send
+int bulk_send(struct connection *c, struct metrics_counters *m);
+
+#endif
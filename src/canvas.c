@@ -1,96 +1,444 @@
-// https://benedicthenshaw.com/soft_render_sdl2.html
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
-#include "SDL.h"
 
 #include "param.h"
 #include "common.h"
 #include "canvas.h"
+#include "span.h"
 
-SDL_Window *window;
-SDL_Renderer *renderer;
-SDL_Texture *screen_texture;
-unsigned int pixels[TEX_SIZE_X*TEX_SIZE_Y*4]; // TODO race condition when setting pixels?
+// The live canvas, written by all network workers concurrently. Every pixel is one aligned 32 bit word that is
+// only accessed with relaxed atomic loads/stores, so nobody ever sees or produces torn pixels (last writer wins).
+// Only used in DRAW_OVERWRITE mode.
+unsigned int *pixels;
 
-#define CLEANUP_AND_EXIT_IF(error_cond, prefix) do { \
-    if (error_cond) {                                \
-        printf("%s: %s\n", prefix, SDL_GetError());  \
-        canvas_stop();                               \
-        exit(1);                                     \
-    }                                                \
-} while (0)
+// The other draw modes keep the live canvas in accumulators instead, one array per channel so a frame resolves
+// them to RGBA8888 several pixels at a time (see span.h). Draws only touch the accumulators, the colors are only
+// computed for frames and reads.
+// - DRAW_AVERAGE: r/g/b are the sums of channel * weight, weight the sum of the weights. The weight is 255, or
+//   alpha for ALPHA RECTANGLE PRINT. Draws are plain read-modify-writes, not atomic adds: two workers drawing the
+//   same pixel at the same time may lose one of the draws, just like one of them loses in overwrite mode. A draw
+//   that brings the weight of a pixel to ACC_RENORM halves all four sums: the mean stays the same, the sums stay
+//   below 2^31 and older colors slowly fade out.
+// - DRAW_BLEND: r/g/b are the color with 8 fractional bits, so blending rounds less. weight is not used. Last
+//   writer wins, as in overwrite mode.
+static int draw_mode;
+static struct span_acc acc;
+#define ACC_RENORM (1U << 22)
+// The second buffer, owned by the frame thread. canvas_update_frame copies the changed tiles of the live canvas
+// in here, so the sinks never read memory that is being written.
+static unsigned int *frame_pixels;
 
-void canvas_stop(void) {
-    if (screen_texture) {
-        SDL_DestroyTexture(screen_texture);
-        screen_texture = NULL;
+// canvas size, copied from params in canvas_start
+static unsigned int width;
+static unsigned int height;
+static int width_shift; // log2(width) if width is a power of two, otherwise -1
+
+// Handoff between the workers and the frame thread: a writer sets the dirty flag of a tile with a release store
+// after storing the pixels. canvas_update_frame clears the flag with an acquire exchange before copying the tile,
+// so it sees at least every pixel written before the flag, and everything written later sets the flag again and
+// is copied in the next frame. Nobody ever waits for anybody.
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+static unsigned int tiles_x;
+static unsigned int tiles_y;
+static unsigned char *tile_dirty;
+
+static inline unsigned int tile_of(unsigned int x, unsigned int y) {
+    return (y >> TILE_SHIFT) * tiles_x + (x >> TILE_SHIFT);
+}
+
+static inline void tile_mark_dirty(unsigned int tile) {
+    __atomic_store_n(&tile_dirty[tile], 1, __ATOMIC_RELEASE);
+}
+
+// takes the dirty flag of a tile, returns whether it was set
+static inline int tile_take_dirty(unsigned int tile) {
+    return __atomic_load_n(&tile_dirty[tile], __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&tile_dirty[tile], 0, __ATOMIC_ACQUIRE);
+}
+
+static struct canvas_stats stats; // only touched by the frame thread
+static struct canvas_frame frame;
+static struct canvas_rect *frame_rects; // one per tile at most
+
+// a rectangle of tiles, end exclusive
+struct tile_rect {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int x1;
+    unsigned int y1;
+};
+
+static struct tile_rect *open_rects; // scratch space for canvas_update_frame, tiles_x each
+static struct tile_rect *next_rects;
+
+static void set_batch_pow2(const struct print_batch *b);
+static void set_batch_generic(const struct print_batch *b);
+static void (*set_batch_impl)(const struct print_batch *b);
+
+// n pixels of the accumulators starting at index -> RGBA8888
+static void resolve(unsigned int *dst, size_t index, size_t n) {
+    if (draw_mode == DRAW_AVERAGE) {
+        span_resolve_average(dst, &acc, index, n);
+    } else {
+        span_resolve_blend(dst, &acc, index, n);
     }
-    if (renderer) {
-        SDL_DestroyRenderer(renderer);
-        renderer = NULL;
+}
+
+// halves the sums of the pixels that reached ACC_RENORM, for the span kernels that only report the largest weight
+static void acc_renorm(size_t index, size_t n) {
+    unsigned int *accs[] = { acc.r, acc.g, acc.b, acc.weight };
+    for (size_t i = index; i < index + n; i++) {
+        if (__atomic_load_n(&acc.weight[i], __ATOMIC_RELAXED) < ACC_RENORM) {
+            continue;
+        }
+        for (int k = 0; k < 4; k++) {
+            unsigned int v = __atomic_load_n(&accs[k][i], __ATOMIC_RELAXED);
+            __atomic_store_n(&accs[k][i], v - v / 2, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline void acc_add(unsigned int *a, unsigned int v) {
+    __atomic_store_n(a, __atomic_load_n(a, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void blend_channel(unsigned int *acc, unsigned int c, unsigned int alpha) {
+    unsigned int old = __atomic_load_n(acc, __ATOMIC_RELAXED);
+    __atomic_store_n(acc, (old * (255 - alpha) + (c << 8) * alpha + 127) / 255, __ATOMIC_RELAXED);
+}
+
+// draws an RGBA8888 color with alpha 0..=255 into the accumulators
+static inline void acc_draw(size_t i, unsigned int color, unsigned int alpha) {
+    unsigned int r = color >> 24;
+    unsigned int g = (color >> 16) & 0xff;
+    unsigned int b = (color >> 8) & 0xff;
+    if (draw_mode == DRAW_AVERAGE) {
+        // the weight last, so a concurrent resolve rather sees a color without its weight than the other way round
+        acc_add(&acc.r[i], r * alpha);
+        acc_add(&acc.g[i], g * alpha);
+        acc_add(&acc.b[i], b * alpha);
+        acc_add(&acc.weight[i], alpha);
+        acc_renorm(i, 1);
+    } else if (alpha == 255) {
+        __atomic_store_n(&acc.r[i], r << 8, __ATOMIC_RELAXED);
+        __atomic_store_n(&acc.g[i], g << 8, __ATOMIC_RELAXED);
+        __atomic_store_n(&acc.b[i], b << 8, __ATOMIC_RELAXED);
+    } else {
+        blend_channel(&acc.r[i], r, alpha);
+        blend_channel(&acc.g[i], g, alpha);
+        blend_channel(&acc.b[i], b, alpha);
     }
-    if (window) {
-        SDL_DestroyWindow(window);
-        window = NULL;
+}
+
+// copies the rect from the live canvas into the frame buffer and adds it to the frame
+static void copy_rect(const struct tile_rect *t) {
+    unsigned int x0 = t->x0 * TILE_SIZE;
+    unsigned int y0 = t->y0 * TILE_SIZE;
+    unsigned int x1 = t->x1 * TILE_SIZE < width ? t->x1 * TILE_SIZE : width;
+    unsigned int y1 = t->y1 * TILE_SIZE < height ? t->y1 * TILE_SIZE : height;
+    for (unsigned int y = y0; y < y1; y++) {
+        if (draw_mode != DRAW_OVERWRITE) {
+            resolve(&frame_pixels[x0 + (size_t)width * y], x0 + (size_t)width * y, x1 - x0);
+            continue;
+        }
+        for (unsigned int x = x0; x < x1; x++) {
+            frame_pixels[x + width * y] = __atomic_load_n(&pixels[x + width * y], __ATOMIC_RELAXED);
+        }
     }
-    SDL_Quit();
+    frame_rects[frame.num_rects] = (struct canvas_rect){ .x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0 };
+    frame.num_rects += 1;
+    stats.rects += 1;
+    stats.bytes_copied += (unsigned long long)(x1 - x0) * (y1 - y0) * 4;
 }
 
-void canvas_draw(void) {
-    // ? SDL_RenderClear(renderer);
-    SDL_UpdateTexture(screen_texture, NULL, pixels, TEX_SIZE_X*4);
-    SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+static void *alloc_or_exit(size_t size) {
+    void *p = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (p == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(p, 0, size);
+    return p;
 }
 
 void canvas_start(void) {
-    int status = SDL_Init(SDL_INIT_VIDEO);
-    CLEANUP_AND_EXIT_IF(status != 0, "SDL_Init");
+    width = params.tex_size_x;
+    height = params.tex_size_y;
+    draw_mode = params.draw_mode;
+    width_shift = (width & (width - 1)) == 0 ? __builtin_ctz(width) : -1;
+    set_batch_impl = width_shift >= 0 ? set_batch_pow2 : set_batch_generic;
+    tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t num_pixels = (size_t)width * height;
+    if (draw_mode == DRAW_OVERWRITE) {
+        pixels = alloc_or_exit(num_pixels * sizeof(*pixels));
+    } else {
+        acc.r = alloc_or_exit(num_pixels * sizeof(*acc.r));
+        acc.g = alloc_or_exit(num_pixels * sizeof(*acc.g));
+        acc.b = alloc_or_exit(num_pixels * sizeof(*acc.b));
+        if (draw_mode == DRAW_AVERAGE) {
+            acc.weight = alloc_or_exit(num_pixels * sizeof(*acc.weight));
+        }
+    }
+    frame_pixels = alloc_or_exit((size_t)width * height * sizeof(*frame_pixels));
+    tile_dirty = alloc_or_exit((size_t)tiles_x * tiles_y);
+    frame_rects = alloc_or_exit((size_t)tiles_x * tiles_y * sizeof(*frame_rects));
+    open_rects = alloc_or_exit(tiles_x * sizeof(*open_rects));
+    next_rects = alloc_or_exit(tiles_x * sizeof(*next_rects));
 
-    window = SDL_CreateWindow("pixelflut",
-            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-            SCREEN_SIZE_X, SCREEN_SIZE_Y, 0);
-    CLEANUP_AND_EXIT_IF(window == NULL, "SDL_CreateWindow");
+    frame.pixels = frame_pixels;
+    frame.width = width;
+    frame.height = height;
+    frame.rects = frame_rects;
+    // the sinks start out with nothing, the first frame contains everything
+    for (unsigned int tile = 0; tile < tiles_x*tiles_y; tile++) {
+        tile_mark_dirty(tile);
+    }
+}
+
+void canvas_stop(void) {
+    free(pixels);
+    free(acc.r);
+    free(acc.g);
+    free(acc.b);
+    free(acc.weight);
+    free(frame_pixels);
+    free(tile_dirty);
+    free(frame_rects);
+    free(open_rects);
+    free(next_rects);
+    pixels = frame_pixels = NULL;
+    acc.r = acc.g = acc.b = acc.weight = NULL;
+    tile_dirty = NULL;
+    frame_rects = NULL;
+    open_rects = next_rects = NULL;
+}
+
+void canvas_restore(const unsigned int *src) {
+    if (draw_mode == DRAW_OVERWRITE) {
+        memcpy(pixels, src, (size_t)width * height * sizeof(*pixels));
+    } else {
+        // as if every pixel was drawn once
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            acc_draw(i, src[i], 255);
+        }
+    }
+    for (unsigned int tile = 0; tile < tiles_x*tiles_y; tile++) {
+        tile_mark_dirty(tile);
+    }
+}
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
-    CLEANUP_AND_EXIT_IF(renderer == NULL, "SDL_CreateRenderer");
-    
-    screen_texture = SDL_CreateTexture(renderer,
-            SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
-            TEX_SIZE_X, TEX_SIZE_Y);
-    CLEANUP_AND_EXIT_IF(screen_texture == NULL, "SDL_CreateTexture");
+const struct canvas_frame *canvas_update_frame(void) {
+    frame.num_rects = 0;
+    // Coalesce the dirty tiles into rectangles: every tile row is split into runs of dirty tiles, and a run
+    // that spans exactly the same columns as a rect ending in the row above extends that rect downwards.
+    // Rects that were not extended are complete and get copied.
+    struct tile_rect *open = open_rects; // rects ending in the previous tile row, sorted by x0
+    struct tile_rect *next = next_rects;
+    size_t num_open = 0;
+    for (unsigned int ty = 0; ty < tiles_y; ty++) {
+        size_t num_next = 0;
+        size_t o = 0;
+        unsigned int tx = 0;
+        while (tx < tiles_x) {
+            if (!tile_take_dirty(ty * tiles_x + tx)) {
+                tx += 1;
+                continue;
+            }
+            unsigned int start = tx;
+            for (tx += 1; tx < tiles_x && tile_take_dirty(ty * tiles_x + tx); tx++) {
+            }
+            // rects of the row above that start left of this run can't be extended anymore
+            for (; o < num_open && open[o].x0 < start; o++) {
+                copy_rect(&open[o]);
+            }
+            if (o < num_open && open[o].x0 == start && open[o].x1 == tx) {
+                next[num_next] = open[o++];
+                next[num_next].y1 = ty + 1;
+            } else {
+                next[num_next] = (struct tile_rect){ .x0 = start, .y0 = ty, .x1 = tx, .y1 = ty + 1 };
+            }
+            num_next += 1;
+        }
+        for (; o < num_open; o++) {
+            copy_rect(&open[o]);
+        }
+        struct tile_rect *tmp = open;
+        open = next;
+        next = tmp;
+        num_open = num_next;
+    }
+    for (size_t o = 0; o < num_open; o++) {
+        copy_rect(&open[o]);
+    }
+    stats.frames += 1;
+    return &frame;
 }
 
 int canvas_set_px(const struct pixel *px) {
-    if (px->x >= TEX_SIZE_X || px->y >= TEX_SIZE_Y)
+    if (px->x >= width || px->y >= height)
         return 0;
-    unsigned int index = px->x + TEX_SIZE_X * px->y;
-    pixels[index] = (px->r << 24) | (px->g << 16) | (px->b << 8) | 0xff;
+    unsigned int index = px->x + width * px->y;
+    unsigned int value = (px->r << 24) | (px->g << 16) | (px->b << 8) | 0xff;
+    if (draw_mode == DRAW_OVERWRITE) {
+        __atomic_store_n(&pixels[index], value, __ATOMIC_RELAXED);
+    } else {
+        acc_draw(index, value, 255);
+    }
+    tile_mark_dirty(tile_of(px->x, px->y));
     return 1;
 }
 
+// pixels of the batch are already bounds-checked and packed by the decoder, see decode.h.
+// pow2 is a constant in both callers, so the power-of-two version maps indices to tiles with shifts instead of
+// a division.
+static inline __attribute__((always_inline)) void set_batch(const struct print_batch *b, int pow2) {
+    // the alpha byte is 0xff except for text draws with alpha (see text.h), overwrite ignores it
+    if (draw_mode == DRAW_OVERWRITE) {
+        for (size_t i = 0; i < b->n; i++) {
+            __atomic_store_n(&pixels[b->index[i]], b->color[i] | 0xff, __ATOMIC_RELAXED);
+        }
+    } else {
+        for (size_t i = 0; i < b->n; i++) {
+            acc_draw(b->index[i], b->color[i], b->color[i] & 0xff);
+        }
+    }
+    // all flags after all pixels, so every release store covers the whole batch
+    unsigned int last_tile = -1;
+    for (size_t i = 0; i < b->n; i++) {
+        unsigned int index = b->index[i];
+        unsigned int x = pow2 ? index & (width - 1) : index % width;
+        unsigned int y = pow2 ? index >> width_shift : index / width;
+        unsigned int tile = tile_of(x, y);
+        if (tile != last_tile) {
+            tile_mark_dirty(tile);
+            last_tile = tile;
+        }
+    }
+}
+
+static void set_batch_pow2(const struct print_batch *b) {
+    set_batch(b, 1);
+}
+
+static void set_batch_generic(const struct print_batch *b) {
+    set_batch(b, 0);
+}
+
+void canvas_set_batch(const struct print_batch *b) {
+    set_batch_impl(b);
+}
+
 int canvas_get_px(struct pixel *px) {
-    if (px->x >= TEX_SIZE_X || px->y >= TEX_SIZE_Y) {
+    if (px->x >= width || px->y >= height) {
         px->r = 0;
         px->g = 0;
         px->b = 0;
         return 0;
     }
-    unsigned int index = px->x + TEX_SIZE_X * px->y;
-    px->r = (pixels[index] >> 24) & 0xff;
-    px->g = (pixels[index] >> 16) & 0xff;
-    px->b = (pixels[index] >>  8) & 0xff;
+    unsigned int index = px->x + width * px->y;
+    unsigned int value;
+    if (draw_mode == DRAW_OVERWRITE) {
+        value = __atomic_load_n(&pixels[index], __ATOMIC_RELAXED);
+    } else {
+        resolve(&value, index, 1);
+    }
+    px->r = (value >> 24) & 0xff;
+    px->g = (value >> 16) & 0xff;
+    px->b = (value >>  8) & 0xff;
     return 1;
 }
 
-int canvas_should_quit(void) {
-    SDL_Event e;
+// the part of a span of row y that is inside the canvas, returns its length
+static inline size_t clip_span(unsigned int x, unsigned int y, size_t n) {
+    if (y >= height || x >= width) {
+        return 0;
+    }
+    return n < width - x ? n : width - x;
+}
+
+// after the pixels of the span
+static inline void mark_span_dirty(unsigned int x, unsigned int y, size_t n) {
+    unsigned int last = tile_of(x + n - 1, y);
+    for (unsigned int tile = tile_of(x, y); tile <= last; tile++) {
+        tile_mark_dirty(tile);
+    }
+}
+
+size_t canvas_fill_span(unsigned int x, unsigned int y, size_t n, unsigned int color) {
+    n = clip_span(x, y, n);
+    if (n == 0) {
+        return 0;
+    }
+    size_t index = x + (size_t)width * y;
+    if (draw_mode == DRAW_OVERWRITE) {
+        span_fill(&pixels[index], color, n);
+    } else if (draw_mode == DRAW_BLEND) {
+        // opaque, same as acc_draw with alpha 255
+        span_fill(&acc.r[index], (color >> 24) << 8, n);
+        span_fill(&acc.g[index], ((color >> 16) & 0xff) << 8, n);
+        span_fill(&acc.b[index], color & 0xff00, n);
+    } else if (span_average_fill(&acc, index, color, n) >= ACC_RENORM) {
+        acc_renorm(index, n);
+    }
+    mark_span_dirty(x, y, n);
+    return n;
+}
+
+// alpha: whether the 4th byte of the colors is alpha (otherwise it is ignored)
+static inline size_t print_span(unsigned int x, unsigned int y, size_t n, const unsigned char *src, int alpha) {
+    n = clip_span(x, y, n);
+    if (n == 0) {
+        return 0;
+    }
+    size_t index = x + (size_t)width * y;
+    if (draw_mode == DRAW_OVERWRITE) {
+        span_convert(&pixels[index], src, n);
+    } else if (draw_mode == DRAW_AVERAGE) {
+        if (span_average_print(&acc, index, src, alpha, n) >= ACC_RENORM) {
+            acc_renorm(index, n);
+        }
+    } else if (!alpha) {
+        span_blend_print(&acc, index, src, n);
+    } else {
+        for (size_t i = 0; i < n; i++, src += 4) {
+            acc_draw(index + i, (src[0] << 24) | (src[1] << 16) | (src[2] << 8) | 0xff, src[3]);
+        }
+    }
+    mark_span_dirty(x, y, n);
+    return n;
+}
+
+size_t canvas_print_span(unsigned int x, unsigned int y, size_t n, const unsigned char *src) {
+    return print_span(x, y, n, src, 0);
+}
 
-    while (SDL_PollEvent(&e) != 0) {
-        if (e.type == SDL_QUIT)
-            return 1;
+size_t canvas_print_alpha_span(unsigned int x, unsigned int y, size_t n, const unsigned char *src) {
+    return print_span(x, y, n, src, 1);
+}
+
+void canvas_get_span(unsigned int x, unsigned int y, size_t n, unsigned char *dst) {
+    size_t inside = clip_span(x, y, n);
+    size_t index = x + (size_t)width * y;
+    if (draw_mode == DRAW_OVERWRITE) {
+        if (inside > 0) {
+            span_encode(dst, &pixels[index], inside);
+        }
+    } else {
+        unsigned int colors[256];
+        for (size_t done = 0; done < inside; ) {
+            size_t chunk = inside - done < 256 ? inside - done : 256;
+            resolve(colors, index + done, chunk);
+            span_encode(dst + 4 * done, colors, chunk);
+            done += chunk;
+        }
     }
-    return 0;
+    memset(dst + 4 * inside, 0, 4 * (n - inside));
+}
+
+void canvas_get_stats(struct canvas_stats *s) {
+    *s = stats;
 }
@@ -1,13 +1,57 @@
 #ifndef PFS_CANVAS_H
 #define PFS_CANVAS_H
 
+#include <stddef.h>
 #include "common.h"
+#include "decode.h"
+
+// The pixel store. Network workers write and read pixels concurrently, the frame thread periodically takes a
+// consistent copy of the changed parts for the sinks (see sink.h).
+
+// how a drawn color is combined with the pixel, params.draw_mode
+#define DRAW_OVERWRITE 0 // replaces it, alpha is ignored
+#define DRAW_AVERAGE 1 // every pixel shows the mean of all colors drawn to it, weighted by alpha
+#define DRAW_BLEND 2 // alpha blending over the current color
+
+// counters of canvas_update_frame, since canvas_start
+struct canvas_stats {
+    unsigned long long frames;
+    unsigned long long rects; // copied rectangles
+    unsigned long long bytes_copied;
+};
+
+struct canvas_rect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+};
+
+struct canvas_frame {
+    const unsigned int *pixels; // RGBA8888, row stride is width. Only changes inside canvas_update_frame.
+    unsigned int width;
+    unsigned int height;
+    const struct canvas_rect *rects; // parts of pixels that changed since the last frame
+    size_t num_rects;
+};
 
 void canvas_start(void);
 void canvas_stop(void);
-void canvas_draw(void);
+// replaces the whole canvas with width * height pixels, before the network starts
+void canvas_restore(const unsigned int *src);
 int canvas_set_px(const struct pixel *px);
 int canvas_get_px(struct pixel *px);
-int canvas_should_quit(void);
+void canvas_set_batch(const struct print_batch *b);
+// Spans of n pixels in row y starting at x, for the rectangle commands. Pixels outside the canvas are skipped.
+// fill and print return the number of pixels inside the canvas, print takes n colors as r g b x.
+size_t canvas_fill_span(unsigned int x, unsigned int y, size_t n, unsigned int color);
+size_t canvas_print_span(unsigned int x, unsigned int y, size_t n, const unsigned char *src);
+// same with colors as r g b a
+size_t canvas_print_alpha_span(unsigned int x, unsigned int y, size_t n, const unsigned char *src);
+// encodes n pixels in the GET response format, pixels outside the canvas are 0 0 0 0
+void canvas_get_span(unsigned int x, unsigned int y, size_t n, unsigned char *dst);
+// only from the frame thread
+const struct canvas_frame *canvas_update_frame(void);
+void canvas_get_stats(struct canvas_stats *s);
 
 #endif
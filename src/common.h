@@ -1,6 +1,8 @@
 #ifndef PFS_COMMON_H
 #define PFS_COMMON_H
 
+#include <time.h>
+
 struct pixel {
     unsigned int x;
     unsigned int y;
@@ -12,4 +14,18 @@ struct pixel {
 #define WOULD_BLOCK(ret) ((ret) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
 #define IS_REAL_ERROR(ret) ((ret) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
 
+// monotonic time in microseconds
+static inline unsigned long long clock_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// monotonic time in nanoseconds, for measuring short things
+static inline unsigned long long clock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 #endif
@@ -7,12 +7,17 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
-#include "SDL.h" // only used for timing here
 
 #include "param.h"
 #include "common.h"
 #include "canvas.h"
+#include "decode.h"
+#include "text.h"
 #include "connection.h"
+#include "uring.h"
+#include "local.h"
+#include "bulk.h"
+#include "sched.h"
 
 void set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -37,6 +42,20 @@ void connection_tracker_print(const struct connection_tracker *t) {
     printf("  ip: %d.%d.%d.%d,\n", t->addr & 0xff, (t->addr >> 8) & 0xff, (t->addr >> 16) & 0xff, (t->addr >> 24) & 0xff);
     printf("  start_time: %lld,\n", t->start_time);
     printf("  end_time: %lld,\n", t->end_time);
+    unsigned long long duration = t->end_time > t->start_time ? t->end_time - t->start_time : 1;
+    const struct metrics_counters *m = &t->counters;
+    printf("  pixels: %llu (%llu/s),\n", m->pixels_drawn, m->pixels_drawn * 1000 / duration);
+    printf("  pixels_read: %llu,\n", m->pixels_read);
+    printf("  bytes_in: %llu (%llu/s),\n", m->bytes_in, m->bytes_in * 1000 / duration);
+    printf("  bytes_out: %llu,\n", m->bytes_out);
+    unsigned long long commands = 0;
+    for (size_t i = 0; i < METRICS_NUM_OPCODES; i++) {
+        commands += m->commands[i];
+    }
+    printf("  commands: %llu,\n", commands);
+    printf("  syscalls: %llu read, %llu write,\n", m->reads, m->writes);
+    printf("  throttled: %llu quota, %llu sendbuf,\n", m->throttles[METRICS_THROTTLE_QUOTA],
+            m->throttles[METRICS_THROTTLE_SENDBUF]);
     printf("}\n");
 
 }
@@ -49,42 +68,90 @@ int rect_iter_done(const struct rect_iter *r) {
     return r->y == r->ystop || r->xstart == r->xstop;
 }
 
-void rect_iter_advance(struct rect_iter *r) {
-    if (rect_iter_done(r)) {
+size_t rect_iter_row_left(const struct rect_iter *r) {
+    return r->xstop - r->x;
+}
+
+void rect_iter_advance(struct rect_iter *r, size_t n) {
+    if (rect_iter_done(r) || n > rect_iter_row_left(r)) {
         printf("WARNING: rect_iter_advance called on finished iter\n");
         return; // TODO panic?
     }
-    r->x += 1;
+    r->x += n;
     if (r->x == r->xstop) {
         r->x = r->xstart;
         r->y += 1;
     }
 }
 
+void rect_iter_clip(struct rect_iter *r, int width, int height) {
+    if (r->xstop > width) {
+        r->xstop = width;
+    }
+    if (r->ystop > height) {
+        r->ystop = height;
+    }
+    if (r->x >= r->xstop || r->y >= r->ystop) {
+        r->xstop = r->xstart; // done
+    }
+}
+
 void connection_print(const struct connection *c) {
-    in_addr_t a = c->addr.sin_addr.s_addr;
+    in_addr_t a = c->cold->addr.sin_addr.s_addr;
     printf("Connection { ip: %d.%d.%d.%d }\n", a & 0xff, (a >> 8) & 0xff, (a >> 16) & 0xff, (a >> 24) & 0xff);
 }
 
 void connection_init(struct connection *c, int connfd, struct sockaddr_in connaddr) {
     set_nonblocking(connfd);
     c->fd = connfd;
-    c->addr = connaddr;
-    connection_tracker_init(&c->tracker, connaddr.sin_addr.s_addr, SDL_GetTicks64());
+    c->readable = 1; // data may have arrived before the socket was added to epoll
+    c->writable = 1;
+    c->scheduled = 1;
+    c->throttled = 0;
+    c->uring = NULL;
+    c->local = NULL;
+    c->cold->addr = connaddr;
+    unsigned long long now = clock_now_us();
+    connection_tracker_init(&c->cold->tracker, connaddr.sin_addr.s_addr, now / 1000);
+    sched_init(&c->sched, connaddr.sin_addr.s_addr, now);
+    c->region = region_get(connaddr.sin_addr.s_addr);
+    c->protocol = PROTOCOL_UNKNOWN;
+    c->text_offset_x = 0;
+    c->text_offset_y = 0;
     rect_iter_init(&c->multirecv);
     rect_iter_init(&c->multisend);
-    buffer_init_malloc(&c->recvbuf);
-    buffer_init_malloc(&c->sendbuf);
+    rect_iter_init(&c->multiexec);
+    c->multisend_bulk = 0;
+    c->bulk = NULL;
+    c->program = NULL;
+    c->packed_left = 0;
+    c->palette = NULL;
+    c->palette_left = 0;
+    buffer_clear(&c->recvbuf);
+    buffer_clear(&c->sendbuf);
 }
 
-void connection_close(struct connection *c) {
-    buffer_destroy_malloc(&c->recvbuf);
-    buffer_destroy_malloc(&c->sendbuf);
-    c->tracker.end_time = SDL_GetTicks64(); // TODO use OS functionality
-    connection_tracker_print(&c->tracker);
+int connection_close(struct connection *c) {
+    int busy = 0;
+    if (c->uring != NULL) {
+        busy = uring_conn_close(c);
+    }
+    if (c->local != NULL) {
+        local_conn_close(c);
+    }
+    sched_destroy(&c->sched);
+    program_state_free(c->program);
+    c->program = NULL;
+    free(c->palette);
+    c->palette = NULL;
+    bulk_free(c->bulk);
+    c->bulk = NULL;
+    c->cold->tracker.end_time = clock_now_us() / 1000;
+    connection_tracker_print(&c->cold->tracker);
 
     close(c->fd);
     c->fd = -1; // extra security
+    return busy;
 }
 
 static void decode_rect(struct rect_iter *r, const unsigned char *rp) {
@@ -98,20 +165,6 @@ static void decode_rect(struct rect_iter *r, const unsigned char *rp) {
     r->ystop = r->ystart + h;
 }
 
-static void decode_pixel(struct pixel *px, const unsigned char *rp) {
-    px->x = rp[1] | (rp[2] << 8);
-    px->y = rp[3] | (rp[4] << 8);
-    px->r = rp[5];
-    px->g = rp[6];
-    px->b = rp[7];
-}
-
-static void decode_color(struct pixel *px, const unsigned char *rp) {
-    px->r = rp[0];
-    px->g = rp[1];
-    px->b = rp[2];
-}
-
 #define ENCODE_LE32(value, ptr) do { \
     (ptr)[0] = (value) & 0xff; \
     (ptr)[1] = ((value) >> 8) & 0xff; \
@@ -119,14 +172,50 @@ static void decode_color(struct pixel *px, const unsigned char *rp) {
     (ptr)[3] = ((value) >> 24) & 0xff; \
 } while (0)
 
-static void encode_info(unsigned char *wp) {
-    ENCODE_LE32(TEX_SIZE_X, wp);
-    ENCODE_LE32(TEX_SIZE_Y, wp + 4);
-    ENCODE_LE32(CONN_BUF_SIZE, wp + 8);
-    ENCODE_LE32(CONN_BUF_SIZE, wp + 12);
+// the canvas size is the size of the client's region
+static void encode_info(const struct region *r, unsigned char *wp) {
+    ENCODE_LE32(r->w, wp);
+    ENCODE_LE32(r->h, wp + 4);
+    ENCODE_LE32(params.recv_buf_size, wp + 8);
+    ENCODE_LE32(params.send_buf_size, wp + 12);
+}
+
+// second half of the version 1 INFO response, see README
+#define INFO_MAGIC 0x58534650 // "PFSX", can't be a screen width
+#define INFO_CAP_ALPHA_RECT (1 << 0)
+#define INFO_CAP_PROGRAM (1 << 1)
+#define INFO_CAP_KERNEL (1 << 2)
+#define INFO_CAP_BATCH_PRINT (1 << 3)
+#define INFO_CAP_PALETTE_PRINT (1 << 4)
+#define INFO_CAP_SPLIT_SCREEN (1 << 5)
+#define INFO_CAP_UDP (1 << 6)
+#define INFO_CAP_UNIX_SOCKET (1 << 7)
+static void encode_info_ext(unsigned char *wp) {
+    unsigned int caps = INFO_CAP_ALPHA_RECT | INFO_CAP_PROGRAM | INFO_CAP_KERNEL | INFO_CAP_BATCH_PRINT
+        | INFO_CAP_PALETTE_PRINT;
+    if (region_config.split_screen != 0 || region_config.num_fixed != 0) {
+        caps |= INFO_CAP_SPLIT_SCREEN;
+    }
+    if (params.udp_port != 0) {
+        caps |= INFO_CAP_UDP;
+    }
+    if (params.unix_socket_path != NULL) {
+        caps |= INFO_CAP_UNIX_SOCKET;
+    }
+    ENCODE_LE32(INFO_MAGIC, wp);
+    ENCODE_LE32(caps, wp + 4);
+    ENCODE_LE32(params.draw_mode, wp + 8);
+    ENCODE_LE32(params.udp_port, wp + 12);
 }
 
-static void get_and_encode_color(struct pixel *px, unsigned char *wp) {
+// px in region coordinates
+static void get_and_encode_color(const struct region *r, struct pixel *px, unsigned char *wp) {
+    if (region_clip_span(r, px->x, px->y, 1) == 0) {
+        memset(wp, 0, 4); // same as outside the canvas
+        return;
+    }
+    px->x += r->x;
+    px->y += r->y;
     int inside_canvas = canvas_get_px(px);
     wp[0] = px->r;
     wp[1] = px->g;
@@ -134,130 +223,467 @@ static void get_and_encode_color(struct pixel *px, unsigned char *wp) {
     wp[3] = inside_canvas;
 }
 
-static int connection_send(struct connection *c) {
-    if (buffer_size(&c->sendbuf) > 0) {
+static int connection_send(struct connection *c, struct metrics_counters *m) {
+    if (c->uring != NULL) {
+        return c->writable ? uring_send(c) : CONNECTION_OK;
+    }
+    if (c->bulk != NULL && bulk_busy(c->bulk)) {
+        return c->writable ? bulk_send(c, m) : CONNECTION_OK;
+    }
+    if (c->writable && buffer_size(&c->sendbuf) > 0) {
         int status = buffer_write_syscall(&c->sendbuf, c->fd);
+        m->writes += 1;
         if (IS_REAL_ERROR(status)) {
             return CONNECTION_ERR;
+        } else if (WOULD_BLOCK(status)) {
+            c->writable = 0;
         }
     }
     return CONNECTION_OK;
 }
 
+// receives at most the rest of the byte budget
+static int connection_recv(struct connection *c, struct step_budget *b, struct metrics_counters *m) {
+    size_t max = b->bytes - b->used_bytes;
+    if (c->uring != NULL) {
+        size_t before = buffer_size(&c->recvbuf);
+        int status = uring_recv(c, max);
+        b->used_bytes += buffer_size(&c->recvbuf) - before;
+        return status;
+    }
+    int status;
+    if (c->local != NULL) {
+        status = local_recv(c, max, &m->reads);
+    } else {
+        status = buffer_read_syscall(&c->recvbuf, c->fd, max);
+        m->reads += 1;
+    }
+    if (IS_REAL_ERROR(status)) {
+        return CONNECTION_ERR;
+    } else if (status == 0) {
+        return CONNECTION_END;
+    } else if (WOULD_BLOCK(status)) {
+        c->readable = 0;
+    } else {
+        b->used_bytes += status;
+    }
+    return CONNECTION_OK;
+}
+
+// can another read happen in this step?
+static int connection_can_recv(const struct connection *c, const struct step_budget *b) {
+    return c->readable && b->used_bytes < b->bytes;
+}
+
+// why connection_step stopped
+#define PAUSE_LIMIT 0 // per-round limit reached
+#define PAUSE_RECV 1 // no complete command in the receive buffer
+#define PAUSE_SEND 2 // response does not fit into the send buffer
+
+// flush the send buffer and decide whether the connection has to be stepped again without a new epoll event.
+static int connection_pause(struct connection *c, struct metrics_counters *m, int reason) {
+    if (reason == PAUSE_SEND) {
+        m->throttles[METRICS_THROTTLE_SENDBUF] += 1;
+    }
+    if (connection_send(c, m) == CONNECTION_ERR) {
+        return CONNECTION_ERR;
+    }
+    if (reason == PAUSE_LIMIT || (reason == PAUSE_RECV && c->readable)) {
+        return CONNECTION_YIELD;
+    }
+    if (c->multisend_bulk && bulk_waiting(c)) {
+        return CONNECTION_OK; // the completion comes with an epoll event
+    }
+    if (c->writable && (reason == PAUSE_SEND || buffer_size(&c->sendbuf) > 0 || !rect_iter_done(&c->multisend)
+                || (c->bulk != NULL && bulk_busy(c->bulk)))) {
+        return CONNECTION_YIELD;
+    }
+    return CONNECTION_OK;
+}
+
+// a part of the step budget is used up. if that happened because the buckets are empty (and not because of the
+// per-step maximum), connection_step puts the connection to sleep.
+static int connection_limit(struct connection *c, struct step_budget *b, struct metrics_counters *m, int limited) {
+    if (limited) {
+        b->quota_hit = 1;
+    }
+    return connection_pause(c, m, PAUSE_LIMIT);
+}
+
+// the receive buffer is empty: either the socket is drained or the byte budget is used up
+static int connection_starved(struct connection *c, struct step_budget *b, struct metrics_counters *m) {
+    if (c->readable && b->used_bytes == b->bytes) {
+        return connection_limit(c, b, m, b->bytes_limited);
+    }
+    return connection_pause(c, m, PAUSE_RECV);
+}
+
 /* In each iteration, the client is allowed
- * - up to 1 read() syscall. To maximize efficiency, it always happens as late as possible (and only if needed).
+ * - read() syscalls up to its byte budget. To maximize efficiency, they always happen as late as possible (and only if needed).
+ *   They are skipped entirely if epoll did not report the socket as readable.
  * - up to 1 write() syscall. This happens at the end. The send buffer should be filled as much as possible.
- * - up to 1 drawn pixel.
+ *   It is skipped entirely if epoll did not report the socket as writable.
+ * - drawn pixels up to its pixel budget. Runs of PRINT commands are decoded in bulk (see decode.h).
+ * The budget is taken from the connection's token buckets, see sched.h.
+ * Returns CONNECTION_YIELD if the connection should be stepped again in the next round, CONNECTION_OK if it
+ * has to wait for the next readiness event.
  */
 
-#define DRAW_LIMIT 1
-#define READ_LIMIT 1
+// the text protocol (see text.h) under the same budget rules. Every command is a line, runs of draws are decoded in
+// bulk like binary PRINT runs.
+static int connection_step_text(struct connection *c, struct step_budget *b, struct metrics_counters *m) {
+    struct print_area area = { c->region.w, c->region.h, params.tex_size_x,
+        c->region.x + params.tex_size_x * c->region.y };
+    struct print_batch batch;
+    struct text_cmd cmd;
+    struct pixel px;
+    unsigned char response[TEXT_MAX_RESPONSE];
+    size_t size;
+    int status;
+    while (1) {
+        const unsigned char *rp = buffer_at(&c->recvbuf, c->recvbuf.read_pos);
+        text_parse(rp, buffer_size(&c->recvbuf), &cmd);
+        if (cmd.type == TEXT_INCOMPLETE && connection_can_recv(c, b)) {
+            if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                return status;
+            }
+            continue;
+        }
+        if (cmd.type == TEXT_INCOMPLETE) {
+            return connection_starved(c, b, m);
+        } else if (cmd.type == TEXT_INVALID) {
+            m->commands[0] += 1;
+            return CONNECTION_ERR;
+        } else if (cmd.type == TEXT_PX_SET) {
+            if (b->used_pixels == b->pixels) {
+                return connection_limit(c, b, m, b->pixels_limited);
+            }
+            size_t n = text_print_run(rp, buffer_size(&c->recvbuf), b->pixels - b->used_pixels, c->text_offset_x,
+                    c->text_offset_y, &area, &batch, &size);
+            if (n == 0) {
+                // the line parses differently the second time: the client rewrote it in its ring (see local.h)
+                return CONNECTION_ERR;
+            }
+            canvas_set_batch(&batch);
+            b->used_pixels += n;
+            m->commands[metrics_opcode_index['P']] += n;
+            buffer_read_reserve(&c->recvbuf, size);
+            continue;
+        } else if (cmd.type == TEXT_PX_GET) {
+            if (buffer_write_space(&c->sendbuf) < TEXT_MAX_RESPONSE) {
+                return connection_pause(c, m, PAUSE_SEND);
+            }
+            px.x = cmd.x + c->text_offset_x;
+            px.y = cmd.y + c->text_offset_y;
+            get_and_encode_color(&c->region, &px, response);
+            size = text_format_px(response, cmd.x, cmd.y, response[0], response[1], response[2]);
+            memcpy(buffer_write_reserve(&c->sendbuf, size), response, size);
+            m->pixels_read += 1;
+            m->commands[metrics_opcode_index['G']] += 1;
+        } else if (cmd.type == TEXT_SIZE || cmd.type == TEXT_HELP) {
+            size = cmd.type == TEXT_SIZE ? text_format_size(response, c->region.w, c->region.h)
+                : strlen(TEXT_HELP_RESPONSE);
+            if (buffer_write_space(&c->sendbuf) < size) {
+                return connection_pause(c, m, PAUSE_SEND);
+            }
+            memcpy(buffer_write_reserve(&c->sendbuf, size), cmd.type == TEXT_SIZE ? (const void *)response
+                    : (const void *)TEXT_HELP_RESPONSE, size);
+            m->commands[metrics_opcode_index['I']] += 1; // like INFO
+        } else if (cmd.type == TEXT_OFFSET) {
+            c->text_offset_x = cmd.x;
+            c->text_offset_y = cmd.y;
+            m->commands[metrics_opcode_index['I']] += 1; // no binary counterpart, it is as cheap as INFO
+        }
+        buffer_read_reserve(&c->recvbuf, cmd.length);
+    }
+}
 
 // TODO perhaps a byte-stream oriented buffer interface? Probably less efficient, though.
-int connection_step(struct connection *c) {
+static int connection_step_budget(struct connection *c, struct step_budget *b, struct metrics_counters *m) {
     unsigned char *wp;
     const unsigned char *rp;
+    unsigned char cmd[8]; // the command of a ring connection, see below
     struct pixel px;
-    int have_read = 0;
-    int have_drawn = 0;
+    struct print_batch batch;
     int multisend_done; // this is extra protection against another command trying to pack its response in the middle of a multisend sequence
                         // doesn't happen as long as we don't have responses < 4 bytes.
     int status;
+    // the first bytes decide the protocol once, see text.h
+    if (c->protocol == PROTOCOL_UNKNOWN) {
+        int text;
+        while ((text = text_sniff(buffer_at(&c->recvbuf, c->recvbuf.read_pos), buffer_size(&c->recvbuf))) == -1
+                && connection_can_recv(c, b)) {
+            if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                return status;
+            }
+        }
+        if (text == -1) {
+            return connection_starved(c, b, m);
+        }
+        c->protocol = text ? PROTOCOL_TEXT : PROTOCOL_BINARY;
+    }
+    if (c->protocol == PROTOCOL_TEXT) {
+        return connection_step_text(c, b, m);
+    }
     // while loop here because we might go through several multirecvs/multisends in one connection_step
     while (1) {
-        // 1. handle multi send as far as possible
-        while (!rect_iter_done(&c->multisend) && (wp = buffer_write_reserve(&c->sendbuf, 4)) != NULL) {
-            px.x = c->multisend.x;
-            px.y = c->multisend.y;
-            rect_iter_advance(&c->multisend);
-            get_and_encode_color(&px, wp);
+        // 1. handle multi send as far as possible, row by row
+        if (c->multisend_bulk && !rect_iter_done(&c->multisend)) {
+            bulk_fill(c, m);
+        }
+        while (!c->multisend_bulk && !rect_iter_done(&c->multisend) && buffer_write_space(&c->sendbuf) >= 4) {
+            size_t n = rect_iter_row_left(&c->multisend);
+            if (n > buffer_write_space(&c->sendbuf) / 4) {
+                n = buffer_write_space(&c->sendbuf) / 4;
+            }
+            wp = buffer_write_reserve(&c->sendbuf, 4 * n);
+            size_t inside = region_clip_span(&c->region, c->multisend.x, c->multisend.y, n);
+            canvas_get_span(c->region.x + c->multisend.x, c->region.y + c->multisend.y, inside, wp);
+            memset(wp + 4 * inside, 0, 4 * (n - inside));
+            rect_iter_advance(&c->multisend, n);
+            m->pixels_read += n;
         }
 
-        // 2. handle multi recv as far as possible
-        while (!rect_iter_done(&c->multirecv) && have_drawn < DRAW_LIMIT) {
+        // 2. handle multi recv as far as possible, row by row. Every pixel is charged, also the ones outside the canvas.
+        while (!rect_iter_done(&c->multirecv) && b->used_pixels < b->pixels) {
+            size_t n = rect_iter_row_left(&c->multirecv);
+            if (n > b->pixels - b->used_pixels) {
+                n = b->pixels - b->used_pixels;
+            }
             if (c->multirecv_source == MULTIRECV_SOURCE_FILL) {
-                goto do_multirecv; // no reading necessary
+                // already clipped to the region
+                canvas_fill_span(c->region.x + c->multirecv.x, c->region.y + c->multirecv.y, n, c->multirecv_fill);
+                rect_iter_advance(&c->multirecv, n);
+                b->used_pixels += n;
+                continue;
             }
-            rp = buffer_read_reserve(&c->recvbuf, 4);
-            if (rp == NULL && have_read < READ_LIMIT) {
-                have_read += 1;
-                status = buffer_read_syscall(&c->recvbuf, c->fd);
-                if (IS_REAL_ERROR(status)) {
-                    return CONNECTION_ERR;
-                } else if (status == 0) {
-                    return CONNECTION_END;
-                } else if (status > 0) {
-                    rp = buffer_read_reserve(&c->recvbuf, 4);
+            if (buffer_size(&c->recvbuf) < 4 && connection_can_recv(c, b)) {
+                if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                    return status;
                 }
             }
-            if (rp == NULL) {
-                return connection_send(c);
+            if (buffer_size(&c->recvbuf) < 4) {
+                return connection_starved(c, b, m);
             }
             if (c->multirecv_source == MULTIRECV_SOURCE_FILL_NOT_READ) {
+                rp = buffer_read_reserve(&c->recvbuf, 4);
                 c->multirecv_source = MULTIRECV_SOURCE_FILL;
-                c->multirecv_source_fill_r = rp[0];
-                c->multirecv_source_fill_g = rp[1];
-                c->multirecv_source_fill_b = rp[2];
+                c->multirecv_fill = (rp[0] << 24) | (rp[1] << 16) | (rp[2] << 8) | 0xff;
+                // nothing to read anymore, so the pixels outside the region can be dropped right away
+                rect_iter_clip(&c->multirecv, c->region.w, c->region.h);
+                continue;
             }
-do_multirecv:
-            px.x = c->multirecv.x;
-            px.y = c->multirecv.y;
-            if (c->multirecv_source == MULTIRECV_SOURCE_FILL) {
-                px.r = c->multirecv_source_fill_r;
-                px.g = c->multirecv_source_fill_g;
-                px.b = c->multirecv_source_fill_b;
-            } else { // TODO ASSERT MULTIRECV_SOURCE_INDIVIDUAL
-                decode_color(&px, rp);
-            }
-            rect_iter_advance(&c->multirecv);
-            canvas_set_px(&px);
-            have_drawn += 1;
+            // TODO ASSERT MULTIRECV_SOURCE_INDIVIDUAL or MULTIRECV_SOURCE_ALPHA
+            if (n > buffer_size(&c->recvbuf) / 4) {
+                n = buffer_size(&c->recvbuf) / 4;
+            }
+            rp = buffer_read_reserve(&c->recvbuf, 4 * n);
+            // the colors of pixels outside the region are read and dropped
+            size_t inside = region_clip_span(&c->region, c->multirecv.x, c->multirecv.y, n);
+            unsigned int x = c->region.x + c->multirecv.x;
+            unsigned int y = c->region.y + c->multirecv.y;
+            if (c->multirecv_source == MULTIRECV_SOURCE_ALPHA) {
+                canvas_print_alpha_span(x, y, inside, rp);
+            } else {
+                canvas_print_span(x, y, inside, rp);
+            }
+            rect_iter_advance(&c->multirecv, n);
+            b->used_pixels += n;
         }
         if (!rect_iter_done(&c->multirecv)) {
-            return connection_send(c);
+            return connection_limit(c, b, m, b->pixels_limited);
+        }
+
+        // 2a. receive the instructions of a program upload
+        while (c->program != NULL && c->program->upload_received < c->program->upload.num_insns) {
+            struct program_state *s = c->program;
+            if (buffer_size(&c->recvbuf) < 4 && connection_can_recv(c, b)) {
+                if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                    return status;
+                }
+            }
+            if (buffer_size(&c->recvbuf) < 4) {
+                return connection_starved(c, b, m);
+            }
+            size_t n = s->upload.num_insns - s->upload_received;
+            if (n > buffer_size(&c->recvbuf) / 4) {
+                n = buffer_size(&c->recvbuf) / 4;
+            }
+            rp = buffer_read_reserve(&c->recvbuf, 4 * n);
+            memcpy(s->upload.insns[s->upload_received], rp, 4 * n);
+            s->upload_received += n;
+            if (s->upload_received == s->upload.num_insns) {
+                // with a low pixel quota a full bucket may not even pay for one pixel, the program would never run
+                if (program_verify(&s->upload) != 0 || s->upload.cost > sched_max_pixels(&c->sched)) {
+                    return CONNECTION_ERR;
+                }
+                s->program = s->upload;
+            }
+        }
+
+        // 2b. receive the weights of a kernel upload
+        while (c->program != NULL && c->program->kernel_received < 2 * c->program->kernel_upload.size
+                * c->program->kernel_upload.size) {
+            struct program_state *s = c->program;
+            if (buffer_size(&c->recvbuf) == 0 && connection_can_recv(c, b)) {
+                if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                    return status;
+                }
+            }
+            if (buffer_size(&c->recvbuf) == 0) {
+                return connection_starved(c, b, m);
+            }
+            size_t n = 2 * s->kernel_upload.size * s->kernel_upload.size - s->kernel_received;
+            if (n > buffer_size(&c->recvbuf)) {
+                n = buffer_size(&c->recvbuf);
+            }
+            rp = buffer_read_reserve(&c->recvbuf, n);
+            memcpy(s->kernel_weights + s->kernel_received, rp, n);
+            s->kernel_received += n;
+            if (s->kernel_received == 2 * s->kernel_upload.size * s->kernel_upload.size) {
+                // same as for programs, a kernel of 25 taps costs 4 pixels per pixel
+                if (program_kernel_verify(&s->kernel_upload, s->kernel_weights) != 0
+                        || s->kernel_upload.cost > sched_max_pixels(&c->sched)) {
+                    return CONNECTION_ERR;
+                }
+                s->kernel = s->kernel_upload;
+                s->kernel_upload.size = 0;
+                s->kernel_received = 0;
+            }
+        }
+
+        // 2c. run the program or kernel row by row. A pixel is charged cost pixels.
+        while (!rect_iter_done(&c->multiexec)) {
+            unsigned int cost = c->program->run_kernel ? c->program->kernel.cost : c->program->program.cost;
+            size_t n = rect_iter_row_left(&c->multiexec);
+            if (n > (b->pixels - b->used_pixels) / cost) {
+                n = (b->pixels - b->used_pixels) / cost;
+            }
+            if (n == 0) {
+                break;
+            }
+            program_run_span(c->program, &c->region, c->multiexec.x, c->multiexec.y, n);
+            rect_iter_advance(&c->multiexec, n);
+            b->used_pixels += n * cost;
+        }
+        if (!rect_iter_done(&c->multiexec)) {
+            return connection_limit(c, b, m, b->pixels_limited);
+        }
+
+        // 2d. receive the colors of SET PALETTE
+        while (c->palette_left > 0) {
+            if (buffer_size(&c->recvbuf) < 4 && connection_can_recv(c, b)) {
+                if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                    return status;
+                }
+            }
+            if (buffer_size(&c->recvbuf) < 4) {
+                return connection_starved(c, b, m);
+            }
+            rp = buffer_read_reserve(&c->recvbuf, 4);
+            c->palette[c->palette_next] = (rp[0] << 24) | (rp[1] << 16) | (rp[2] << 8) | 0xff;
+            c->palette_next += 1;
+            c->palette_left -= 1;
+        }
+
+        // 2e. decode the records of BATCH PRINT or PALETTE PRINT straight from the receive buffer, one per pixel
+        while (c->packed_left > 0 && b->used_pixels < b->pixels) {
+            size_t size = c->packed_palette ? PACKED_PALETTE_SIZE : PACKED_RGB_SIZE;
+            if (buffer_size(&c->recvbuf) < size && connection_can_recv(c, b)) {
+                if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                    return status;
+                }
+            }
+            if (buffer_size(&c->recvbuf) < size) {
+                return connection_starved(c, b, m);
+            }
+            size_t n = c->packed_left;
+            if (n > b->pixels - b->used_pixels) {
+                n = b->pixels - b->used_pixels;
+            }
+            if (n > buffer_size(&c->recvbuf) / size) {
+                n = buffer_size(&c->recvbuf) / size;
+            }
+            rp = buffer_read_reserve(&c->recvbuf, size * n);
+            struct print_area area = { c->region.w, c->region.h, params.tex_size_x,
+                c->region.x + params.tex_size_x * c->region.y };
+            const unsigned int *palette = c->packed_palette ? c->palette : NULL;
+            for (size_t done = 0; done < n; ) {
+                size_t k = decode_packed_run(rp + size * done, n - done, c->packed_x, c->packed_y, palette, &area,
+                        &batch);
+                canvas_set_batch(&batch);
+                done += k;
+            }
+            c->packed_left -= n;
+            b->used_pixels += n;
+        }
+        if (c->packed_left > 0) {
+            return connection_limit(c, b, m, b->pixels_limited);
         }
 
         // 3. get actual command
         // Invariants holding here:
-        //  - multisend is either empty or the sendbuffer is full
+        //  - multisend is either empty or the sendbuffer (the chunks of bulk.h) is full
         //  - multirecv is empty -> we can read an actual command
         // peek here instead of reserve, because we can't be sure that we are able to process the command
         rp = buffer_read_peek(&c->recvbuf, 8);
-        if (rp == NULL && have_read < READ_LIMIT) {
-            have_read += 1;
-            status = buffer_read_syscall(&c->recvbuf, c->fd);
-            if (IS_REAL_ERROR(status)) {
-                return CONNECTION_ERR;
-            } else if (status == 0) {
-                return CONNECTION_END;
-            } else if (status > 0) {
-                rp = buffer_read_peek(&c->recvbuf, 8);
+        if (rp == NULL && connection_can_recv(c, b)) {
+            if ((status = connection_recv(c, b, m)) != CONNECTION_OK) {
+                return status;
             }
+            rp = buffer_read_peek(&c->recvbuf, 8);
         }
         if (rp == NULL) {
-            return connection_send(c);
+            return connection_starved(c, b, m);
+        }
+        // the client can rewrite its ring while the command is handled: a field that is checked and then used (like
+        // the size of an upload) must be the same both times, so every byte is read exactly once into a copy
+        if (c->local != NULL && local_has_ring(c)) {
+            for (size_t i = 0; i < sizeof(cmd); i++) {
+                cmd[i] = ((const volatile unsigned char *)rp)[i];
+            }
+            rp = cmd;
         }
 
-        multisend_done = rect_iter_done(&c->multisend);
+        multisend_done = rect_iter_done(&c->multisend) && (c->bulk == NULL || !bulk_busy(c->bulk));
         if (rp[0] == 'I') {
-            if (!multisend_done || (wp = buffer_write_reserve(&c->sendbuf, 16)) == NULL) {
-                return connection_send(c);
+            size_t size = rp[1] == 1 ? 32 : 16; // byte 1 is the version of the response
+            if (!multisend_done || (wp = buffer_write_reserve(&c->sendbuf, size)) == NULL) {
+                return connection_pause(c, m, PAUSE_SEND);
+            }
+            encode_info(&c->region, wp);
+            if (size == 32) {
+                encode_info_ext(wp + 16);
             }
-            encode_info(wp);
         } else if (rp[0] == 'P') {
-            if (have_drawn == DRAW_LIMIT) {
-                return connection_send(c);
+            if (b->used_pixels == b->pixels) {
+                return connection_limit(c, b, m, b->pixels_limited);
+            }
+            // decode the whole run of PRINT commands that is already in the buffer
+            size_t max_cmds = buffer_size(&c->recvbuf) / 8;
+            if (max_cmds > b->pixels - b->used_pixels) {
+                max_cmds = b->pixels - b->used_pixels;
+            }
+            struct print_area area = { c->region.w, c->region.h, params.tex_size_x,
+                c->region.x + params.tex_size_x * c->region.y };
+            // from the buffer, rp may be the copy of the first command. every field is only loaded once here.
+            size_t num_cmds = decode_print_run(buffer_at(&c->recvbuf, c->recvbuf.read_pos), max_cmds, &area, &batch);
+            if (num_cmds == 0) {
+                return CONNECTION_ERR; // the client rewrote the command in its ring, this would never stop
             }
-            decode_pixel(&px, rp);
-            canvas_set_px(&px);
-            have_drawn += 1;
+            canvas_set_batch(&batch);
+            b->used_pixels += num_cmds;
+            m->commands[metrics_opcode_index['P']] += num_cmds;
+            buffer_read_reserve(&c->recvbuf, 8 * num_cmds);
+            continue; // already advanced
         } else if (rp[0] == 'G') {
             if (!multisend_done || (wp = buffer_write_reserve(&c->sendbuf, 4)) == NULL) {
-                return connection_send(c);
+                return connection_pause(c, m, PAUSE_SEND);
             }
             px.x = rp[1] | (rp[2] << 8);
             px.y = rp[3] | (rp[4] << 8);
-            get_and_encode_color(&px, wp);
+            get_and_encode_color(&c->region, &px, wp);
+            m->pixels_read += 1;
         } else if (rp[0] == 'p') {
             if (!rect_iter_done(&c->multirecv)) {
                 printf("BUG: multirecv not empty?\n");
@@ -265,6 +691,13 @@ do_multirecv:
             }
             c->multirecv_source = MULTIRECV_SOURCE_INDIVIDUAL;
             decode_rect(&c->multirecv, rp);
+        } else if (rp[0] == 'a') {
+            if (!rect_iter_done(&c->multirecv)) {
+                printf("BUG: multirecv not empty?\n");
+                return CONNECTION_ERR;
+            }
+            c->multirecv_source = MULTIRECV_SOURCE_ALPHA;
+            decode_rect(&c->multirecv, rp);
         } else if (rp[0] == 'f') {
             if (!rect_iter_done(&c->multirecv)) {
                 printf("BUG: multirecv not empty?\n");
@@ -272,15 +705,86 @@ do_multirecv:
             }
             c->multirecv_source = MULTIRECV_SOURCE_FILL_NOT_READ;
             decode_rect(&c->multirecv, rp);
+        } else if (rp[0] == 'b' || rp[0] == 'q') {
+            if (rp[0] == 'q' && c->palette == NULL) {
+                return CONNECTION_ERR;
+            }
+            c->packed_left = rp[1] | (rp[2] << 8);
+            c->packed_x = rp[3] | (rp[4] << 8);
+            c->packed_y = rp[5] | (rp[6] << 8);
+            c->packed_palette = rp[0] == 'q';
+        } else if (rp[0] == 'Q') {
+            unsigned int first = rp[1];
+            unsigned int count = rp[2] == 0 ? 256 : rp[2];
+            if (first + count > 256) {
+                return CONNECTION_ERR;
+            }
+            if (c->palette == NULL) {
+                c->palette = calloc(256, sizeof(*c->palette));
+                if (c->palette == NULL) {
+                    perror("calloc");
+                    exit(1); // TODO
+                }
+            }
+            c->palette_next = first;
+            c->palette_left = count;
+        } else if (rp[0] == 'u') {
+            if (rp[1] == 0 || rp[1] > PROGRAM_MAX_INSNS) {
+                return CONNECTION_ERR;
+            }
+            if (c->program == NULL) {
+                c->program = program_state_new();
+            }
+            c->program->upload.num_insns = rp[1];
+            c->program->upload_received = 0;
+        } else if (rp[0] == 'k') {
+            if ((rp[1] != 1 && rp[1] != 3 && rp[1] != 5) || rp[2] > KERNEL_MAX_SHIFT) {
+                return CONNECTION_ERR;
+            }
+            if (c->program == NULL) {
+                c->program = program_state_new();
+            }
+            c->program->kernel_upload.size = rp[1];
+            c->program->kernel_upload.shift = rp[2];
+            c->program->kernel_upload.bias = (short)(rp[3] | (rp[4] << 8));
+            c->program->kernel_received = 0;
+        } else if (rp[0] == 'x' || rp[0] == 'c') {
+            int run_kernel = rp[0] == 'c';
+            if (c->program == NULL || (run_kernel ? c->program->kernel.size : c->program->program.num_insns) == 0) {
+                return CONNECTION_ERR;
+            }
+            c->program->run_kernel = run_kernel;
+            decode_rect(&c->multiexec, rp);
+            rect_iter_clip(&c->multiexec, c->region.w, c->region.h);
+            if (!rect_iter_done(&c->multiexec)) {
+                program_run_begin(c->program, &c->region, c->multiexec.xstart, c->multiexec.ystart,
+                        c->multiexec.xstop);
+            }
+        } else if (rp[0] == 'M') {
+            // the receive buffer is replaced by the ring, so the command is taken from the old one first
+            buffer_read_reserve(&c->recvbuf, 8);
+            if (c->local == NULL || local_map_ring(c) != 0) {
+                return CONNECTION_ERR;
+            }
+            m->commands[metrics_opcode_index['M']] += 1;
+            continue; // already advanced
         } else if (rp[0] == 'g') {
-            if (!rect_iter_done(&c->multisend)) {
-                return connection_send(c);
+            if (!multisend_done) {
+                return connection_pause(c, m, PAUSE_SEND);
             }
             decode_rect(&c->multisend, rp);
+            size_t size = 4 * (size_t)(c->multisend.xstop - c->multisend.xstart)
+                * (c->multisend.ystop - c->multisend.ystart);
+            c->multisend_bulk = c->uring == NULL && size >= BULK_MIN_SIZE;
+            if (c->multisend_bulk) {
+                bulk_begin(c);
+            }
         } else {
             // unknown command.
+            m->commands[0] += 1;
             return CONNECTION_ERR;
         }
+        m->commands[metrics_opcode_index[rp[0]]] += 1;
         // ADVANCE
         if (buffer_read_reserve(&c->recvbuf, 8) == NULL) {
             printf("BUG: reserve after peek\n");
@@ -288,3 +792,27 @@ do_multirecv:
         }
     }
 }
+
+int connection_step(struct connection *c, struct metrics_counters *m) {
+    struct step_budget b;
+    struct metrics_counters step = {0};
+    unsigned long long now = clock_now_us();
+    size_t sent_before = c->sendbuf.write_pos;
+    sched_begin(&c->sched, &b, now);
+    int status = connection_step_budget(c, &b, &step);
+    sched_end(&c->sched, &b);
+    step.pixels_drawn = b.used_pixels;
+    step.bytes_in = b.used_bytes;
+    step.bytes_out += c->sendbuf.write_pos - sent_before; // bulk_fill counts its own
+    if (step.throttles[METRICS_THROTTLE_SENDBUF] == 0 && !rect_iter_done(&c->multisend)) {
+        step.throttles[METRICS_THROTTLE_SENDBUF] = 1; // RECTANGLE GET waits for space, at most once per step
+    }
+    if (status == CONNECTION_YIELD && b.quota_hit) {
+        c->throttled_until = sched_wake_time(&c->sched, &b, now);
+        step.throttles[METRICS_THROTTLE_QUOTA] += 1;
+        status = CONNECTION_THROTTLED;
+    }
+    metrics_counters_add(&c->cold->tracker.counters, &step);
+    metrics_counters_add(m, &step);
+    return status;
+}
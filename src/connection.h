@@ -3,6 +3,14 @@
 
 #include <sys/socket.h>
 #include "buffer.h"
+#include "sched.h"
+#include "metrics.h"
+#include "region.h"
+#include "program.h"
+
+struct uring_conn;
+struct local_conn;
+struct bulk_send;
 
 void set_nonblocking(int fd);
 
@@ -10,6 +18,7 @@ struct connection_tracker {
     in_addr_t addr;
     unsigned long long start_time;
     unsigned long long end_time;
+    struct metrics_counters counters;
 };
 
 void connection_tracker_init(struct connection_tracker *t, in_addr_t addr, unsigned long long start_time);
@@ -26,32 +35,77 @@ struct rect_iter {
 
 void rect_iter_init(struct rect_iter *r);
 int rect_iter_done(const struct rect_iter *r);
-void rect_iter_advance(struct rect_iter *r);
+// pixels left in the current row
+size_t rect_iter_row_left(const struct rect_iter *r);
+// advances by n <= rect_iter_row_left pixels
+void rect_iter_advance(struct rect_iter *r, size_t n);
+// restricts the rest of the rect to 0..width x 0..height
+void rect_iter_clip(struct rect_iter *r, int width, int height);
+
+// state only needed when a connection is opened, closed or printed, kept out of the slots stepped in the hot loop
+struct connection_cold {
+    struct sockaddr_in addr;
+    struct connection_tracker tracker;
+};
+
+#define PROTOCOL_UNKNOWN 0 // until the first bytes arrived
+#define PROTOCOL_BINARY 1
+#define PROTOCOL_TEXT 2 // see text.h
 
 #define MULTIRECV_SOURCE_INDIVIDUAL 0
 #define MULTIRECV_SOURCE_FILL 1
 #define MULTIRECV_SOURCE_FILL_NOT_READ 2
+#define MULTIRECV_SOURCE_ALPHA 3 // individual colors with alpha
 struct connection {
     int fd; // fd == -1 means free
-    struct sockaddr_in addr;
-    struct connection_tracker tracker;
+    // socket readiness as last reported by epoll (edge-triggered).
+    // a flag is only cleared after read()/write() returned EAGAIN.
+    int readable;
+    int writable;
+    int scheduled; // connection is stepped in the next round of the network loop
+    int throttled; // quota used up, not stepped before throttled_until
+    unsigned long long throttled_until; // clock_now_us() time
+    struct uring_conn *uring; // NULL if the connection uses read()/write(), see uring.h
+    struct local_conn *local; // NULL unless the connection came over the unix socket, see local.h
+    struct conn_sched sched;
+    struct region region; // part of the canvas the client draws to and reads from, see region.h
+    int protocol; // PROTOCOL_*, decided by the first bytes of the connection
+    unsigned int text_offset_x; // OFFSET of a text connection
+    unsigned int text_offset_y;
     int multirecv_source; // TODO init?
-    unsigned char multirecv_source_fill_r;
-    unsigned char multirecv_source_fill_g;
-    unsigned char multirecv_source_fill_b;
+    unsigned int multirecv_fill; // RGBA8888 color of MULTIRECV_SOURCE_FILL
     struct rect_iter multirecv;
     struct rect_iter multisend;
+    int multisend_bulk; // the RECTANGLE GET in multisend is sent from bulk, see bulk.h
+    struct bulk_send *bulk; // NULL until the first large RECTANGLE GET
+    struct rect_iter multiexec; // rect of the running pixel program, clipped to the region
+    struct program_state *program; // NULL until the first upload
+    unsigned int packed_left; // records of the current BATCH PRINT or PALETTE PRINT still to come
+    unsigned int packed_x; // base coordinates of the records
+    unsigned int packed_y;
+    int packed_palette; // records are PALETTE PRINT records
+    unsigned int *palette; // 256 RGBA8888 colors, NULL until the first SET PALETTE
+    unsigned int palette_next; // next entry of the SET PALETTE being received
+    unsigned int palette_left; // entries still to come
+    // mapped by the pool (see pool.h) and kept when the slot is reused. recvbuf is the shared memory ring of a
+    // local connection after MAP RING, the pool's buffer is restored on close.
     struct buffer recvbuf;
     struct buffer sendbuf;
-};
+    struct connection_cold *cold; // set by the pool
+    size_t active_index; // position in the active list of the pool
+} __attribute__((aligned(64))); // slots never share a cache line
 
 void connection_print(const struct connection *c);
 void connection_init(struct connection *c, int connfd, struct sockaddr_in connaddr);
-void connection_close(struct connection *c);
+// returns 1 if io_uring requests still use the buffers of the slot, it is released by uring_poll() then
+int connection_close(struct connection *c);
 
 #define CONNECTION_OK 0
 #define CONNECTION_ERR 1
 #define CONNECTION_END 2
-int connection_step(struct connection *c);
+#define CONNECTION_YIELD 3 // stopped by a per-round limit, more work is pending
+#define CONNECTION_THROTTLED 4 // quota used up, more work is pending at c->throttled_until
+// the counters of the step are added to the tracker of c and to m
+int connection_step(struct connection *c, struct metrics_counters *m);
 
 #endif
@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "decode.h"
+
+// Layout of a PRINT command: 'P' x[0..=7] x[8..=15] y[0..=7] y[8..=15] r g b
+// Canvas colors are RGBA8888, as a little-endian 32 bit word the bytes are: 0xff b g r
+
+// continues a run at command i, appending to the batch
+static size_t print_run_scalar_from(const unsigned char *rp, size_t i, size_t max_cmds, const struct print_area *a,
+        struct print_batch *b) {
+    for (rp += i * 8; i < max_cmds && rp[0] == 'P'; i++, rp += 8) {
+        unsigned int x = rp[1] | (rp[2] << 8);
+        unsigned int y = rp[3] | (rp[4] << 8);
+        if (x < a->width && y < a->height) {
+            b->index[b->n] = a->offset + x + a->stride * y;
+            b->color[b->n] = (rp[5] << 24) | (rp[6] << 16) | (rp[7] << 8) | 0xff;
+            b->n += 1;
+        }
+    }
+    return i;
+}
+
+static size_t print_run_scalar(const unsigned char *rp, size_t max_cmds, const struct print_area *a,
+        struct print_batch *b) {
+    if (max_cmds > PRINT_BATCH_MAX) {
+        max_cmds = PRINT_BATCH_MAX;
+    }
+    b->n = 0;
+    return print_run_scalar_from(rp, 0, max_cmds, a, b);
+}
+
+#ifdef HAVE_X86_SIMD
+// appends the pixels selected by mask (bit i: lane i is inside the canvas)
+static inline void batch_append_masked(struct print_batch *b, const unsigned int *index, const unsigned int *color,
+        unsigned int mask) {
+    while (mask) {
+        int lane = __builtin_ctz(mask);
+        b->index[b->n] = index[lane];
+        b->color[b->n] = color[lane];
+        b->n += 1;
+        mask &= mask - 1;
+    }
+}
+
+// 4 commands per iteration: two 16 byte loads with two commands each
+__attribute__((target("sse4.1")))
+static size_t print_run_sse41(const unsigned char *rp, size_t max_cmds, const struct print_area *a,
+        struct print_batch *b) {
+    if (max_cmds > PRINT_BATCH_MAX) {
+        max_cmds = PRINT_BATCH_MAX;
+    }
+    b->n = 0;
+    // per load: x0 x1 y0 y1 as 32 bit lanes, and the colors of both commands in the low half
+    const __m128i shuf_xy = _mm_setr_epi8(1, 2, -1, -1, 9, 10, -1, -1, 3, 4, -1, -1, 11, 12, -1, -1);
+    const __m128i shuf_color = _mm_setr_epi8(-1, 7, 6, 5, -1, 15, 14, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff);
+    const __m128i opcode = _mm_set1_epi8('P');
+    const __m128i w = _mm_set1_epi32(a->width);
+    const __m128i h = _mm_set1_epi32(a->height);
+    const __m128i stride = _mm_set1_epi32(a->stride);
+    const __m128i offset = _mm_set1_epi32(a->offset);
+    unsigned int index[4];
+    unsigned int color[4];
+    size_t i = 0;
+    for (; i + 4 <= max_cmds; i += 4) {
+        __m128i c01 = _mm_loadu_si128((const __m128i *)(rp + i * 8));
+        __m128i c23 = _mm_loadu_si128((const __m128i *)(rp + i * 8 + 16));
+        unsigned int ops = _mm_movemask_epi8(_mm_cmpeq_epi8(c01, opcode))
+            | (_mm_movemask_epi8(_mm_cmpeq_epi8(c23, opcode)) << 16);
+        if ((ops & 0x01010101) != 0x01010101) {
+            break; // end of the run is somewhere in here
+        }
+        __m128i xy01 = _mm_shuffle_epi8(c01, shuf_xy);
+        __m128i xy23 = _mm_shuffle_epi8(c23, shuf_xy);
+        __m128i x = _mm_unpacklo_epi64(xy01, xy23);
+        __m128i y = _mm_unpackhi_epi64(xy01, xy23);
+        __m128i col = _mm_or_si128(alpha,
+                _mm_unpacklo_epi64(_mm_shuffle_epi8(c01, shuf_color), _mm_shuffle_epi8(c23, shuf_color)));
+        __m128i inside = _mm_and_si128(_mm_cmpgt_epi32(w, x), _mm_cmpgt_epi32(h, y));
+        __m128i idx = _mm_add_epi32(_mm_add_epi32(x, offset), _mm_mullo_epi32(y, stride));
+        unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+        if (mask == 0xf) {
+            _mm_storeu_si128((__m128i *)&b->index[b->n], idx);
+            _mm_storeu_si128((__m128i *)&b->color[b->n], col);
+            b->n += 4;
+        } else {
+            _mm_storeu_si128((__m128i *)index, idx);
+            _mm_storeu_si128((__m128i *)color, col);
+            batch_append_masked(b, index, color, mask);
+        }
+    }
+    return print_run_scalar_from(rp, i, max_cmds, a, b);
+}
+
+// 8 commands per iteration: two 32 byte loads with four commands each
+__attribute__((target("avx2")))
+static size_t print_run_avx2(const unsigned char *rp, size_t max_cmds, const struct print_area *a,
+        struct print_batch *b) {
+    if (max_cmds > PRINT_BATCH_MAX) {
+        max_cmds = PRINT_BATCH_MAX;
+    }
+    b->n = 0;
+    // same shuffles as the sse4.1 version, in both 128 bit lanes
+    const __m256i shuf_xy = _mm256_setr_epi8(
+            1, 2, -1, -1, 9, 10, -1, -1, 3, 4, -1, -1, 11, 12, -1, -1,
+            1, 2, -1, -1, 9, 10, -1, -1, 3, 4, -1, -1, 11, 12, -1, -1);
+    const __m256i shuf_color = _mm256_setr_epi8(
+            -1, 7, 6, 5, -1, 15, 14, 13, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, 7, 6, 5, -1, 15, 14, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i alpha = _mm256_set1_epi32(0xff);
+    const __m256i opcode = _mm256_set1_epi8('P');
+    const __m256i w = _mm256_set1_epi32(a->width);
+    const __m256i h = _mm256_set1_epi32(a->height);
+    const __m256i stride = _mm256_set1_epi32(a->stride);
+    const __m256i offset = _mm256_set1_epi32(a->offset);
+    unsigned int index[8];
+    unsigned int color[8];
+    size_t i = 0;
+    for (; i + 8 <= max_cmds; i += 8) {
+        __m256i c0123 = _mm256_loadu_si256((const __m256i *)(rp + i * 8));
+        __m256i c4567 = _mm256_loadu_si256((const __m256i *)(rp + i * 8 + 32));
+        unsigned int ops0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c0123, opcode));
+        unsigned int ops1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c4567, opcode));
+        if ((ops0 & ops1 & 0x01010101) != 0x01010101) {
+            break; // end of the run is somewhere in here
+        }
+        __m256i xy0 = _mm256_shuffle_epi8(c0123, shuf_xy); // x0 x1 y0 y1 | x2 x3 y2 y3
+        __m256i xy1 = _mm256_shuffle_epi8(c4567, shuf_xy); // x4 x5 y4 y5 | x6 x7 y6 y7
+        // unpacking gives x0 x1 x4 x5 | x2 x3 x6 x7, the permute restores command order
+        __m256i x = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(xy0, xy1), 0xd8);
+        __m256i y = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(xy0, xy1), 0xd8);
+        __m256i col = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(
+                    _mm256_shuffle_epi8(c0123, shuf_color), _mm256_shuffle_epi8(c4567, shuf_color)), 0xd8);
+        col = _mm256_or_si256(col, alpha);
+        __m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(w, x), _mm256_cmpgt_epi32(h, y));
+        __m256i idx = _mm256_add_epi32(_mm256_add_epi32(x, offset), _mm256_mullo_epi32(y, stride));
+        unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(inside));
+        if (mask == 0xff) {
+            _mm256_storeu_si256((__m256i *)&b->index[b->n], idx);
+            _mm256_storeu_si256((__m256i *)&b->color[b->n], col);
+            b->n += 8;
+        } else {
+            _mm256_storeu_si256((__m256i *)index, idx);
+            _mm256_storeu_si256((__m256i *)color, col);
+            batch_append_masked(b, index, color, mask);
+        }
+    }
+    return print_run_scalar_from(rp, i, max_cmds, a, b);
+}
+
+const decode_print_fn decode_print_sse41 = print_run_sse41;
+const decode_print_fn decode_print_avx2 = print_run_avx2;
+#else
+const decode_print_fn decode_print_sse41 = NULL;
+const decode_print_fn decode_print_avx2 = NULL;
+#endif
+
+const decode_print_fn decode_print_scalar = print_run_scalar;
+
+static decode_print_fn print_impl = print_run_scalar;
+
+int decode_cpu_supports(decode_print_fn fn) {
+    if (fn == NULL) {
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (fn == decode_print_avx2) {
+        return __builtin_cpu_supports("avx2");
+    } else if (fn == decode_print_sse41) {
+        return __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return 1;
+}
+
+void decode_init(void) {
+    if (decode_cpu_supports(decode_print_avx2)) {
+        print_impl = decode_print_avx2;
+    } else if (decode_cpu_supports(decode_print_sse41)) {
+        print_impl = decode_print_sse41;
+    } else {
+        print_impl = decode_print_scalar;
+    }
+}
+
+const char *decode_impl_name(void) {
+    if (print_impl == decode_print_avx2) {
+        return "avx2";
+    } else if (print_impl == decode_print_sse41) {
+        return "sse4.1";
+    }
+    return "scalar";
+}
+
+size_t decode_print_run(const unsigned char *rp, size_t max_cmds, const struct print_area *a, struct print_batch *b) {
+    return print_impl(rp, max_cmds, a, b);
+}
+
+// no simd version: records are not aligned to anything, the loop is already bound by the canvas writes.
+// pixels are stored unconditionally and only counted if they are inside the area, so there is no branch per record.
+size_t decode_packed_run(const unsigned char *rp, size_t n, unsigned int base_x, unsigned int base_y,
+        const unsigned int *palette, const struct print_area *a, struct print_batch *b) {
+    if (n > PRINT_BATCH_MAX) {
+        n = PRINT_BATCH_MAX;
+    }
+    b->n = 0;
+    if (palette != NULL) {
+        for (size_t i = 0; i < n; i++, rp += PACKED_PALETTE_SIZE) {
+            unsigned int x = base_x + rp[0];
+            unsigned int y = base_y + rp[1];
+            b->index[b->n] = a->offset + x + a->stride * y;
+            b->color[b->n] = palette[rp[2]];
+            b->n += x < a->width && y < a->height;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++, rp += PACKED_RGB_SIZE) {
+            unsigned int x = base_x + rp[0];
+            unsigned int y = base_y + rp[1];
+            b->index[b->n] = a->offset + x + a->stride * y;
+            b->color[b->n] = (rp[2] << 24) | (rp[3] << 16) | (rp[4] << 8) | 0xff;
+            b->n += x < a->width && y < a->height;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,49 @@
+#ifndef PFS_DECODE_H
+#define PFS_DECODE_H
+
+#include <stddef.h>
+
+// Bulk decoder for runs of PRINT ('P') commands.
+// Decodes up to max_cmds consecutive 8 byte PRINT commands starting at rp and stops at the first other opcode.
+// Pixels inside the area are appended to the batch in command order as canvas index + packed color.
+// Returns the number of commands consumed (out-of-bounds ones included).
+
+#define PRINT_BATCH_MAX 64
+
+struct print_batch {
+    size_t n;
+    unsigned int index[PRINT_BATCH_MAX];
+    unsigned int color[PRINT_BATCH_MAX]; // RGBA8888, same as canvas_set_px
+};
+
+// the part of the canvas the commands draw to: x < width and y < height is canvas index offset + x + stride * y.
+// The whole canvas, or the region of the client in split screen mode (see region.h).
+struct print_area {
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride; // canvas width
+    unsigned int offset;
+};
+
+typedef size_t (*decode_print_fn)(const unsigned char *rp, size_t max_cmds, const struct print_area *a,
+        struct print_batch *b);
+
+void decode_init(void); // selects the best implementation for this cpu
+size_t decode_print_run(const unsigned char *rp, size_t max_cmds, const struct print_area *a, struct print_batch *b);
+const char *decode_impl_name(void);
+
+// Packed PRINT records of BATCH PRINT ('b') and PALETTE PRINT ('q'): dx dy r g b, or dx dy index into the palette
+// (RGBA8888 colors). The pixel is at (base_x + dx, base_y + dy). Decodes up to min(n, PRINT_BATCH_MAX) records,
+// appends the pixels inside the area to the batch and returns the number of records consumed.
+#define PACKED_RGB_SIZE 5
+#define PACKED_PALETTE_SIZE 3
+size_t decode_packed_run(const unsigned char *rp, size_t n, unsigned int base_x, unsigned int base_y,
+        const unsigned int *palette, const struct print_area *a, struct print_batch *b);
+
+// individual implementations, exported for benchmarks. NULL if not supported by cpu or compiler.
+extern const decode_print_fn decode_print_scalar;
+extern const decode_print_fn decode_print_sse41;
+extern const decode_print_fn decode_print_avx2;
+int decode_cpu_supports(decode_print_fn fn);
+
+#endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE // F_GET_SEALS, MSG_CMSG_CLOEXEC
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "param.h"
+#include "connection.h"
+#include "local.h"
+
+struct local_conn {
+    int memfd; // received with SCM_RIGHTS and kept until MAP RING, -1 if none
+    struct local_ring_header *header; // NULL until MAP RING
+    struct buffer socket_buf; // the receive buffer from the pool while c->recvbuf is the ring
+};
+
+int local_listen(void) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(params.unix_socket_path) >= sizeof(addr.sun_path)) {
+        printf("unix socket path too long: %s\n", params.unix_socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, params.unix_socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("unix socket");
+        exit(1);
+    }
+    unlink(params.unix_socket_path); // left behind by a server that did not exit cleanly
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror("unix bind");
+        exit(1);
+    }
+    set_nonblocking(fd);
+    printf("unix socket at %s\n", params.unix_socket_path);
+    return fd;
+}
+
+struct local_conn *local_conn_new(void) {
+    struct local_conn *l = malloc(sizeof(*l));
+    if (l == NULL) {
+        perror("malloc");
+        exit(1); // TODO
+    }
+    l->memfd = -1;
+    l->header = NULL;
+    return l;
+}
+
+void local_conn_close(struct connection *c) {
+    struct local_conn *l = c->local;
+    if (l->header != NULL) {
+        munmap(c->recvbuf.data, 2 * c->recvbuf.capacity);
+        munmap(l->header, LOCAL_RING_HEADER_SIZE);
+        c->recvbuf = l->socket_buf;
+    }
+    if (l->memfd != -1) {
+        close(l->memfd);
+    }
+    free(l);
+    c->local = NULL;
+}
+
+// like buffer_read_syscall, but also takes the memfd sent along with the bytes
+static int socket_recv(struct connection *c, size_t max) {
+    struct buffer *b = &c->recvbuf;
+    size_t space = buffer_write_space(b);
+    struct iovec iov = { buffer_at(b, b->write_pos), space < max ? space : max };
+    union {
+        struct cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))]; // more fds than that are closed by the kernel
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    int status = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (status > 0) {
+        b->write_pos += status;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); status > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len >= CMSG_LEN(sizeof(int))) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            if (c->local->memfd != -1) {
+                close(c->local->memfd); // only the last one counts
+            }
+            c->local->memfd = fd;
+        }
+    }
+    return status;
+}
+
+static int ring_recv(struct connection *c, size_t max, unsigned long long *syscalls) {
+    struct local_ring_header *h = c->local->header;
+    struct buffer *b = &c->recvbuf;
+    __atomic_store_n(&h->read_pos, b->read_pos, __ATOMIC_RELEASE); // the client may overwrite everything before it
+    unsigned long long pos = __atomic_load_n(&h->write_pos, __ATOMIC_ACQUIRE);
+    while (pos == b->write_pos) {
+        __atomic_store_n(&h->server_waiting, 1, __ATOMIC_SEQ_CST);
+        pos = __atomic_load_n(&h->write_pos, __ATOMIC_SEQ_CST);
+        if (pos != b->write_pos) {
+            break;
+        }
+        // still empty: take the wakeups that already came. EAGAIN waits for the next one, EOF is the client leaving.
+        unsigned char wakeups[64];
+        int status = read(c->fd, wakeups, sizeof(wakeups));
+        *syscalls += 1;
+        if (status <= 0) {
+            return status;
+        }
+        pos = __atomic_load_n(&h->write_pos, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&h->server_waiting, 0, __ATOMIC_RELAXED); // saves the client a wakeup it does not need
+    if (pos - b->read_pos > b->capacity || pos - b->write_pos > b->capacity) {
+        errno = EPROTO; // overwrote unread commands or went backwards
+        return -1;
+    }
+    size_t n = pos - b->write_pos;
+    if (n > max) {
+        n = max;
+    }
+    b->write_pos += n;
+    return n;
+}
+
+int local_recv(struct connection *c, size_t max, unsigned long long *syscalls) {
+    if (c->local->header != NULL) {
+        return ring_recv(c, max, syscalls);
+    }
+    *syscalls += 1;
+    return socket_recv(c, max);
+}
+
+int local_has_ring(const struct connection *c) {
+    return c->local->header != NULL;
+}
+
+int local_map_ring(struct connection *c) {
+    struct local_conn *l = c->local;
+    if (l->header != NULL || l->memfd == -1 || buffer_size(&c->recvbuf) != 0) {
+        return -1;
+    }
+    int fd = l->memfd;
+    l->memfd = -1;
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (fstat(fd, &st) != 0 || seals == -1 || !(seals & F_SEAL_SHRINK) || st.st_size <= LOCAL_RING_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size_t capacity = st.st_size - LOCAL_RING_HEADER_SIZE;
+    if (capacity != buffer_round_capacity(capacity) || capacity > MAX_CONN_BUF_SIZE) {
+        close(fd);
+        return -1;
+    }
+    // like buffer_map, but the memfd comes from the client, so failing is not fatal
+    struct local_ring_header *h = mmap(NULL, LOCAL_RING_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    unsigned char *addr = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    int mapped = h != MAP_FAILED && addr != MAP_FAILED
+        && mmap(addr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, LOCAL_RING_HEADER_SIZE) != MAP_FAILED
+        && mmap(addr + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                LOCAL_RING_HEADER_SIZE) != MAP_FAILED;
+    close(fd); // the mappings keep the memory alive
+    if (!mapped) {
+        if (h != MAP_FAILED) {
+            munmap(h, LOCAL_RING_HEADER_SIZE);
+        }
+        if (addr != MAP_FAILED) {
+            munmap(addr, 2 * capacity);
+        }
+        return -1;
+    }
+    l->header = h;
+    l->socket_buf = c->recvbuf;
+    c->recvbuf.read_pos = c->recvbuf.write_pos = 0;
+    c->recvbuf.capacity = capacity;
+    c->recvbuf.data = addr;
+    __atomic_store_n(&h->read_pos, 0, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef PFS_LOCAL_H
+#define PFS_LOCAL_H
+
+#include <stddef.h>
+
+// Transports for pixel generators on the same machine, only with the epoll backend:
+// - params.unix_socket_path is a unix stream socket that speaks the same protocol as the tcp port.
+// - a client of the unix socket can switch its connection to a shared memory ring: it creates a memfd, sends it
+//   with SCM_RIGHTS along with MAP RING ('M', the other 7 bytes are ignored) and from then on writes its commands
+//   into the ring instead of the socket. The ring becomes the receive buffer of the connection, so connection_step
+//   decodes the commands where the client wrote them, and taking a batch is a pair of atomic loads instead of a
+//   read(). Responses still come over the socket.
+//
+// The memfd holds a LOCAL_RING_HEADER_SIZE header (struct local_ring_header) followed by the ring, whose size must
+// be a power of two of at least one page and at most MAX_CONN_BUF_SIZE. It must be sealed with F_SEAL_SHRINK, so
+// the client can't truncate it while the server reads from it. MAP RING must be the last thing sent over the socket.
+//
+// write_pos and read_pos count bytes since MAP RING and never wrap, the byte at pos is at pos % ring size. The client
+// writes at write_pos and then advances it, but never more than ring size bytes ahead of read_pos. The server
+// advances read_pos whenever it looks for new commands. When the server finds the ring empty it sets
+// server_waiting and sleeps on the socket. A client that advanced write_pos and finds server_waiting set clears it
+// and sends one byte (any value) over the socket to wake the server. Both sides access write_pos and
+// server_waiting sequentially consistent, so one of them always sees the other. The server never wakes the client,
+// a client with a full ring polls read_pos.
+//
+// All connections over the unix socket count as coming from 127.0.0.1 for quotas and regions.
+
+#define LOCAL_RING_HEADER_SIZE 4096
+
+struct local_ring_header {
+    unsigned long long write_pos; // written by the client
+    unsigned char pad0[56];
+    unsigned long long read_pos; // written by the server
+    unsigned char pad1[56];
+    unsigned int server_waiting;
+};
+
+struct connection;
+struct local_conn;
+
+// opens the listening socket at params.unix_socket_path, replacing a stale socket file
+int local_listen(void);
+struct local_conn *local_conn_new(void);
+// unmaps the ring and hands the pool's receive buffer back to the connection, frees c->local
+void local_conn_close(struct connection *c);
+// same contract as the read() path in connection.c: up to max > 0 bytes into c->recvbuf, either from the socket or
+// from the ring. *syscalls counts the syscalls it took.
+int local_recv(struct connection *c, size_t max, unsigned long long *syscalls);
+// whether c->recvbuf is the ring. The client can change its bytes at any time, so the commands in it have to be
+// decoded from a copy whenever a field is checked before it is used.
+int local_has_ring(const struct connection *c);
+// handles MAP RING after the command was taken from the receive buffer. returns -1 if the connection has to be
+// closed: no memfd came with the command, a ring is already mapped, the socket sent more or the memfd is invalid.
+int local_map_ring(struct connection *c);
+
+#endif
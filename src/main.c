@@ -7,28 +7,227 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-#include "SDL.h"
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
 
+#include "param.h"
 #include "common.h"
 #include "canvas.h"
+#include "sink.h"
+#include "decode.h"
+#include "text.h"
+#include "span.h"
+#include "program.h"
 #include "net.h"
+#include "metrics.h"
+#include "region.h"
 
 #define FPS 30
 #define MS_PER_FRAME (1000 / (FPS))
+// how often the upload counters of the canvas and the network counters are printed
+#define STATS_INTERVAL_MS 10000
 
-int main() {
+static void usage(const char *prog) {
+    printf("usage: %s [-c file] [-w workers] [-u] [-p pixels] [-b bytes] [-P pixels] [-B bytes] [--option value ...]\n", prog);
+    printf("  -c, --config file        read options from file, one 'option = value' per line\n");
+    printf("  -w, --workers n          number of network threads (default: number of cpu cores)\n");
+    printf("  -u, --io-uring 1         use io_uring instead of epoll and read()/write()\n");
+    printf("  -p, --conn-pixels n      pixels per second each connection may draw (default: unlimited)\n");
+    printf("  -b, --conn-bytes n       bytes per second each connection may send (default: unlimited)\n");
+    printf("  -P, --ip-pixels n        pixels per second all connections of one ip may draw together (default: unlimited)\n");
+    printf("  -B, --ip-bytes n         bytes per second all connections of one ip may send together (default: unlimited)\n");
+    printf("      --width n            canvas width (default: %d)\n", DEFAULT_TEX_SIZE_X);
+    printf("      --height n           canvas height (default: %d)\n", DEFAULT_TEX_SIZE_Y);
+    printf("      --screen-width n     window width (default: canvas width)\n");
+    printf("      --screen-height n    window height (default: canvas height)\n");
+    printf("      --port n             tcp port (default: %d)\n", DEFAULT_PORT);
+    printf("      --max-conns n        maximum number of connections (default: %d)\n", DEFAULT_MAX_CONNS);
+    printf("      --recv-buf n         receive buffer size per connection (default: %d)\n", DEFAULT_CONN_BUF_SIZE);
+    printf("      --send-buf n         send buffer size per connection (default: %d)\n", DEFAULT_CONN_BUF_SIZE);
+    printf("      --headless 1         no window\n");
+    printf("      --snapshot file      periodically write the canvas to file (PPM)\n");
+    printf("      --snapshot-interval n  seconds between snapshots (default: %d)\n", DEFAULT_SNAPSHOT_INTERVAL);
+    printf("      --checkpoint file    keep the canvas in file and restore it from there on start\n");
+    printf("      --checkpoint-interval n  ms between checkpoints (default: %d)\n", DEFAULT_CHECKPOINT_INTERVAL);
+    printf("      --draw-mode mode     overwrite, average or blend (default: overwrite)\n");
+    printf("      --split-screen n     split the canvas into n regions, one per client ip (default: off)\n");
+    printf("      --region 'ip x y w h'  region of a client ip, can be given several times\n");
+    printf("      --stream-port n      stream the canvas to viewers on this tcp port (default: off)\n");
+    printf("      --metrics-port n     serve metrics on 127.0.0.1 on this tcp port (default: off)\n");
+    printf("      --udp-port n         accept PRINT commands in udp datagrams on this port (default: off)\n");
+    printf("      --udp-workers n      threads receiving udp datagrams (default: %d)\n", DEFAULT_UDP_WORKERS);
+    printf("      --udp-pixels n       pixels per second one ip may draw over udp (default: unlimited)\n");
+    printf("      --unix-socket path   also listen on this unix socket, needs the epoll backend (default: off)\n");
+    printf("      --zerocopy 1         send large RECTANGLE GET responses with MSG_ZEROCOPY\n");
+}
+
+static const struct option long_options[] = {
+    { "config", required_argument, NULL, 'c' },
+    { "workers", required_argument, NULL, 'w' },
+    { "io-uring", required_argument, NULL, 0 },
+    { "conn-pixels", required_argument, NULL, 'p' },
+    { "conn-bytes", required_argument, NULL, 'b' },
+    { "ip-pixels", required_argument, NULL, 'P' },
+    { "ip-bytes", required_argument, NULL, 'B' },
+    { "width", required_argument, NULL, 0 },
+    { "height", required_argument, NULL, 0 },
+    { "screen-width", required_argument, NULL, 0 },
+    { "screen-height", required_argument, NULL, 0 },
+    { "port", required_argument, NULL, 0 },
+    { "max-conns", required_argument, NULL, 0 },
+    { "recv-buf", required_argument, NULL, 0 },
+    { "send-buf", required_argument, NULL, 0 },
+    { "headless", required_argument, NULL, 0 },
+    { "snapshot", required_argument, NULL, 0 },
+    { "snapshot-interval", required_argument, NULL, 0 },
+    { "checkpoint", required_argument, NULL, 0 },
+    { "checkpoint-interval", required_argument, NULL, 0 },
+    { "draw-mode", required_argument, NULL, 0 },
+    { "split-screen", required_argument, NULL, 0 },
+    { "region", required_argument, NULL, 0 },
+    { "stream-port", required_argument, NULL, 0 },
+    { "metrics-port", required_argument, NULL, 0 },
+    { "udp-port", required_argument, NULL, 0 },
+    { "udp-workers", required_argument, NULL, 0 },
+    { "udp-pixels", required_argument, NULL, 0 },
+    { "unix-socket", required_argument, NULL, 0 },
+    { "zerocopy", required_argument, NULL, 0 },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 },
+};
+#define SHORT_OPTIONS "c:w:up:b:P:B:h"
+
+// the config file is read first, so the other options on the command line override it
+static void parse_args(int argc, char **argv) {
+    int opt;
+    int index;
+    while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, long_options, NULL)) != -1) {
+        if (opt == 'c') {
+            params_load_file(optarg);
+        } else if (opt == 'h' || opt == '?') {
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, SHORT_OPTIONS, long_options, &index)) != -1) {
+        const char *name = NULL;
+        const char *value = optarg;
+        if (opt == 0) {
+            name = long_options[index].name;
+        } else if (opt == 'u') {
+            name = "io-uring";
+            value = "1";
+        } else if (opt != 'c') {
+            for (const struct option *o = long_options; o->name != NULL; o++) {
+                if (o->val == opt) {
+                    name = o->name;
+                    break;
+                }
+            }
+        }
+        if (name != NULL && params_set(name, value) != 0) {
+            exit(1);
+        }
+    }
+    params_finish();
+}
+
+static volatile sig_atomic_t should_quit = 0;
+
+static void handle_quit_signal(int sig) {
+    (void)sig;
+    should_quit = 1;
+}
+
+static void sleep_ms(unsigned long long ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    decode_init();
+    printf("PRINT decoder: %s\n", decode_impl_name());
+    text_init();
+    printf("text newline scanner: %s\n", text_impl_name());
+    span_init();
+    printf("rectangle kernels: %s\n", span_impl_name());
+    program_init();
+    printf("pixel programs: %s\n", program_impl_name());
     canvas_start();
-    net_start();
+    region_start();
+#ifndef PFS_HEADLESS
+    sinks_add(params.headless ? &sink_null : &sink_sdl);
+#else
+    sinks_add(&sink_null);
+#endif
+    if (params.snapshot_path != NULL) {
+        sinks_add(&sink_ppm);
+    }
+    if (params.checkpoint_path != NULL) {
+        sinks_add(&sink_checkpoint);
+    }
+    if (params.stream_port != 0) {
+        sinks_add(&sink_stream);
+    }
+    sinks_start();
+    signal(SIGINT, handle_quit_signal);
+    signal(SIGTERM, handle_quit_signal);
+    net_start(params.num_workers, params.backend);
+    if (params.metrics_port != 0) {
+        metrics_start();
+    }
 
-    while (!canvas_should_quit()) {
-        unsigned long long before_drawing = SDL_GetTicks64();
-        canvas_draw();
-        unsigned long long drawing_time = SDL_GetTicks64() - before_drawing;
+    // without a sink that needs frames, this loop only checks for quitting
+    int need_frames = sinks_need_frames();
+    struct canvas_stats last_stats = {0};
+    struct net_stats last_net_stats = {0};
+    unsigned long long last_stats_time = clock_now_us() / 1000;
+    while (!should_quit && !sinks_should_quit()) {
+        unsigned long long before_drawing = clock_now_us() / 1000;
+        if (need_frames) {
+            unsigned long long frame_start = clock_now_us();
+            sinks_frame(canvas_update_frame());
+            metrics_record_frame(clock_now_us() - frame_start);
+        }
+        metrics_poll();
+        if (before_drawing - last_stats_time >= STATS_INTERVAL_MS) {
+            if (need_frames) {
+                struct canvas_stats now;
+                canvas_get_stats(&now);
+                unsigned long long frames = now.frames - last_stats.frames;
+                printf("canvas: %llu frames, %llu bytes copied per frame in %llu rects\n", frames,
+                        (now.bytes_copied - last_stats.bytes_copied) / frames, (now.rects - last_stats.rects) / frames);
+                last_stats = now;
+            }
+            struct net_stats net_now;
+            net_get_stats(&net_now);
+            unsigned long long accepts = net_now.accepts - last_net_stats.accepts;
+            printf("net: %llu open, %llu accepts (%llu ns each), %llu KiB in connection slots\n", net_now.open_conns,
+                    accepts, accepts > 0 ? (net_now.accept_ns - last_net_stats.accept_ns) / accepts : 0,
+                    net_now.slot_bytes / 1024);
+            last_net_stats = net_now;
+            if (params.checkpoint_path != NULL) {
+                struct checkpoint_stats cp;
+                checkpoint_get_stats(&cp);
+                printf("checkpoints: %llu, %llu bytes written, %llu us on average, %llu us max per frame\n",
+                        cp.checkpoints, cp.bytes_written, cp.checkpoints > 0 ? cp.total_us / cp.checkpoints : 0,
+                        cp.max_frame_us);
+            }
+            last_stats_time = before_drawing;
+        }
+        unsigned long long drawing_time = clock_now_us() / 1000 - before_drawing;
         if (drawing_time > MS_PER_FRAME)
             drawing_time = MS_PER_FRAME;
-        SDL_Delay(MS_PER_FRAME - drawing_time);
+        sleep_ms(MS_PER_FRAME - drawing_time);
     }
 
+    metrics_stop();
     net_stop();
+    sinks_stop();
+    region_stop();
     canvas_stop();
 }
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "param.h"
+#include "common.h"
+#include "canvas.h"
+#include "connection.h"
+#include "sink.h"
+#include "net.h"
+#include "metrics.h"
+#include "udp.h"
+
+// The endpoint is served from the main loop with nonblocking sockets: a scraper connects, sends its request and
+// gets the current values, then the connection is closed. Only requests to 127.0.0.1 are accepted.
+
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_REQUEST_TIMEOUT_US 1000000 // clients that don't send a request in time are dropped
+#define METRICS_RESPONSE_SIZE 16384
+
+// same order as METRICS_OPCODES
+const unsigned char metrics_opcode_index[256] = {
+    ['I'] = 1, ['P'] = 2, ['G'] = 3, ['p'] = 4, ['f'] = 5, ['g'] = 6, ['a'] = 7, ['u'] = 8, ['x'] = 9, ['k'] = 10,
+    ['c'] = 11, ['b'] = 12, ['q'] = 13, ['Q'] = 14, ['M'] = 15,
+};
+
+struct metrics_client {
+    int fd; // -1 = free
+    unsigned long long accepted_us;
+};
+
+static int listen_fd = -1;
+static struct metrics_client clients[METRICS_MAX_CLIENTS];
+static struct metrics_histogram frames; // only touched by the main thread
+static char response[METRICS_RESPONSE_SIZE];
+static size_t response_size;
+
+// the structs only consist of unsigned long long, so they are added up word by word
+static void add_words(unsigned long long *dst, const unsigned long long *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_counters_add(struct metrics_counters *dst, const struct metrics_counters *src) {
+    unsigned long long *d = (unsigned long long *)dst;
+    const unsigned long long *s = (const unsigned long long *)src;
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(*d); i++) {
+        metrics_inc(&d[i], s[i]);
+    }
+}
+
+void metrics_histogram_record(struct metrics_histogram *h, unsigned long long us) {
+    unsigned int bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && us >= 1ULL << bucket) {
+        bucket += 1;
+    }
+    metrics_inc(&h->buckets[bucket], 1);
+    metrics_inc(&h->count, 1);
+    metrics_inc(&h->sum_us, us);
+}
+
+void metrics_sum(struct metrics *sum, const struct metrics *m) {
+    add_words((unsigned long long *)&sum->counters, (const unsigned long long *)&m->counters,
+            sizeof(m->counters) / sizeof(unsigned long long));
+    sum->epoll_waits += __atomic_load_n(&m->epoll_waits, __ATOMIC_RELAXED);
+    sum->uring_enters += __atomic_load_n(&m->uring_enters, __ATOMIC_RELAXED);
+    add_words((unsigned long long *)&sum->rounds, (const unsigned long long *)&m->rounds,
+            sizeof(m->rounds) / sizeof(unsigned long long));
+}
+
+void metrics_record_frame(unsigned long long us) {
+    metrics_histogram_record(&frames, us);
+}
+
+__attribute__((format(printf, 1, 2)))
+static void out(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(response + response_size, sizeof(response) - response_size, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        response_size += n;
+        if (response_size > sizeof(response) - 1) {
+            response_size = sizeof(response) - 1; // cut off, the buffer is big enough for everything we have
+        }
+    }
+}
+
+static void out_metric(const char *name, const char *type, const char *help) {
+    out("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void out_counter(const char *name, const char *help, unsigned long long value) {
+    out_metric(name, "counter", help);
+    out("%s %llu\n", name, value);
+}
+
+static void out_gauge(const char *name, const char *help, unsigned long long value) {
+    out_metric(name, "gauge", help);
+    out("%s %llu\n", name, value);
+}
+
+static void out_histogram(const char *name, const char *help, const struct metrics_histogram *h) {
+    out_metric(name, "histogram", help);
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += h->buckets[i];
+        out("%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << i) / 1e6, cumulative);
+    }
+    out("%s_bucket{le=\"+Inf\"} %llu\n", name, h->count);
+    out("%s_sum %g\n", name, (double)h->sum_us / 1e6);
+    out("%s_count %llu\n", name, h->count);
+}
+
+static void format_response(void) {
+    struct metrics m;
+    struct net_stats net;
+    memset(&m, 0, sizeof(m));
+    net_get_metrics(&m);
+    net_get_stats(&net);
+    struct udp_stats us = {0};
+    if (params.udp_port != 0) {
+        udp_get_stats(&us);
+    }
+    const struct metrics_counters *c = &m.counters;
+
+    response_size = 0;
+    out("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    out_counter("pfs_received_bytes_total", "Bytes received from clients.", c->bytes_in);
+    out_counter("pfs_sent_bytes_total", "Bytes of responses to clients.", c->bytes_out);
+    out_counter("pfs_drawn_pixels_total", "Pixels drawn by clients, including the ones outside the canvas.",
+            c->pixels_drawn);
+    out_counter("pfs_read_pixels_total", "Pixels read by clients.", c->pixels_read);
+
+    out_metric("pfs_commands_total", "counter", "Commands by opcode.");
+    for (size_t i = 0; i < METRICS_NUM_OPCODES - 1; i++) {
+        out("pfs_commands_total{op=\"%c\"} %llu\n", METRICS_OPCODES[i], c->commands[i + 1]);
+    }
+    out("pfs_commands_total{op=\"other\"} %llu\n", c->commands[0]);
+
+    out_metric("pfs_syscalls_total", "counter", "Syscalls of the network workers.");
+    out("pfs_syscalls_total{call=\"read\"} %llu\n", c->reads);
+    out("pfs_syscalls_total{call=\"write\"} %llu\n", c->writes);
+    out("pfs_syscalls_total{call=\"epoll_wait\"} %llu\n", m.epoll_waits);
+    out("pfs_syscalls_total{call=\"io_uring_enter\"} %llu\n", m.uring_enters);
+    if (params.udp_port != 0) {
+        out("pfs_syscalls_total{call=\"recvmmsg\"} %llu\n", us.syscalls);
+    }
+
+    out_metric("pfs_throttles_total", "counter", "Times a connection had to stop, by reason.");
+    out("pfs_throttles_total{reason=\"quota\"} %llu\n", c->throttles[METRICS_THROTTLE_QUOTA]);
+    out("pfs_throttles_total{reason=\"sendbuf\"} %llu\n", c->throttles[METRICS_THROTTLE_SENDBUF]);
+
+    out_histogram("pfs_round_duration_seconds", "Time a network worker spent stepping its scheduled connections.",
+            &m.rounds);
+    out_histogram("pfs_frame_duration_seconds", "Time the main loop spent on a frame.", &frames);
+
+    out_gauge("pfs_open_connections", "Open connections.", net.open_conns);
+    out_counter("pfs_accepts_total", "Accepted connections.", net.accepts);
+    out_gauge("pfs_connection_slot_bytes", "Memory of the connection slots that have been used so far.",
+            net.slot_bytes);
+
+    if (params.udp_port != 0) {
+        out_counter("pfs_udp_datagrams_total", "Datagrams received on the udp port.", us.datagrams);
+        out_counter("pfs_udp_limited_pixels_total", "PRINT commands over udp dropped by the per-ip rate.",
+                us.limited_pixels);
+    }
+
+    struct canvas_stats cs;
+    canvas_get_stats(&cs);
+    out_counter("pfs_frames_total", "Frames taken from the canvas.", cs.frames);
+    out_counter("pfs_frame_copied_bytes_total", "Bytes copied from the canvas into frames.", cs.bytes_copied);
+    if (params.checkpoint_path != NULL) {
+        struct checkpoint_stats cp;
+        checkpoint_get_stats(&cp);
+        out_counter("pfs_checkpoints_total", "Completed checkpoints.", cp.checkpoints);
+        out_counter("pfs_checkpoint_written_bytes_total", "Bytes copied into the checkpoint file.", cp.bytes_written);
+    }
+}
+
+void metrics_start(void) {
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int should_reuse_address = 1;
+    if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &should_reuse_address,
+                sizeof(should_reuse_address)) != 0) {
+        perror("metrics socket");
+        exit(1);
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(params.metrics_port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+        perror("metrics bind");
+        exit(1);
+    }
+    set_nonblocking(listen_fd);
+    printf("metrics on 127.0.0.1:%d\n", params.metrics_port);
+}
+
+static void client_close(struct metrics_client *mc) {
+    close(mc->fd);
+    mc->fd = -1;
+}
+
+// the request itself is not looked at, every request gets the metrics
+static void client_poll(struct metrics_client *mc, unsigned long long now) {
+    char request[1024];
+    ssize_t status = recv(mc->fd, request, sizeof(request), MSG_DONTWAIT);
+    if (WOULD_BLOCK(status)) {
+        if (now - mc->accepted_us > METRICS_REQUEST_TIMEOUT_US) {
+            client_close(mc);
+        }
+        return;
+    }
+    if (status > 0) {
+        if (response_size == 0) {
+            format_response(); // once per tick for all clients
+        }
+        // fits into the empty socket buffer, a client that does not take it only gets part of it
+        send(mc->fd, response, response_size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    client_close(mc);
+}
+
+void metrics_poll(void) {
+    if (listen_fd == -1) {
+        return;
+    }
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+        struct metrics_client *mc = NULL;
+        for (int i = 0; i < METRICS_MAX_CLIENTS && mc == NULL; i++) {
+            if (clients[i].fd == -1) {
+                mc = &clients[i];
+            }
+        }
+        if (mc == NULL) {
+            close(fd); // scrapers only come every few seconds
+            continue;
+        }
+        mc->fd = fd;
+        mc->accepted_us = clock_now_us();
+    }
+    unsigned long long now = clock_now_us();
+    response_size = 0;
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            client_poll(&clients[i], now);
+        }
+    }
+}
+
+void metrics_stop(void) {
+    if (listen_fd == -1) {
+        return;
+    }
+    for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            client_close(&clients[i]);
+        }
+    }
+    close(listen_fd);
+    listen_fd = -1;
+}
@@ -0,0 +1,64 @@
+#ifndef PFS_METRICS_H
+#define PFS_METRICS_H
+
+// Counters for the metrics endpoint on 127.0.0.1:params.metrics_port (Prometheus text format, see README).
+// Every network worker owns a struct metrics and is the only thread writing to it. A connection step counts into
+// a struct metrics_counters on the stack, which is added to the connection's tracker and to the worker's counters
+// once at the end of the step. The endpoint only sums up the workers when it is scraped.
+
+// opcodes counted individually, all other bytes in the opcode position are counted as "other" (index 0)
+#define METRICS_OPCODES "IPGpfgauxkcbqQM"
+#define METRICS_NUM_OPCODES (sizeof(METRICS_OPCODES)) // including "other"
+
+// why a connection could not go on
+#define METRICS_THROTTLE_QUOTA 0 // its token buckets ran dry (see sched.h)
+#define METRICS_THROTTLE_SENDBUF 1 // a response did not fit into its send buffer
+#define METRICS_NUM_THROTTLES 2
+
+struct metrics_counters {
+    unsigned long long bytes_in;
+    unsigned long long bytes_out; // responses put into the send buffer or the chunks of a large RECTANGLE GET
+    unsigned long long pixels_drawn; // charged to the quota, including the ones outside the canvas
+    unsigned long long pixels_read;
+    unsigned long long reads; // read() syscalls, the io_uring backend has none
+    unsigned long long writes; // write() syscalls, same
+    unsigned long long commands[METRICS_NUM_OPCODES];
+    unsigned long long throttles[METRICS_NUM_THROTTLES];
+};
+
+// durations: bucket i counts the ones below 2^i us, the last bucket everything else
+#define METRICS_HISTOGRAM_BUCKETS 24
+struct metrics_histogram {
+    unsigned long long buckets[METRICS_HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum_us;
+};
+
+struct metrics {
+    struct metrics_counters counters;
+    unsigned long long epoll_waits;
+    unsigned long long uring_enters;
+    struct metrics_histogram rounds; // time per round of stepping the scheduled connections
+} __attribute__((aligned(64))); // workers never share a cache line
+
+// index into metrics_counters.commands
+extern const unsigned char metrics_opcode_index[256];
+
+// the updates below are done with relaxed atomic stores, so the endpoint can read concurrently. Only one thread
+// may write to a struct.
+void metrics_counters_add(struct metrics_counters *dst, const struct metrics_counters *src);
+void metrics_histogram_record(struct metrics_histogram *h, unsigned long long us);
+static inline void metrics_inc(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+// reads a struct that another thread writes to and adds it to sum
+void metrics_sum(struct metrics *sum, const struct metrics *m);
+
+void metrics_start(void);
+// time of one tick of the main loop
+void metrics_record_frame(unsigned long long us);
+// answers pending requests, called from the main loop
+void metrics_poll(void);
+void metrics_stop(void);
+
+#endif
@@ -5,108 +5,331 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <fcntl.h>
-#include "SDL.h"
 
+#include "param.h"
 #include "common.h"
 #include "canvas.h"
 #include "connection.h"
+#include "uring.h"
+#include "pool.h"
+#include "metrics.h"
 #include "net.h"
+#include "udp.h"
+#include "local.h"
 
-#define PORT 1337
+// Every worker owns a shard of the connections. It has its own listening socket (SO_REUSEPORT, so the kernel
+// distributes incoming connections between the workers) and its own epoll instance. Connections never move
+// between workers, so nothing in here needs locking.
+//
+// The connections live in the slots of the worker's pool (see pool.h) and never move, so the epoll registration
+// can point to the slot. pool.active[0..num_active] lists the open connections. If one in the middle is closed,
+// the last entry is moved in its spot (like rust's Vec::swap_remove), so when iterating over the list we need to
+// make sure that the one that got swapped is not skipped.
+struct net_worker {
+    pthread_t thread;
+    int id;
+    int sockfd;
+    int epollfd;
+    struct uring *uring; // NULL for the epoll backend
+    struct conn_pool pool;
+    size_t num_scheduled; // connections with c->scheduled set
+    size_t num_throttled; // connections with c->throttled set
+    // read by net_get_stats from the main thread
+    unsigned long long accepts;
+    unsigned long long accept_ns;
+    unsigned long long open_conns;
+    unsigned long long mapped_slots;
+    struct metrics metrics;
+};
 
-// conns[0..num_conns] contains the active connections.
-// if one connection in the middle is removed, conns[num_conns - 1] is moved in its spot.
-// this is like rust's Vec::swap_remove.
-// when iterating over the connections, we need to make sure that the one that got swapped is not skipped.
-#define MAX_CONNS 1024
-struct connection conns[MAX_CONNS];
-size_t num_conns = 0;
-pthread_t net_thread;
+struct net_worker *workers;
+int num_workers;
+int net_backend;
 volatile int should_quit = 0; // written from other thread
+// the unix socket is shared by all workers (EPOLLEXCLUSIVE), its epoll registration points to local_listener_tag
+static int local_fd = -1;
+static char local_listener_tag;
 
-static void handle_new_connection(int sockfd) {
-    if (num_conns == MAX_CONNS) {
-        printf("WARNING: all connections occupied!\n"); // TODO
+#define MAX_EVENTS 256
+// upper bound for blocking in epoll_wait while no connection is scheduled. This is how long it takes to notice should_quit.
+#define IDLE_TIMEOUT_MS 100
+
+static void epoll_register(struct net_worker *w, int op, int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(w->epollfd, op, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        exit(1); // TODO
+    }
+}
+
+#define CONN_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+static void schedule(struct net_worker *w, struct connection *c) {
+    if (!c->scheduled) {
+        c->scheduled = 1;
+        w->num_scheduled += 1;
+    }
+}
+
+static void unschedule(struct net_worker *w, struct connection *c) {
+    if (c->scheduled) {
+        c->scheduled = 0;
+        w->num_scheduled -= 1;
+    }
+}
+
+// readiness events of a throttled connection only update its flags, it is scheduled again by wake_throttled
+static void throttle(struct net_worker *w, struct connection *c) {
+    unschedule(w, c);
+    c->throttled = 1;
+    w->num_throttled += 1;
+}
+
+static void unthrottle(struct net_worker *w, struct connection *c) {
+    if (c->throttled) {
+        c->throttled = 0;
+        w->num_throttled -= 1;
+    }
+}
+
+// schedules the throttled connections whose time is up.
+// returns the timeout in ms for blocking in epoll_wait until the next one wakes up, at most IDLE_TIMEOUT_MS
+static int wake_throttled(struct net_worker *w) {
+    if (w->num_throttled == 0) {
+        return IDLE_TIMEOUT_MS;
+    }
+    unsigned long long now = clock_now_us();
+    unsigned long long next = now + IDLE_TIMEOUT_MS * 1000;
+    for (size_t i = 0; i < w->pool.num_active; i++) {
+        struct connection *c = w->pool.active[i];
+        if (!c->throttled) {
+            continue;
+        }
+        if (c->throttled_until <= now) {
+            unthrottle(w, c);
+            schedule(w, c);
+        } else if (c->throttled_until < next) {
+            next = c->throttled_until;
+        }
+    }
+    return (next - now + 999) / 1000;
+}
+
+static void update_stats(struct net_worker *w) {
+    __atomic_store_n(&w->open_conns, w->pool.num_active, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->mapped_slots, w->pool.num_mapped, __ATOMIC_RELAXED);
+}
+
+// returns NULL if the worker has no free slot
+static struct connection *add_connection(struct net_worker *w, int connfd, struct sockaddr_in connaddr) {
+    unsigned long long start = clock_now_ns();
+    struct connection *c = pool_alloc(&w->pool);
+    if (c == NULL) {
+        printf("WARNING: all connections of worker %d occupied!\n", w->id); // TODO
+        close(connfd);
+        return NULL;
+    }
+    connection_init(c, connfd, connaddr); // connection starts out scheduled
+    w->num_scheduled += 1;
+    if (w->uring != NULL) {
+        uring_conn_open(w->uring, c);
     } else {
+        epoll_register(w, EPOLL_CTL_ADD, connfd, CONN_EVENTS, c);
+    }
+    __atomic_store_n(&w->accept_ns, w->accept_ns + (clock_now_ns() - start), __ATOMIC_RELAXED);
+    __atomic_store_n(&w->accepts, w->accepts + 1, __ATOMIC_RELAXED);
+    update_stats(w);
+
+    printf("accept (worker %d) ", w->id);
+    connection_print(c);
+    return c;
+}
+
+static void handle_new_connections(struct net_worker *w) {
+    while (1) {
         int connfd;
         struct sockaddr_in connaddr;
         socklen_t connlen = sizeof(connaddr);
-        connfd = accept(sockfd, (struct sockaddr *) &connaddr, &connlen);
+        connfd = accept(w->sockfd, (struct sockaddr *) &connaddr, &connlen);
         if (IS_REAL_ERROR(connfd)) {
             perror("accept");
             exit(1); // TODO
-        } else if (connfd != -1) { // we found a new connection (no error and no wouldblock)
-            struct connection *c = &conns[num_conns];
-            connection_init(c, connfd, connaddr);
-            num_conns += 1;
-
-            printf("accept ");
-            connection_print(c);
+        } else if (connfd == -1) { // wouldblock: backlog is empty
+            return;
         }
+        add_connection(w, connfd, connaddr);
+    }
+}
+
+// one connection per event, the other workers that are waiting get the next ones
+static void handle_new_local_connection(struct net_worker *w) {
+    int connfd = accept(local_fd, NULL, NULL);
+    if (IS_REAL_ERROR(connfd)) {
+        perror("accept");
+        exit(1); // TODO
+    } else if (connfd == -1) { // another worker was faster
+        return;
+    }
+    struct sockaddr_in connaddr = {0}; // local connections count as 127.0.0.1
+    connaddr.sin_family = AF_INET;
+    connaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct connection *c = add_connection(w, connfd, connaddr);
+    if (c != NULL) {
+        c->local = local_conn_new();
+    }
+}
+
+static void uring_on_accept(void *arg, int connfd) {
+    struct sockaddr_in connaddr = {0};
+    socklen_t connlen = sizeof(connaddr);
+    getpeername(connfd, (struct sockaddr *) &connaddr, &connlen);
+    add_connection(arg, connfd, connaddr);
+}
+
+static void uring_on_ready(void *arg, struct connection *c) {
+    if (!c->throttled) {
+        schedule(arg, c);
     }
 }
 
-static void close_and_swap(struct connection *c, const char *msg_prefix) {
+static void uring_on_release(void *arg, struct connection *c) {
+    struct net_worker *w = arg;
+    pool_free(&w->pool, c);
+}
+
+static void handle_event(struct net_worker *w, const struct epoll_event *ev) {
+    struct connection *c = ev->data.ptr;
+    if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        c->readable = 1; // the following read() reports EOF or the error
+    }
+    if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        c->writable = 1;
+    }
+    if (!c->throttled) {
+        schedule(w, c);
+    }
+}
+
+static void close_connection(struct net_worker *w, struct connection *c, const char *msg_prefix) {
     printf("%s ", msg_prefix);
     connection_print(c);
 
-    connection_close(c);
-
-    // move highest connection to this spot (no inactive connections between the active ones)
-    struct connection *last = &conns[num_conns - 1];
-    if (c != last) {
-        memcpy(c, last, sizeof(*c));
+    unschedule(w, c);
+    unthrottle(w, c);
+    pool_deactivate(&w->pool, c);
+    // closing the fd also removes it from epoll
+    if (!connection_close(c)) {
+        pool_free(&w->pool, c);
     }
-    num_conns -= 1;
+    update_stats(w);
 }
 
-static void *net_thread_main(void *arg) {
-    int sockfd = (int)(intptr_t)arg;
+static void step_scheduled(struct net_worker *w) {
+    if (w->num_scheduled == 0) {
+        return;
+    }
+    unsigned long long start = clock_now_us();
+    for (size_t i = 0; i < w->pool.num_active; i++) {
+        struct connection *c = w->pool.active[i];
+        if (c->fd == -1) {
+            printf("connection not used?\n");
+            exit(1); // TODO
+        }
+        if (!c->scheduled) {
+            continue;
+        }
 
-    while (!should_quit) {
-        handle_new_connection(sockfd);
+        int status = connection_step(c, &w->metrics.counters);
+        if (status == CONNECTION_YIELD) {
+            // stays scheduled.
+        } else if (status == CONNECTION_OK) {
+            unschedule(w, c); // wait for the next readiness event
+        } else if (status == CONNECTION_THROTTLED) {
+            throttle(w, c);
+        } else if (status == CONNECTION_ERR) {
+            close_connection(w, c, "error in");
+            i -= 1; // connection at this index is now another one
+            continue;
+        } else if (status == CONNECTION_END) {
+            close_connection(w, c, "close");
+            i -= 1; // connection at this index is now another one
+            continue;
+        } else {
+            printf("what.\n");
+            exit(1); // TODO
+        }
+    }
+    metrics_histogram_record(&w->metrics.rounds, clock_now_us() - start);
+}
 
-        for (size_t i = 0; i < num_conns; i++) {
-            struct connection *c = &conns[i];
-            if (c->fd == -1) {
-                printf("connection not used?\n");
-                exit(1); // TODO
-            }
+static void run_epoll(struct net_worker *w) {
+    struct epoll_event events[MAX_EVENTS];
 
-            int status = connection_step(c);
-            if (status == CONNECTION_OK) {
-                // ok.
-            } else if (status == CONNECTION_ERR) {
-                close_and_swap(c, "error in");
-                i -= 1; // connection at this index is now another one
-                continue;
-            } else if (status == CONNECTION_END) {
-                close_and_swap(c, "close");
-                i -= 1; // connection at this index is now another one
-                continue;
+    while (!should_quit) {
+        // only block if there is nothing left to do from the last round
+        int timeout = wake_throttled(w);
+        int n = epoll_wait(w->epollfd, events, MAX_EVENTS, w->num_scheduled > 0 ? 0 : timeout);
+        metrics_inc(&w->metrics.epoll_waits, 1);
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1); // TODO
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                handle_new_connections(w);
+            } else if (events[i].data.ptr == &local_listener_tag) {
+                handle_new_local_connection(w);
             } else {
-                printf("what.\n");
-                exit(1); // TODO
+                handle_event(w, &events[i]);
             }
         }
+        step_scheduled(w);
+    }
+}
+
+static void run_uring(struct net_worker *w) {
+    while (!should_quit) {
+        // submits the sends queued in the last round, then reaps all completions
+        int timeout = wake_throttled(w);
+        uring_poll(w->uring, w->num_scheduled > 0 ? 0 : timeout, uring_on_accept, uring_on_ready, uring_on_release, w);
+        __atomic_store_n(&w->metrics.uring_enters, uring_enter_count(w->uring), __ATOMIC_RELAXED);
+        step_scheduled(w);
     }
+}
 
-    printf("closing network\n");
-    for (size_t i = 0; i < num_conns; i++) {
-        if (conns[i].fd != -1) {
-            connection_close(&conns[i]);
+static void *net_thread_main(void *arg) {
+    struct net_worker *w = arg;
+
+    if (net_backend == NET_BACKEND_URING) {
+        w->uring = uring_create(w->sockfd); // created here because the ring is restricted to a single thread
+        run_uring(w);
+    } else {
+        run_epoll(w);
+    }
+
+    for (size_t i = 0; i < w->pool.num_active; i++) {
+        if (w->pool.active[i]->fd != -1) {
+            connection_close(w->pool.active[i]);
         } else {
             printf("connection not used?\n");
             exit(1); // TODO
         }
     }
-    close(sockfd);
+    close(w->sockfd);
+    close(w->epollfd);
+    if (w->uring != NULL) {
+        uring_destroy(w->uring);
+    }
+    pool_destroy(&w->pool);
     return NULL;
 }
 
-void net_start(void) {
+static int open_listener(void) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) {
         perror("socket");
@@ -121,11 +344,18 @@ void net_start(void) {
         perror("setsockopt");
         exit(1);
     }
+    /* every worker binds its own socket to the port, the kernel load balances between them */
+    int should_reuse_port = 1;
+    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &should_reuse_port,
+        sizeof(should_reuse_port))) {
+        perror("setsockopt");
+        exit(1);
+    }
 
     struct sockaddr_in servaddr = {0};
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT);
+    servaddr.sin_port = htons(params.port);
 
     if (bind(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) != 0) {
         perror("bind");
@@ -138,14 +368,100 @@ void net_start(void) {
     }
 
     set_nonblocking(sockfd);
+    return sockfd;
+}
 
-    if (pthread_create(&net_thread, NULL, net_thread_main, (void*)(intptr_t)sockfd) != 0) {
-        printf("pthread_create\n");
+void net_start(int nworkers, int backend) {
+    if (nworkers <= 0) {
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers <= 0) {
+            nworkers = 1;
+        }
+    }
+    num_workers = nworkers;
+    net_backend = backend;
+    workers = aligned_alloc(64, num_workers * sizeof(*workers)); // the size is a multiple of the alignment
+    if (workers == NULL) {
+        perror("aligned_alloc");
         exit(1);
     }
+    memset(workers, 0, num_workers * sizeof(*workers));
+    printf("starting %d network worker(s) (%s)\n", num_workers, backend == NET_BACKEND_URING ? "io_uring" : "epoll");
+    printf("connection slot: %zu bytes (%zu hot, %zu cold, %zu buffers)\n",
+            sizeof(struct connection) + sizeof(struct connection_cold) + params.recv_buf_size + params.send_buf_size,
+            sizeof(struct connection), sizeof(struct connection_cold), params.recv_buf_size + params.send_buf_size);
+
+    if (params.unix_socket_path != NULL) {
+        if (backend == NET_BACKEND_URING) {
+            printf("the unix socket needs the epoll backend\n");
+            exit(1);
+        }
+        local_fd = local_listen();
+    }
+    // all listeners are bound before any worker starts accepting
+    for (int i = 0; i < num_workers; i++) {
+        struct net_worker *w = &workers[i];
+        w->id = i;
+        pool_init(&w->pool, (params.max_conns + num_workers - 1) / num_workers,
+                params.recv_buf_size, params.send_buf_size);
+        w->sockfd = open_listener();
+        w->epollfd = epoll_create1(0);
+        if (w->epollfd == -1) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        // listening socket stays level-triggered, it is drained completely on every event anyway
+        epoll_register(w, EPOLL_CTL_ADD, w->sockfd, EPOLLIN, NULL);
+        if (local_fd != -1) {
+            epoll_register(w, EPOLL_CTL_ADD, local_fd, EPOLLIN | EPOLLEXCLUSIVE, &local_listener_tag);
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, net_thread_main, &workers[i]) != 0) {
+            printf("pthread_create\n");
+            exit(1);
+        }
+    }
+    if (params.udp_port != 0) {
+        udp_start();
+    }
 }
 
 void net_stop(void) {
     should_quit = 1;
-    pthread_join(net_thread, NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (params.udp_port != 0) {
+        udp_stop();
+    }
+    if (local_fd != -1) {
+        close(local_fd);
+        unlink(params.unix_socket_path);
+        local_fd = -1;
+    }
+    printf("closing network\n");
+    free(workers);
+    workers = NULL;
+}
+
+void net_get_stats(struct net_stats *s) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < num_workers; i++) {
+        struct net_worker *w = &workers[i];
+        s->accepts += __atomic_load_n(&w->accepts, __ATOMIC_RELAXED);
+        s->accept_ns += __atomic_load_n(&w->accept_ns, __ATOMIC_RELAXED);
+        s->open_conns += __atomic_load_n(&w->open_conns, __ATOMIC_RELAXED);
+        s->slot_bytes += __atomic_load_n(&w->mapped_slots, __ATOMIC_RELAXED) * pool_slot_size(&w->pool);
+    }
+}
+
+void net_get_metrics(struct metrics *sum) {
+    for (int i = 0; i < num_workers; i++) {
+        metrics_sum(sum, &workers[i].metrics);
+    }
+    if (params.udp_port != 0) {
+        udp_get_metrics(sum);
+    }
 }
@@ -1,7 +1,25 @@
 #ifndef PFS_NET_H
 #define PFS_NET_H
 
-void net_start(void);
+struct metrics;
+
+#define NET_BACKEND_EPOLL 0
+#define NET_BACKEND_URING 1
+
+// starts num_workers network threads. num_workers <= 0 means one per online cpu core.
+void net_start(int num_workers, int backend);
 void net_stop(void);
 
+struct net_stats {
+    unsigned long long accepts;
+    unsigned long long accept_ns; // time spent setting up accepted connections
+    unsigned long long open_conns;
+    unsigned long long slot_bytes; // memory of the connection slots that have been used so far
+};
+
+// sums the counters of all workers
+void net_get_stats(struct net_stats *s);
+// adds the metrics of all workers to sum (see metrics.h)
+void net_get_metrics(struct metrics *sum);
+
 #endif
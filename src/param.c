@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "param.h"
+#include "buffer.h"
+#include "sched.h"
+#include "net.h"
+#include "canvas.h"
+#include "region.h"
+
+struct params params = {
+    .tex_size_x = DEFAULT_TEX_SIZE_X,
+    .tex_size_y = DEFAULT_TEX_SIZE_Y,
+    .recv_buf_size = DEFAULT_CONN_BUF_SIZE,
+    .send_buf_size = DEFAULT_CONN_BUF_SIZE,
+    .port = DEFAULT_PORT,
+    .max_conns = DEFAULT_MAX_CONNS,
+    .backend = NET_BACKEND_EPOLL,
+#ifdef PFS_HEADLESS
+    .headless = 1,
+#endif
+    .snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL,
+    .checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL,
+    .udp_workers = DEFAULT_UDP_WORKERS,
+};
+
+#define OPT_UINT 0
+#define OPT_INT 1
+#define OPT_SIZE 2
+#define OPT_ULL 3
+#define OPT_BACKEND 4 // 1 = io_uring, 0 = epoll
+#define OPT_STRING 5 // min and max are unused
+#define OPT_DRAW_MODE 6 // one of draw_mode_names, min and max are unused
+#define OPT_REGION 7 // "ip x y w h", added to region_config, min and max are unused
+
+// indexed by DRAW_*
+static const char *const draw_mode_names[] = { "overwrite", "average", "blend" };
+
+struct option_desc {
+    const char *name;
+    int type;
+    void *ptr;
+    unsigned long long min;
+    unsigned long long max;
+};
+
+static const struct option_desc options[] = {
+    { "width", OPT_UINT, &params.tex_size_x, 1, MAX_TEX_SIZE },
+    { "height", OPT_UINT, &params.tex_size_y, 1, MAX_TEX_SIZE },
+    { "screen-width", OPT_UINT, &params.screen_size_x, 0, MAX_TEX_SIZE },
+    { "screen-height", OPT_UINT, &params.screen_size_y, 0, MAX_TEX_SIZE },
+    { "recv-buf", OPT_SIZE, &params.recv_buf_size, MIN_CONN_BUF_SIZE, MAX_CONN_BUF_SIZE },
+    { "send-buf", OPT_SIZE, &params.send_buf_size, MIN_CONN_BUF_SIZE, MAX_CONN_BUF_SIZE },
+    { "port", OPT_INT, &params.port, 0, 65535 },
+    { "max-conns", OPT_INT, &params.max_conns, 1, 1 << 20 },
+    { "workers", OPT_INT, &params.num_workers, 0, 1024 },
+    { "io-uring", OPT_BACKEND, &params.backend, 0, 1 },
+#ifdef PFS_HEADLESS
+    { "headless", OPT_INT, &params.headless, 1, 1 }, // built without SDL
+#else
+    { "headless", OPT_INT, &params.headless, 0, 1 },
+#endif
+    { "snapshot", OPT_STRING, &params.snapshot_path, 0, 0 },
+    { "snapshot-interval", OPT_UINT, &params.snapshot_interval, 1, 24 * 3600 },
+    { "checkpoint", OPT_STRING, &params.checkpoint_path, 0, 0 },
+    { "checkpoint-interval", OPT_UINT, &params.checkpoint_interval, 10, 3600 * 1000 },
+    { "draw-mode", OPT_DRAW_MODE, &params.draw_mode, 0, 0 },
+    { "split-screen", OPT_UINT, &region_config.split_screen, 0, MAX_SPLIT_SCREEN },
+    { "region", OPT_REGION, &region_config, 0, 0 },
+    { "stream-port", OPT_INT, &params.stream_port, 0, 65535 },
+    { "metrics-port", OPT_INT, &params.metrics_port, 0, 65535 },
+    { "udp-port", OPT_INT, &params.udp_port, 0, 65535 },
+    { "udp-workers", OPT_INT, &params.udp_workers, 1, 1024 },
+    { "unix-socket", OPT_STRING, &params.unix_socket_path, 0, 0 },
+    { "zerocopy", OPT_INT, &params.zerocopy, 0, 1 },
+    { "conn-pixels", OPT_ULL, &quota_config.conn_pixels, 0, 1ULL << 40 },
+    { "conn-bytes", OPT_ULL, &quota_config.conn_bytes, 0, 1ULL << 40 },
+    { "ip-pixels", OPT_ULL, &quota_config.ip_pixels, 0, 1ULL << 40 },
+    { "ip-bytes", OPT_ULL, &quota_config.ip_bytes, 0, 1ULL << 40 },
+    { "udp-pixels", OPT_ULL, &quota_config.udp_pixels, 0, 1ULL << 40 },
+};
+
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+int params_set(const char *name, const char *value) {
+    const struct option_desc *o = NULL;
+    for (size_t i = 0; i < NUM_OPTIONS; i++) {
+        if (strcmp(options[i].name, name) == 0) {
+            o = &options[i];
+            break;
+        }
+    }
+    if (o == NULL) {
+        printf("unknown option '%s'\n", name);
+        return -1;
+    }
+    if (o->type == OPT_STRING) {
+        char *copy = strdup(value);
+        if (copy == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        *(const char **)o->ptr = copy; // lives until the server exits
+        return 0;
+    }
+    if (o->type == OPT_DRAW_MODE) {
+        for (size_t i = 0; i < sizeof(draw_mode_names) / sizeof(draw_mode_names[0]); i++) {
+            if (strcmp(value, draw_mode_names[i]) == 0) {
+                *(int *)o->ptr = i;
+                return 0;
+            }
+        }
+        printf("invalid value '%s' for option '%s' (allowed: overwrite, average, blend)\n", value, name);
+        return -1;
+    }
+    if (o->type == OPT_REGION) {
+        if (region_config_add(value) != 0) {
+            printf("invalid value '%s' for option '%s' (expected: ip x y w h)\n", value, name);
+            return -1;
+        }
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-' || v < o->min || v > o->max) {
+        printf("invalid value '%s' for option '%s' (allowed: %llu..%llu)\n", value, name, o->min, o->max);
+        return -1;
+    }
+    switch (o->type) {
+    case OPT_UINT:
+        *(unsigned int *)o->ptr = v;
+        break;
+    case OPT_INT:
+        *(int *)o->ptr = v;
+        break;
+    case OPT_SIZE:
+        *(size_t *)o->ptr = v;
+        break;
+    case OPT_ULL:
+        *(unsigned long long *)o->ptr = v;
+        break;
+    case OPT_BACKEND:
+        *(int *)o->ptr = v ? NET_BACKEND_URING : NET_BACKEND_EPOLL;
+        break;
+    case OPT_STRING:
+    case OPT_DRAW_MODE:
+    case OPT_REGION:
+        break; // handled above
+    }
+    return 0;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+void params_load_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno += 1;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *name = trim(line);
+        if (*name == '\0') {
+            continue;
+        }
+        char *eq = strchr(name, '=');
+        if (eq == NULL) {
+            printf("%s:%d: expected 'name = value'\n", path, lineno);
+            exit(1);
+        }
+        *eq = '\0';
+        if (params_set(trim(name), trim(eq + 1)) != 0) {
+            printf("%s:%d: invalid line\n", path, lineno);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+void params_finish(void) {
+    if (params.screen_size_x == 0) {
+        params.screen_size_x = params.tex_size_x;
+    }
+    if (params.screen_size_y == 0) {
+        params.screen_size_y = params.tex_size_y;
+    }
+    // report the sizes the buffers really get
+    params.recv_buf_size = buffer_round_capacity(params.recv_buf_size);
+    params.send_buf_size = buffer_round_capacity(params.send_buf_size);
+}
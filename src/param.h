@@ -1,10 +1,58 @@
 #ifndef PFS_PARAM_H
 #define PFS_PARAM_H
 
-#define CONN_BUF_SIZE 1024
-#define TEX_SIZE_X 512
-#define TEX_SIZE_Y 512
-#define SCREEN_SIZE_X 512
-#define SCREEN_SIZE_Y 512
+#include <stddef.h>
+
+// defaults, see struct params
+#define DEFAULT_CONN_BUF_SIZE 4096
+#define DEFAULT_TEX_SIZE_X 512
+#define DEFAULT_TEX_SIZE_Y 512
+#define DEFAULT_PORT 1337
+#define DEFAULT_MAX_CONNS 1024 // total number of connections, split evenly between the workers
+#define DEFAULT_SNAPSHOT_INTERVAL 10 // seconds
+#define DEFAULT_CHECKPOINT_INTERVAL 1000 // ms
+#define DEFAULT_UDP_WORKERS 1
+
+// limits: coordinates are 16 bit in the protocol, buffers must hold the INFO response
+#define MAX_TEX_SIZE 16384
+#define MIN_CONN_BUF_SIZE 16
+#define MAX_CONN_BUF_SIZE (64 * 1024 * 1024)
+
+// Runtime configuration. Filled from the command line and the config file before anything starts,
+// read-only afterwards.
+struct params {
+    unsigned int tex_size_x;
+    unsigned int tex_size_y;
+    unsigned int screen_size_x; // window size, 0 = same as the canvas
+    unsigned int screen_size_y;
+    size_t recv_buf_size; // per connection, rounded up to a power of two of at least one page
+    size_t send_buf_size;
+    int port;
+    int max_conns;
+    int num_workers; // 0 = number of cpu cores
+    int backend; // NET_BACKEND_*
+    int headless; // no window, always set if built with HEADLESS=1
+    const char *snapshot_path; // NULL = no snapshots
+    unsigned int snapshot_interval; // seconds
+    const char *checkpoint_path; // NULL = no checkpoints
+    unsigned int checkpoint_interval; // ms
+    int draw_mode; // DRAW_* (canvas.h)
+    int stream_port; // 0 = no streaming
+    int metrics_port; // 0 = no metrics endpoint
+    int udp_port; // 0 = no udp ingest
+    int udp_workers;
+    const char *unix_socket_path; // NULL = no unix socket
+    int zerocopy; // large RECTANGLE GET responses are sent with MSG_ZEROCOPY, see bulk.h
+};
+
+extern struct params params;
+
+// sets a single option by its long name (see README), also used for the quotas in sched.h.
+// returns 0 on success, -1 if the name is unknown or the value is invalid.
+int params_set(const char *name, const char *value);
+// reads "name = value" lines, '#' starts a comment. exits on errors.
+void params_load_file(const char *path);
+// fills in derived values
+void params_finish(void);
 
 #endif
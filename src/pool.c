@@ -0,0 +1,102 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "connection.h"
+#include "pool.h"
+
+static void *alloc_or_exit(size_t alignment, size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    void *p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (p == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(p, 0, size);
+    return p;
+}
+
+void pool_init(struct conn_pool *p, size_t max_conns, size_t recv_capacity, size_t send_capacity) {
+    memset(p, 0, sizeof(*p));
+    p->max_conns = max_conns;
+    p->recv_capacity = recv_capacity;
+    p->send_capacity = send_capacity;
+    p->slots = alloc_or_exit(64, max_conns * sizeof(*p->slots));
+    p->cold = alloc_or_exit(64, max_conns * sizeof(*p->cold));
+    p->active = alloc_or_exit(64, max_conns * sizeof(*p->active));
+    p->free = alloc_or_exit(64, max_conns * sizeof(*p->free));
+    for (size_t i = 0; i < max_conns; i++) {
+        p->slots[i].fd = -1;
+        p->slots[i].cold = &p->cold[i];
+        p->free[i] = max_conns - 1 - i; // lowest slots are used first
+    }
+    p->num_free = max_conns;
+
+    // the file only gets memory for pages that are touched
+    size_t file_size = max_conns * (recv_capacity + send_capacity);
+    p->arena_fd = memfd_create("pfs-conn-buffers", MFD_CLOEXEC);
+    if (p->arena_fd == -1 || ftruncate(p->arena_fd, file_size) != 0) {
+        perror("memfd");
+        exit(1);
+    }
+    p->arena_size = 2 * file_size;
+    p->arena = mmap(NULL, p->arena_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->arena == MAP_FAILED) {
+        perror("mmap arena");
+        exit(1);
+    }
+}
+
+void pool_destroy(struct conn_pool *p) {
+    munmap(p->arena, p->arena_size);
+    close(p->arena_fd);
+    free(p->slots);
+    free(p->cold);
+    free(p->active);
+    free(p->free);
+    memset(p, 0, sizeof(*p));
+}
+
+static void map_buffers(struct conn_pool *p, struct connection *c) {
+    size_t index = c - p->slots;
+    size_t stride = p->recv_capacity + p->send_capacity;
+    unsigned char *addr = p->arena + 2 * stride * index;
+    buffer_map(&c->recvbuf, p->arena_fd, stride * index, addr, p->recv_capacity);
+    buffer_map(&c->sendbuf, p->arena_fd, stride * index + p->recv_capacity, addr + 2 * p->recv_capacity,
+            p->send_capacity);
+    p->num_mapped += 1;
+}
+
+struct connection *pool_alloc(struct conn_pool *p) {
+    if (p->num_free == 0) {
+        return NULL;
+    }
+    p->num_free -= 1;
+    struct connection *c = &p->slots[p->free[p->num_free]];
+    if (c->recvbuf.data == NULL) {
+        map_buffers(p, c);
+    }
+    c->active_index = p->num_active;
+    p->active[p->num_active] = c;
+    p->num_active += 1;
+    return c;
+}
+
+void pool_deactivate(struct conn_pool *p, struct connection *c) {
+    struct connection *last = p->active[p->num_active - 1];
+    p->active[c->active_index] = last;
+    last->active_index = c->active_index;
+    p->num_active -= 1;
+}
+
+void pool_free(struct conn_pool *p, struct connection *c) {
+    p->free[p->num_free] = c - p->slots;
+    p->num_free += 1;
+}
+
+size_t pool_slot_size(const struct conn_pool *p) {
+    return sizeof(*p->slots) + sizeof(*p->cold) + p->recv_capacity + p->send_capacity;
+}
@@ -0,0 +1,42 @@
+#ifndef PFS_POOL_H
+#define PFS_POOL_H
+
+#include <stddef.h>
+
+struct connection;
+struct connection_cold;
+
+// Preallocated connection slots of one network worker.
+// - slots are cache line aligned and never move, so a closed connection leaves a hole that goes on the free list.
+//   The active list holds pointers to the open connections for iterating; removing one only swaps a pointer.
+// - cold state (address, tracker) lives in a separate array next to the slots.
+// - the ring buffers of all slots are cut out of one memfd ("arena") and one reserved address range. A slot maps
+//   its buffers the first time it is used and keeps them, so accepting a connection costs no syscall for buffers.
+struct conn_pool {
+    struct connection *slots;
+    struct connection_cold *cold;
+    size_t max_conns;
+    struct connection **active;
+    size_t num_active;
+    size_t *free; // stack of free slot indices
+    size_t num_free;
+    size_t num_mapped; // slots whose buffers are mapped
+    int arena_fd;
+    unsigned char *arena;
+    size_t arena_size; // reserved address range, twice the size of the file because every buffer is mapped twice
+    size_t recv_capacity;
+    size_t send_capacity;
+};
+
+void pool_init(struct conn_pool *p, size_t max_conns, size_t recv_capacity, size_t send_capacity);
+void pool_destroy(struct conn_pool *p);
+// takes a free slot and appends it to the active list. Returns NULL if all slots are taken.
+struct connection *pool_alloc(struct conn_pool *p);
+// removes the slot from the active list, the slot at the end of the list takes its index
+void pool_deactivate(struct conn_pool *p, struct connection *c);
+// puts an inactive slot back on the free list
+void pool_free(struct conn_pool *p, struct connection *c);
+// memory of one slot: hot and cold state plus both buffers
+size_t pool_slot_size(const struct conn_pool *p);
+
+#endif
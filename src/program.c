@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "canvas.h"
+#include "program.h"
+
+// The interpreter runs every instruction for PROGRAM_LANES pixels of a row at once, so the dispatch is paid per
+// instruction and chunk instead of per pixel, the kernel pass does the same per tap. Registers are arrays of vectors
+// (GCC vector extensions), the same code is compiled for the baseline instruction set and for avx2.
+
+#define PROGRAM_LANES 64
+#define VEC_LANES 8
+#define VECS (PROGRAM_LANES / VEC_LANES)
+typedef int prog_vec __attribute__((vector_size(VEC_LANES * sizeof(int))));
+typedef unsigned int prog_uvec __attribute__((vector_size(VEC_LANES * sizeof(int))));
+
+#define RING_ROWS (2 * PROGRAM_RADIUS + 1)
+
+// pixels of the snapshot are r g b 1, channel c of a pixel read as a native word
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CHANNEL_SHIFT(c) (8 * (c))
+#else
+#define CHANNEL_SHIFT(c) (24 - 8 * (c))
+#endif
+
+struct program_state *program_state_new(void) {
+    struct program_state *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("calloc");
+        exit(1); // TODO
+    }
+    return s;
+}
+
+void program_state_free(struct program_state *s) {
+    if (s != NULL) {
+        free(s->snapshot.rows);
+        free(s);
+    }
+}
+
+int program_verify(struct program *p) {
+    if (p->num_insns == 0 || p->num_insns > PROGRAM_MAX_INSNS) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < p->num_insns; i++) {
+        const unsigned char *in = p->insns[i];
+        if (in[1] >= PROGRAM_REGS) {
+            return -1;
+        }
+        switch (in[0]) {
+        case PROG_CONST:
+            break;
+        case PROG_LOAD:
+            if ((in[2] & 15) > 2 * PROGRAM_RADIUS || (in[2] >> 4) > 2 * PROGRAM_RADIUS || in[3] > 2) {
+                return -1;
+            }
+            break;
+        case PROG_COORD:
+            if (in[2] > 1) {
+                return -1;
+            }
+            break;
+        case PROG_ADD: case PROG_SUB: case PROG_MUL: case PROG_MIN: case PROG_MAX:
+        case PROG_AND: case PROG_OR: case PROG_XOR: case PROG_LT: case PROG_EQ: case PROG_SELECT:
+            if (in[2] >= PROGRAM_REGS || in[3] >= PROGRAM_REGS) {
+                return -1;
+            }
+            break;
+        case PROG_SHL: case PROG_SHR:
+            if (in[2] >= PROGRAM_REGS || in[3] >= 32) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    p->cost = (p->num_insns + PROGRAM_INSNS_PER_PIXEL - 1) / PROGRAM_INSNS_PER_PIXEL;
+    return 0;
+}
+
+int program_kernel_verify(struct program_kernel *k, const unsigned char *weights) {
+    if ((k->size != 1 && k->size != 3 && k->size != 5) || k->shift > KERNEL_MAX_SHIFT) {
+        return -1;
+    }
+    // taps are stored with the offsets of a 5x5 kernel, smaller kernels are centered
+    unsigned int border = PROGRAM_RADIUS - k->size / 2;
+    k->num_taps = 0;
+    for (unsigned int i = 0; i < k->size * k->size; i++) {
+        int weight = (short)(weights[2 * i] | (weights[2 * i + 1] << 8));
+        if (weight != 0) {
+            unsigned int dx = border + i % k->size;
+            unsigned int dy = border + i / k->size;
+            k->tap_offset[k->num_taps] = dx | (dy << 4);
+            k->tap_weight[k->num_taps] = weight;
+            k->num_taps += 1;
+        }
+    }
+    k->cost = k->num_taps == 0 ? 1 : (k->num_taps + KERNEL_TAPS_PER_PIXEL - 1) / KERNEL_TAPS_PER_PIXEL;
+    return 0;
+}
+
+static inline unsigned char *snapshot_row(const struct program_snapshot *s, int row) {
+    return s->rows + (size_t)(((row % RING_ROWS) + RING_ROWS) % RING_ROWS) * s->stride * 4;
+}
+
+// copies row of the region into the ring, the columns and the row are clamped to the region
+static void snapshot_load(struct program_snapshot *s, const struct region *r, int row) {
+    unsigned char *dst = snapshot_row(s, row);
+    unsigned int src_row = row < 0 ? 0 : (unsigned int)row >= r->h ? r->h - 1 : (unsigned int)row;
+    int first = (int)s->x0 - PROGRAM_RADIUS; // column of dst[0]
+    unsigned int lo = first < 0 ? 0 : first;
+    unsigned int hi = first + s->stride > r->w ? r->w : first + s->stride;
+    canvas_get_span(r->x + lo, r->y + src_row, hi - lo, dst + 4 * (lo - first));
+    for (int col = first; col < (int)lo; col++) {
+        memcpy(dst + 4 * (col - first), dst + 4 * (lo - first), 4);
+    }
+    for (unsigned int col = hi; col < first + s->stride; col++) {
+        memcpy(dst + 4 * (col - first), dst + 4 * (hi - 1 - first), 4);
+    }
+}
+
+void program_run_begin(struct program_state *s, const struct region *r, unsigned int x0, unsigned int y0,
+        unsigned int x1) {
+    (void)r;
+    struct program_snapshot *snap = &s->snapshot;
+    snap->stride = x1 - x0 + 2 * PROGRAM_RADIUS;
+    // the interpreter loads whole chunks, so the last row is followed by a chunk of padding
+    size_t size = ((size_t)RING_ROWS * snap->stride + PROGRAM_LANES) * 4;
+    if (size > snap->capacity) {
+        free(snap->rows);
+        snap->rows = calloc(1, size);
+        if (snap->rows == NULL) {
+            perror("calloc");
+            exit(1); // TODO
+        }
+        snap->capacity = size;
+    }
+    snap->x0 = x0;
+    snap->next_row = (int)y0 - PROGRAM_RADIUS;
+}
+
+// computes n <= PROGRAM_LANES pixels of row y starting at x into out (r g b x)
+static inline __attribute__((always_inline)) void run_chunk(const struct program *p, const struct program_snapshot *s,
+        unsigned int x, unsigned int y, size_t n, unsigned char *out) {
+    prog_vec regs[PROGRAM_REGS][VECS];
+    memset(regs, 0, sizeof(regs));
+    const unsigned char *center = snapshot_row(s, y) + 4 * (x - s->x0 + PROGRAM_RADIUS);
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < VECS; k++) {
+            prog_uvec w;
+            memcpy(&w, center + k * sizeof(w), sizeof(w));
+            regs[c][k] = (prog_vec)((w >> CHANNEL_SHIFT(c)) & 0xff);
+        }
+    }
+    for (unsigned int i = 0; i < p->num_insns; i++) {
+        const unsigned char *in = p->insns[i];
+        prog_vec *d = regs[in[1]];
+        const prog_vec *a = regs[in[2] & (PROGRAM_REGS - 1)]; // only a register for the ops that use it
+        const prog_vec *b = regs[in[3] & (PROGRAM_REGS - 1)];
+// d = expr for all vectors, expr uses va and vb
+#define BINARY(expr) \
+        for (int k = 0; k < VECS; k++) { \
+            prog_vec va = a[k]; \
+            prog_vec vb = b[k]; \
+            d[k] = (expr); \
+        } \
+        break
+        switch (in[0]) {
+        case PROG_CONST: {
+            int value = (short)(in[2] | (in[3] << 8));
+            for (int k = 0; k < VECS; k++) {
+                d[k] = (prog_vec){0} + value;
+            }
+            break;
+        }
+        case PROG_LOAD: {
+            int dx = (in[2] & 15) - PROGRAM_RADIUS;
+            int dy = (in[2] >> 4) - PROGRAM_RADIUS;
+            const unsigned char *src = snapshot_row(s, (int)y + dy) + 4 * (x - s->x0 + PROGRAM_RADIUS + dx);
+            for (int k = 0; k < VECS; k++) {
+                prog_uvec w;
+                memcpy(&w, src + k * sizeof(w), sizeof(w));
+                d[k] = (prog_vec)((w >> CHANNEL_SHIFT(in[3])) & 0xff);
+            }
+            break;
+        }
+        case PROG_COORD:
+            for (int k = 0; k < VECS; k++) {
+                d[k] = in[2] == 0 ? (prog_vec){0, 1, 2, 3, 4, 5, 6, 7} + (int)(x + k * VEC_LANES)
+                    : (prog_vec){0} + (int)y;
+            }
+            break;
+        // wrapping arithmetic, done unsigned
+        case PROG_ADD: BINARY((prog_vec)((prog_uvec)va + (prog_uvec)vb));
+        case PROG_SUB: BINARY((prog_vec)((prog_uvec)va - (prog_uvec)vb));
+        case PROG_MUL: BINARY((prog_vec)((prog_uvec)va * (prog_uvec)vb));
+        case PROG_MIN: BINARY((va & (va < vb)) | (vb & ~(va < vb)));
+        case PROG_MAX: BINARY((va & (va > vb)) | (vb & ~(va > vb)));
+        case PROG_AND: BINARY(va & vb);
+        case PROG_OR: BINARY(va | vb);
+        case PROG_XOR: BINARY(va ^ vb);
+        case PROG_LT: BINARY(va < vb);
+        case PROG_EQ: BINARY(va == vb);
+        case PROG_SELECT: BINARY((va & (d[k] != 0)) | (vb & ~(d[k] != 0)));
+        case PROG_SHL:
+            for (int k = 0; k < VECS; k++) {
+                d[k] = (prog_vec)((prog_uvec)a[k] << in[3]);
+            }
+            break;
+        case PROG_SHR:
+            for (int k = 0; k < VECS; k++) {
+                d[k] = a[k] >> in[3];
+            }
+            break;
+        }
+#undef BINARY
+    }
+    // registers 0, 1, 2 are the new color
+    const int *lanes[3] = { (const int *)regs[0], (const int *)regs[1], (const int *)regs[2] };
+    for (size_t j = 0; j < n; j++) {
+        for (int c = 0; c < 3; c++) {
+            int v = lanes[c][j];
+            out[4 * j + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+}
+
+// same for the kernel. Every tap is one pass over the chunk for all three channels.
+static inline __attribute__((always_inline)) void kernel_chunk(const struct program_kernel *kn,
+        const struct program_snapshot *s, unsigned int x, unsigned int y, size_t n, unsigned char *out) {
+    prog_vec acc[3][VECS];
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < VECS; k++) {
+            acc[c][k] = (prog_vec){0} + ((1 << kn->shift) >> 1); // rounding
+        }
+    }
+    for (unsigned int t = 0; t < kn->num_taps; t++) {
+        int dx = (kn->tap_offset[t] & 15) - PROGRAM_RADIUS;
+        int dy = (kn->tap_offset[t] >> 4) - PROGRAM_RADIUS;
+        int weight = kn->tap_weight[t];
+        const unsigned char *src = snapshot_row(s, (int)y + dy) + 4 * (x - s->x0 + PROGRAM_RADIUS + dx);
+        for (int k = 0; k < VECS; k++) {
+            prog_uvec w;
+            memcpy(&w, src + k * sizeof(w), sizeof(w));
+            for (int c = 0; c < 3; c++) {
+                acc[c][k] += (prog_vec)((w >> CHANNEL_SHIFT(c)) & 0xff) * weight;
+            }
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < VECS; k++) {
+            acc[c][k] = (acc[c][k] >> kn->shift) + kn->bias;
+        }
+    }
+    const int *lanes[3] = { (const int *)acc[0], (const int *)acc[1], (const int *)acc[2] };
+    for (size_t j = 0; j < n; j++) {
+        for (int c = 0; c < 3; c++) {
+            int v = lanes[c][j];
+            out[4 * j + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+}
+
+typedef void (*run_chunk_fn)(const struct program *p, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out);
+
+static void run_chunk_generic(const struct program *p, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out) {
+    run_chunk(p, s, x, y, n, out);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void run_chunk_avx2(const struct program *p, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out) {
+    run_chunk(p, s, x, y, n, out);
+}
+#endif
+
+typedef void (*kernel_chunk_fn)(const struct program_kernel *kn, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out);
+
+static void kernel_chunk_generic(const struct program_kernel *kn, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out) {
+    kernel_chunk(kn, s, x, y, n, out);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void kernel_chunk_avx2(const struct program_kernel *kn, const struct program_snapshot *s, unsigned int x,
+        unsigned int y, size_t n, unsigned char *out) {
+    kernel_chunk(kn, s, x, y, n, out);
+}
+#endif
+
+static run_chunk_fn run_impl = run_chunk_generic;
+static kernel_chunk_fn kernel_impl = kernel_chunk_generic;
+
+void program_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        run_impl = run_chunk_avx2;
+        kernel_impl = kernel_chunk_avx2;
+    }
+#endif
+}
+
+const char *program_impl_name(void) {
+#ifdef HAVE_X86_SIMD
+    if (run_impl == run_chunk_avx2) {
+        return "avx2";
+    }
+#endif
+    return "generic";
+}
+
+void program_run_span(struct program_state *s, const struct region *r, unsigned int x, unsigned int y, size_t n) {
+    // the row below the current one by PROGRAM_RADIUS is copied before the current row changes
+    while (s->snapshot.next_row <= (int)y + PROGRAM_RADIUS) {
+        snapshot_load(&s->snapshot, r, s->snapshot.next_row);
+        s->snapshot.next_row += 1;
+    }
+    unsigned char out[4 * PROGRAM_LANES];
+    while (n > 0) {
+        size_t chunk = n < PROGRAM_LANES ? n : PROGRAM_LANES;
+        if (s->run_kernel) {
+            kernel_impl(&s->kernel, &s->snapshot, x, y, chunk, out);
+        } else {
+            run_impl(&s->program, &s->snapshot, x, y, chunk, out);
+        }
+        canvas_print_span(r->x + x, r->y + y, chunk, out);
+        x += chunk;
+        n -= chunk;
+    }
+}
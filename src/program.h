@@ -0,0 +1,96 @@
+#ifndef PFS_PROGRAM_H
+#define PFS_PROGRAM_H
+
+#include <stddef.h>
+#include "region.h"
+
+// Pixel programs ('u', 'x') compute the new color of every pixel of a rect from the pixel and its neighbours,
+// kernels ('k', 'c') are the convolution special case with a fast path. Programs have no jumps. A run reads the rows
+// as they were before it changed them. See README for the instruction set.
+
+#define PROGRAM_MAX_INSNS 64
+#define PROGRAM_REGS 16
+#define PROGRAM_RADIUS 2 // neighbours are at most this far away in x and y
+#define PROGRAM_INSNS_PER_PIXEL 8 // a run is charged one pixel per this many instructions for every pixel
+
+// instructions are 4 bytes: op d a b. Registers are 32 bit signed integers.
+#define PROG_CONST 0x00 // d = a | b << 8, sign-extended from 16 bits
+#define PROG_LOAD 0x01 // d = channel b (0 r, 1 g, 2 b) of the pixel at dx = (a & 15) - 2, dy = (a >> 4) - 2
+#define PROG_COORD 0x02 // d = x (a = 0) or y (a = 1) of the pixel, relative to the region
+#define PROG_ADD 0x10 // d = a + b, for all binary ops a and b are registers
+#define PROG_SUB 0x11
+#define PROG_MUL 0x12
+#define PROG_MIN 0x13
+#define PROG_MAX 0x14
+#define PROG_AND 0x15
+#define PROG_OR 0x16
+#define PROG_XOR 0x17
+#define PROG_LT 0x18 // d = a < b ? -1 : 0
+#define PROG_EQ 0x19 // d = a == b ? -1 : 0
+#define PROG_SELECT 0x1a // d = d != 0 ? a : b
+#define PROG_SHL 0x20 // d = a << b, b is a constant below 32
+#define PROG_SHR 0x21 // d = a >> b, arithmetic
+
+struct program {
+    unsigned int num_insns;
+    unsigned int cost; // pixels charged per pixel of a run
+    unsigned char insns[PROGRAM_MAX_INSNS][4];
+};
+
+#define KERNEL_MAX_SIZE (2 * PROGRAM_RADIUS + 1)
+#define KERNEL_MAX_SHIFT 16
+#define KERNEL_TAPS_PER_PIXEL 8 // a run is charged one pixel per this many nonzero weights for every pixel
+
+// new channel = ((sum of weight * channel) + rounding) >> shift + bias
+struct program_kernel {
+    unsigned int size; // 1, 3 or 5
+    unsigned int shift;
+    int bias;
+    // the nonzero weights, set by program_kernel_verify
+    unsigned int num_taps;
+    unsigned char tap_offset[KERNEL_MAX_SIZE * KERNEL_MAX_SIZE]; // same as the a operand of PROG_LOAD
+    int tap_weight[KERNEL_MAX_SIZE * KERNEL_MAX_SIZE];
+    unsigned int cost; // pixels charged per pixel of a run
+};
+
+// the rows of the canvas around the current row of a run, before the run changed them. A ring of
+// 2 * PROGRAM_RADIUS + 1 rows, each covering the columns of the rect plus PROGRAM_RADIUS on both sides. Pixels
+// outside the region are replaced by the nearest one inside.
+struct program_snapshot {
+    unsigned char *rows; // GET response format, r g b 1
+    size_t capacity; // bytes
+    unsigned int stride; // pixels per row
+    unsigned int x0; // first column of the rect
+    int next_row; // next row to copy into the ring
+};
+
+// per connection, allocated on the first upload
+struct program_state {
+    struct program program; // the last complete upload
+    struct program upload; // the upload being received
+    unsigned int upload_received; // instructions of upload so far
+    struct program_kernel kernel; // the last complete kernel, size 0 if there is none
+    struct program_kernel kernel_upload;
+    unsigned char kernel_weights[2 * KERNEL_MAX_SIZE * KERNEL_MAX_SIZE]; // of kernel_upload, as received
+    unsigned int kernel_received; // bytes of kernel_weights so far
+    int run_kernel; // the current run applies the kernel instead of the program
+    struct program_snapshot snapshot;
+};
+
+void program_init(void); // selects the best interpreter for this cpu
+const char *program_impl_name(void);
+struct program_state *program_state_new(void);
+void program_state_free(struct program_state *s);
+// checks a complete upload, returns -1 if it is invalid. Sets the cost.
+int program_verify(struct program *p);
+// checks a kernel upload with size * size weights (int16, little endian, row by row), returns -1 if it is invalid.
+// Sets the taps and the cost.
+int program_kernel_verify(struct program_kernel *k, const unsigned char *weights);
+// prepares a run over the rect x0..x1 x y0..y1 (end exclusive, region coordinates, inside the region)
+void program_run_begin(struct program_state *s, const struct region *r, unsigned int x0, unsigned int y0,
+        unsigned int x1);
+// runs the program (or the kernel, see run_kernel) for n pixels of row y starting at x. Rows are run in order,
+// every row from its first pixel.
+void program_run_span(struct program_state *s, const struct region *r, unsigned int x, unsigned int y, size_t n);
+
+#endif
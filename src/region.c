@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "param.h"
+#include "region.h"
+
+struct region_config region_config; // no split screen
+
+// grid cells, assigned[i] is the ip that got cell i. Only grows, an ip keeps its cell until the server exits.
+static unsigned int grid_cols;
+static unsigned int cell_w;
+static unsigned int cell_h;
+static in_addr_t assigned[MAX_SPLIT_SCREEN];
+static unsigned int num_assigned;
+static pthread_mutex_t assign_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int region_config_add(const char *value) {
+    char ip[16];
+    struct region r;
+    char extra;
+    in_addr_t addr;
+    if (sscanf(value, "%15s %u %u %u %u %c", ip, &r.x, &r.y, &r.w, &r.h, &extra) != 5
+            || inet_pton(AF_INET, ip, &addr) != 1) {
+        return -1;
+    }
+    if (region_config.num_fixed == MAX_FIXED_REGIONS) {
+        printf("too many regions (at most %d)\n", MAX_FIXED_REGIONS);
+        return -1;
+    }
+    region_config.fixed_addr[region_config.num_fixed] = addr;
+    region_config.fixed[region_config.num_fixed] = r;
+    region_config.num_fixed += 1;
+    return 0;
+}
+
+void region_start(void) {
+    unsigned int width = params.tex_size_x;
+    unsigned int height = params.tex_size_y;
+    for (size_t i = 0; i < region_config.num_fixed; i++) {
+        const struct region *r = &region_config.fixed[i];
+        if (r->x >= width || r->y >= height || r->w > width - r->x || r->h > height - r->y) {
+            printf("region %u %u %u %u is not inside the %ux%u canvas\n", r->x, r->y, r->w, r->h, width, height);
+            exit(1);
+        }
+    }
+    unsigned int n = region_config.split_screen;
+    if (n == 0) {
+        return;
+    }
+    // as square as possible, n = 4 gives quarters
+    grid_cols = 1;
+    while (grid_cols * grid_cols < n) {
+        grid_cols += 1;
+    }
+    unsigned int rows = (n + grid_cols - 1) / grid_cols;
+    cell_w = width / grid_cols;
+    cell_h = height / rows;
+    if (cell_w == 0 || cell_h == 0) {
+        printf("the %ux%u canvas is too small for %u regions\n", width, height, n);
+        exit(1);
+    }
+    printf("split screen: %u regions of %ux%u\n", n, cell_w, cell_h);
+}
+
+void region_stop(void) {
+    num_assigned = 0;
+}
+
+static struct region lookup(in_addr_t addr, int assign) {
+    for (size_t i = 0; i < region_config.num_fixed; i++) {
+        if (region_config.fixed_addr[i] == addr) {
+            return region_config.fixed[i];
+        }
+    }
+    struct region r = { 0, 0, 0, 0 };
+    if (region_config.split_screen == 0) {
+        if (region_config.num_fixed == 0) {
+            r.w = params.tex_size_x;
+            r.h = params.tex_size_y;
+        }
+        return r;
+    }
+    pthread_mutex_lock(&assign_lock);
+    unsigned int cell = 0;
+    while (cell < num_assigned && assigned[cell] != addr) {
+        cell += 1;
+    }
+    if (assign && cell == num_assigned && num_assigned < region_config.split_screen) {
+        assigned[num_assigned] = addr;
+        num_assigned += 1;
+    }
+    int has_cell = cell < num_assigned;
+    pthread_mutex_unlock(&assign_lock);
+    if (has_cell) {
+        r.x = (cell % grid_cols) * cell_w;
+        r.y = (cell / grid_cols) * cell_h;
+        r.w = cell_w;
+        r.h = cell_h;
+    }
+    return r;
+}
+
+struct region region_get(in_addr_t addr) {
+    return lookup(addr, 1);
+}
+
+struct region region_find(in_addr_t addr) {
+    return lookup(addr, 0);
+}
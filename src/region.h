@@ -0,0 +1,57 @@
+#ifndef PFS_REGION_H
+#define PFS_REGION_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+// Split screen: every client ip draws to its own region of the canvas. Clients use coordinates relative to their
+// region and INFO reports its size, so a client does not notice the split except for the smaller canvas.
+// Coordinates outside the region are treated like coordinates outside the canvas. Regions are pinned to the ip,
+// not the connection: all connections of an ip share one region, also after reconnecting.
+//
+// Regions are either configured per ip ("region" option) or handed out from a grid of split_screen cells to the
+// ips in the order they first connect. Ips without a region get an empty one once split screen is on. Without
+// either option every ip gets the whole canvas.
+//
+// Only tcp connections claim grid cells. A udp sender uses the cell of its ip if a tcp connection claimed one and
+// draws nowhere otherwise, spoofed source addresses can't take the cells away from real clients.
+
+struct region {
+    unsigned int x;
+    unsigned int y;
+    unsigned int w;
+    unsigned int h;
+};
+
+#define MAX_FIXED_REGIONS 64
+#define MAX_SPLIT_SCREEN 1024
+
+struct region_config {
+    unsigned int split_screen; // number of grid cells, 0 = no grid
+    size_t num_fixed;
+    in_addr_t fixed_addr[MAX_FIXED_REGIONS];
+    struct region fixed[MAX_FIXED_REGIONS];
+};
+
+extern struct region_config region_config; // set before region_start
+
+// adds a fixed region, value is "ip x y w h". returns -1 if it is invalid.
+int region_config_add(const char *value);
+// checks the fixed regions against the canvas size and lays out the grid, exits on errors
+void region_start(void);
+void region_stop(void);
+// the region of an ip, assigns a grid cell on the first call. Called once per connection.
+struct region region_get(in_addr_t addr);
+// same, but never assigns a cell: an ip without one gets an empty region. For udp, whose source addresses are
+// trivially spoofed and could take all cells otherwise.
+struct region region_find(in_addr_t addr);
+
+// the part of a span of n pixels in row y starting at x (region coordinates) that is inside the region
+static inline size_t region_clip_span(const struct region *r, unsigned int x, unsigned int y, size_t n) {
+    if (y >= r->h || x >= r->w) {
+        return 0;
+    }
+    return n < r->w - x ? n : r->w - x;
+}
+
+#endif
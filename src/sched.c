@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "sched.h"
+
+#define MICRO 1000000ULL
+
+struct quota_config quota_config; // all unlimited
+
+void token_bucket_init(struct token_bucket *b, unsigned long long rate, unsigned long long now_us) {
+    b->rate = rate;
+    b->capacity_us = rate * QUOTA_BURST_MS * 1000;
+    if (b->capacity_us < MICRO) {
+        b->capacity_us = MICRO;
+    }
+    b->tokens_us = b->capacity_us; // start full
+    b->last_us = now_us;
+}
+
+static void token_bucket_refill(struct token_bucket *b, unsigned long long now_us) {
+    if (now_us <= b->last_us) {
+        return;
+    }
+    unsigned long long elapsed = now_us - b->last_us;
+    b->last_us = now_us;
+    if (elapsed >= MICRO) { // more than enough to fill any bucket, also keeps the product below from overflowing
+        b->tokens_us = b->capacity_us;
+        return;
+    }
+    b->tokens_us += elapsed * b->rate;
+    if (b->tokens_us > b->capacity_us) {
+        b->tokens_us = b->capacity_us;
+    }
+}
+
+size_t token_bucket_take(struct token_bucket *b, size_t want, unsigned long long now_us) {
+    if (b->rate == 0) {
+        return want;
+    }
+    token_bucket_refill(b, now_us);
+    size_t available = b->tokens_us / MICRO;
+    size_t n = want < available ? want : available;
+    b->tokens_us -= n * MICRO;
+    return n;
+}
+
+void token_bucket_refund(struct token_bucket *b, size_t n) {
+    if (b->rate == 0) {
+        return;
+    }
+    b->tokens_us += n * MICRO;
+    if (b->tokens_us > b->capacity_us) {
+        b->tokens_us = b->capacity_us;
+    }
+}
+
+unsigned long long token_bucket_wait_us(const struct token_bucket *b, size_t n) {
+    if (b->rate == 0 || b->tokens_us >= n * MICRO) {
+        return 0;
+    }
+    return (n * MICRO - b->tokens_us + b->rate - 1) / b->rate;
+}
+
+// per-ip buckets, shared between all network workers.
+// the table lock protects the hash chains and the reference counts, every entry has its own lock for the buckets.
+#define IP_TABLE_SIZE 256
+static struct ip_quota *ip_table[IP_TABLE_SIZE];
+static pthread_mutex_t ip_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int ip_hash(in_addr_t addr) {
+    return (addr * 2654435761U) >> 24; // top 8 bits of a multiplicative hash
+}
+
+static struct ip_quota *ip_quota_get(in_addr_t addr, unsigned long long now_us) {
+    pthread_mutex_lock(&ip_table_lock);
+    struct ip_quota **slot = &ip_table[ip_hash(addr) % IP_TABLE_SIZE];
+    struct ip_quota *q;
+    for (q = *slot; q != NULL; q = q->next) {
+        if (q->addr == addr) {
+            break;
+        }
+    }
+    if (q == NULL) {
+        q = calloc(1, sizeof(*q));
+        if (q == NULL) {
+            perror("calloc");
+            exit(1); // TODO
+        }
+        q->addr = addr;
+        pthread_mutex_init(&q->lock, NULL);
+        token_bucket_init(&q->pixels, quota_config.ip_pixels, now_us);
+        token_bucket_init(&q->bytes, quota_config.ip_bytes, now_us);
+        q->next = *slot;
+        *slot = q;
+    }
+    q->refs += 1;
+    pthread_mutex_unlock(&ip_table_lock);
+    return q;
+}
+
+static void ip_quota_put(struct ip_quota *q) {
+    pthread_mutex_lock(&ip_table_lock);
+    q->refs -= 1;
+    if (q->refs == 0) {
+        struct ip_quota **slot = &ip_table[ip_hash(q->addr) % IP_TABLE_SIZE];
+        while (*slot != q) {
+            slot = &(*slot)->next;
+        }
+        *slot = q->next;
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+    }
+    pthread_mutex_unlock(&ip_table_lock);
+}
+
+static unsigned long long next_id = 1;
+
+void sched_init(struct conn_sched *s, in_addr_t addr, unsigned long long now_us) {
+    s->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    token_bucket_init(&s->pixels, quota_config.conn_pixels, now_us);
+    token_bucket_init(&s->bytes, quota_config.conn_bytes, now_us);
+    s->ip = NULL;
+    if (quota_config.ip_pixels != 0 || quota_config.ip_bytes != 0) {
+        s->ip = ip_quota_get(addr, now_us);
+    }
+}
+
+void sched_destroy(struct conn_sched *s) {
+    if (s->ip != NULL) {
+        pthread_mutex_lock(&s->ip->lock);
+        if (s->ip->turn == s->id) {
+            s->ip->turn = 0;
+        }
+        pthread_mutex_unlock(&s->ip->lock);
+        ip_quota_put(s->ip);
+        s->ip = NULL;
+    }
+}
+
+void sched_begin(struct conn_sched *s, struct step_budget *b, unsigned long long now_us) {
+    b->pixels = token_bucket_take(&s->pixels, STEP_MAX_PIXELS, now_us);
+    b->bytes = token_bucket_take(&s->bytes, STEP_MAX_BYTES, now_us);
+    if (s->ip != NULL) {
+        struct ip_quota *q = s->ip;
+        size_t ip_pixels = 0;
+        size_t ip_bytes = 0;
+        pthread_mutex_lock(&q->lock);
+        if (q->turn == 0 || q->turn == s->id) {
+            ip_pixels = token_bucket_take(&q->pixels, b->pixels, now_us);
+            ip_bytes = token_bucket_take(&q->bytes, b->bytes, now_us);
+            q->turn = 0;
+        }
+        b->has_turn = q->turn == 0 && ((ip_pixels == 0 && b->pixels > 0) || (ip_bytes == 0 && b->bytes > 0));
+        if (b->has_turn) {
+            q->turn = s->id;
+        }
+        pthread_mutex_unlock(&q->lock);
+        token_bucket_refund(&s->pixels, b->pixels - ip_pixels);
+        token_bucket_refund(&s->bytes, b->bytes - ip_bytes);
+        b->pixels = ip_pixels;
+        b->bytes = ip_bytes;
+    } else {
+        b->has_turn = 0;
+    }
+    b->pixels_limited = b->pixels < STEP_MAX_PIXELS;
+    b->bytes_limited = b->bytes < STEP_MAX_BYTES;
+    b->used_pixels = 0;
+    b->used_bytes = 0;
+    b->quota_hit = 0;
+}
+
+void sched_end(struct conn_sched *s, const struct step_budget *b) {
+    size_t unused_pixels = b->pixels - b->used_pixels;
+    size_t unused_bytes = b->bytes - b->used_bytes;
+    token_bucket_refund(&s->pixels, unused_pixels);
+    token_bucket_refund(&s->bytes, unused_bytes);
+    // only a connection that sleeps until the buckets refill keeps the turn. one that stopped for another reason
+    // (nothing to read, only stepped for EPOLLOUT) may not be stepped again for a long time and would block the ip.
+    int release_turn = b->has_turn && !b->quota_hit;
+    if (s->ip != NULL && (unused_pixels > 0 || unused_bytes > 0 || release_turn)) {
+        pthread_mutex_lock(&s->ip->lock);
+        token_bucket_refund(&s->ip->pixels, unused_pixels);
+        token_bucket_refund(&s->ip->bytes, unused_bytes);
+        if (release_turn && s->ip->turn == s->id) {
+            s->ip->turn = 0;
+        }
+        pthread_mutex_unlock(&s->ip->lock);
+    }
+}
+
+static size_t bucket_max(const struct token_bucket *b, size_t n) {
+    if (b->rate == 0 || b->capacity_us / MICRO >= n) {
+        return n;
+    }
+    return b->capacity_us / MICRO;
+}
+
+size_t sched_max_pixels(const struct conn_sched *s) {
+    size_t n = bucket_max(&s->pixels, STEP_MAX_PIXELS);
+    if (s->ip != NULL) {
+        n = bucket_max(&s->ip->pixels, n); // capacity_us never changes, no need for the lock
+    }
+    return n;
+}
+
+static unsigned long long max_ull(unsigned long long a, unsigned long long b) {
+    return a > b ? a : b;
+}
+
+unsigned long long sched_wake_time(const struct conn_sched *s, const struct step_budget *b, unsigned long long now_us) {
+    unsigned long long wait = THROTTLE_MIN_US;
+    if (b->pixels_limited && b->used_pixels == b->pixels) {
+        wait = max_ull(wait, token_bucket_wait_us(&s->pixels, 1));
+        if (s->ip != NULL) {
+            pthread_mutex_lock(&s->ip->lock);
+            wait = max_ull(wait, token_bucket_wait_us(&s->ip->pixels, 1));
+            pthread_mutex_unlock(&s->ip->lock);
+        }
+    }
+    if (b->bytes_limited && b->used_bytes == b->bytes) {
+        wait = max_ull(wait, token_bucket_wait_us(&s->bytes, 1));
+        if (s->ip != NULL) {
+            pthread_mutex_lock(&s->ip->lock);
+            wait = max_ull(wait, token_bucket_wait_us(&s->ip->bytes, 1));
+            pthread_mutex_unlock(&s->ip->lock);
+        }
+    }
+    return now_us + wait;
+}
@@ -0,0 +1,84 @@
+#ifndef PFS_SCHED_H
+#define PFS_SCHED_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+// Bandwidth scheduling: every connection has token buckets for drawn pixels and received bytes, and all
+// connections from the same ip additionally share a pair of buckets. Buckets are refilled continuously
+// at the configured rate and hold at most QUOTA_BURST_MS worth of tokens. A rate of 0 means unlimited.
+//
+// At the start of connection_step the connection takes a budget from its buckets (at most STEP_MAX_PIXELS /
+// STEP_MAX_BYTES, so clients still take turns), unused tokens are returned afterwards.
+
+#define QUOTA_BURST_MS 100
+#define STEP_MAX_PIXELS 4096
+#define STEP_MAX_BYTES 16384
+// a throttled connection sleeps at least this long, so slow buckets don't cause tiny steps
+#define THROTTLE_MIN_US 1000
+
+struct quota_config {
+    unsigned long long conn_pixels; // per second
+    unsigned long long conn_bytes;
+    unsigned long long ip_pixels;
+    unsigned long long ip_bytes;
+    unsigned long long udp_pixels; // per source ip over udp, separate from the tcp buckets (see udp.h)
+};
+
+extern struct quota_config quota_config; // set before net_start
+
+struct token_bucket {
+    unsigned long long rate; // tokens per second, 0 = unlimited
+    unsigned long long capacity_us; // capacity in microtokens
+    unsigned long long tokens_us; // microtokens, 1 token = 1000000 microtokens
+    unsigned long long last_us;
+};
+
+void token_bucket_init(struct token_bucket *b, unsigned long long rate, unsigned long long now_us);
+// refills and takes up to want tokens, returns the amount taken
+size_t token_bucket_take(struct token_bucket *b, size_t want, unsigned long long now_us);
+void token_bucket_refund(struct token_bucket *b, size_t n);
+// microseconds until n tokens are available
+unsigned long long token_bucket_wait_us(const struct token_bucket *b, size_t n);
+
+struct ip_quota {
+    in_addr_t addr;
+    int refs;
+    pthread_mutex_t lock;
+    struct token_bucket pixels;
+    struct token_bucket bytes;
+    // id of a connection that found the buckets empty. it gets the next tokens, otherwise the connection that
+    // comes first in the worker's loop would take everything that was refilled in the meantime.
+    unsigned long long turn; // 0 = nobody waiting
+    struct ip_quota *next;
+};
+
+struct conn_sched {
+    struct token_bucket pixels;
+    struct token_bucket bytes;
+    struct ip_quota *ip; // NULL if there is no per-ip quota
+    unsigned long long id; // never reused, unlike pool slots, so a turn can't pass to the next connection in the slot
+};
+
+struct step_budget {
+    size_t pixels;
+    size_t bytes;
+    int pixels_limited; // budget is below the step maximum because of the buckets
+    int bytes_limited;
+    size_t used_pixels;
+    size_t used_bytes;
+    int quota_hit; // the step stopped because the buckets ran dry
+    int has_turn; // sched_begin gave the turn of the ip to this connection
+};
+
+void sched_init(struct conn_sched *s, in_addr_t addr, unsigned long long now_us);
+void sched_destroy(struct conn_sched *s);
+void sched_begin(struct conn_sched *s, struct step_budget *b, unsigned long long now_us);
+void sched_end(struct conn_sched *s, const struct step_budget *b);
+// the most pixels one step can take from the buckets. A command that charges more per pixel would wait forever.
+size_t sched_max_pixels(const struct conn_sched *s);
+// when a throttled connection should be stepped again
+unsigned long long sched_wake_time(const struct conn_sched *s, const struct step_budget *b, unsigned long long now_us);
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sink.h"
+
+const struct sink sink_null = {
+    .name = "none",
+};
+
+static const struct sink *sinks[MAX_SINKS];
+static int num_sinks;
+
+void sinks_add(const struct sink *s) {
+    if (num_sinks == MAX_SINKS) {
+        printf("too many sinks\n");
+        exit(1);
+    }
+    sinks[num_sinks] = s;
+    num_sinks += 1;
+}
+
+void sinks_start(void) {
+    for (int i = 0; i < num_sinks; i++) {
+        printf("output: %s\n", sinks[i]->name);
+        if (sinks[i]->start != NULL) {
+            sinks[i]->start();
+        }
+    }
+}
+
+int sinks_need_frames(void) {
+    for (int i = 0; i < num_sinks; i++) {
+        if (sinks[i]->frame != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sinks_frame(const struct canvas_frame *f) {
+    for (int i = 0; i < num_sinks; i++) {
+        if (sinks[i]->frame != NULL) {
+            sinks[i]->frame(f);
+        }
+    }
+}
+
+int sinks_should_quit(void) {
+    for (int i = 0; i < num_sinks; i++) {
+        if (sinks[i]->should_quit != NULL && sinks[i]->should_quit()) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// in reverse order of starting
+void sinks_stop(void) {
+    for (int i = num_sinks - 1; i >= 0; i--) {
+        if (sinks[i]->stop != NULL) {
+            sinks[i]->stop();
+        }
+    }
+    num_sinks = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef PFS_SINK_H
+#define PFS_SINK_H
+
+#include "canvas.h"
+
+// Outputs of the canvas. The main loop calls canvas_update_frame once per tick and hands the frame to every
+// active sink. All callbacks run on the main thread and may be NULL.
+struct sink {
+    const char *name;
+    void (*start)(void);
+    void (*frame)(const struct canvas_frame *f); // NULL if the sink does not need frames
+    int (*should_quit)(void); // e.g. the window was closed
+    void (*stop)(void);
+};
+
+extern const struct sink sink_null; // no output at all
+extern const struct sink sink_ppm; // writes params.snapshot_path every params.snapshot_interval seconds
+extern const struct sink sink_checkpoint; // keeps params.checkpoint_path up to date, restores it on start
+extern const struct sink sink_stream; // sends the changes to viewers on params.stream_port
+#ifndef PFS_HEADLESS
+extern const struct sink sink_sdl; // window
+#endif
+
+// counters of sink_checkpoint
+struct checkpoint_stats {
+    unsigned long long checkpoints;
+    unsigned long long bytes_written;
+    unsigned long long total_us; // time spent copying, summed over the frames of every checkpoint
+    unsigned long long max_frame_us; // most time spent in one frame
+};
+
+void checkpoint_get_stats(struct checkpoint_stats *s);
+
+#define MAX_SINKS 8
+
+void sinks_add(const struct sink *s);
+void sinks_start(void);
+int sinks_need_frames(void);
+void sinks_frame(const struct canvas_frame *f);
+int sinks_should_quit(void);
+void sinks_stop(void);
+
+#endif
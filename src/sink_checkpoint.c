@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "param.h"
+#include "common.h"
+#include "sink.h"
+
+// Keeps a copy of the canvas in a memory-mapped file (params.checkpoint_path) and restores it on startup.
+// Every frame only marks the tiles its rects cover. Every params.checkpoint_interval ms a checkpoint copies the
+// marked tiles from the frame buffer into the mapping, tile row by tile row and at most about
+// CHECKPOINT_FRAME_BYTES per frame, so even a completely changed 4K canvas is spread over a few frames. The
+// network workers never wait for it, and the kernel writes the pages back in the background. A killed server
+// leaves every tile as of the last or the running checkpoint.
+//
+// File layout: one page of header, then the pixels as RGBA8888 words in host byte order, row stride is width.
+
+#define CHECKPOINT_MAGIC "PFSCKPT1"
+#define CHECKPOINT_TILE_SHIFT 6 // same as the canvas, so the tile aligned rects of a frame cover whole tiles
+#define CHECKPOINT_FRAME_BYTES (4 * 1024 * 1024)
+
+struct checkpoint_header {
+    char magic[8];
+    unsigned int width;
+    unsigned int height;
+    unsigned long long generation; // completed checkpoints
+};
+
+static int fd = -1;
+static unsigned char *map;
+static size_t map_size;
+static size_t header_size;
+static struct checkpoint_header *header;
+static unsigned int *file_pixels;
+static unsigned int tiles_x;
+static unsigned int tiles_y;
+static unsigned char *dirty; // tiles changed since the last checkpoint
+static unsigned long long last_checkpoint_us; // start of the last checkpoint
+static int writing; // a checkpoint is running
+static unsigned int cursor; // next tile row of the running checkpoint
+static unsigned long long checkpoint_us; // time spent on the running checkpoint so far
+static const struct canvas_frame *last_frame;
+static struct checkpoint_stats stats;
+
+// returns whether the file holds a checkpoint of a canvas of the current size
+static int checkpoint_valid(size_t file_size) {
+    return file_size == map_size && memcmp(header->magic, CHECKPOINT_MAGIC, 8) == 0
+        && header->width == params.tex_size_x && header->height == params.tex_size_y;
+}
+
+static void checkpoint_start(void) {
+    unsigned int width = params.tex_size_x;
+    unsigned int height = params.tex_size_y;
+    header_size = sysconf(_SC_PAGESIZE);
+    map_size = header_size + (size_t)width * height * sizeof(*file_pixels);
+    fd = open(params.checkpoint_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        perror(params.checkpoint_path);
+        exit(1);
+    }
+    size_t file_size = st.st_size;
+    if (file_size != map_size && ftruncate(fd, map_size) != 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0); // no page faults in checkpoints
+    if (map == MAP_FAILED) {
+        perror("mmap checkpoint");
+        exit(1);
+    }
+    header = (struct checkpoint_header *)map;
+    file_pixels = (unsigned int *)(map + header_size);
+
+    if (checkpoint_valid(file_size)) {
+        canvas_restore(file_pixels);
+        printf("restored canvas from %s (checkpoint %llu)\n", params.checkpoint_path, header->generation);
+    } else {
+        if (file_size > 0) {
+            printf("%s is no checkpoint of a %ux%u canvas, overwriting it\n", params.checkpoint_path, width, height);
+        }
+        memcpy(header->magic, CHECKPOINT_MAGIC, 8);
+        header->width = width;
+        header->height = height;
+        header->generation = 0;
+    }
+
+    tiles_x = (width + (1 << CHECKPOINT_TILE_SHIFT) - 1) >> CHECKPOINT_TILE_SHIFT;
+    tiles_y = (height + (1 << CHECKPOINT_TILE_SHIFT) - 1) >> CHECKPOINT_TILE_SHIFT;
+    dirty = calloc((size_t)tiles_x * tiles_y, 1);
+    if (dirty == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    last_checkpoint_us = clock_now_us();
+}
+
+static void mark_rect(const struct canvas_rect *r) {
+    unsigned int tx1 = (r->x + r->w - 1) >> CHECKPOINT_TILE_SHIFT;
+    unsigned int ty1 = (r->y + r->h - 1) >> CHECKPOINT_TILE_SHIFT;
+    for (unsigned int ty = r->y >> CHECKPOINT_TILE_SHIFT; ty <= ty1; ty++) {
+        memset(&dirty[ty * tiles_x + (r->x >> CHECKPOINT_TILE_SHIFT)], 1, tx1 - (r->x >> CHECKPOINT_TILE_SHIFT) + 1);
+    }
+}
+
+// copies the dirty tiles of a tile row, runs of dirty tiles are copied pixel row by pixel row.
+// returns the number of bytes copied.
+static unsigned long long write_tile_row(const struct canvas_frame *f, unsigned int ty) {
+    unsigned long long bytes = 0;
+    unsigned int tx = 0;
+    while (tx < tiles_x) {
+        if (!dirty[ty * tiles_x + tx]) {
+            tx += 1;
+            continue;
+        }
+        unsigned int tx0 = tx;
+        for (; tx < tiles_x && dirty[ty * tiles_x + tx]; tx++) {
+            dirty[ty * tiles_x + tx] = 0;
+        }
+        unsigned int x0 = tx0 << CHECKPOINT_TILE_SHIFT;
+        unsigned int x1 = tx << CHECKPOINT_TILE_SHIFT < f->width ? tx << CHECKPOINT_TILE_SHIFT : f->width;
+        unsigned int y0 = ty << CHECKPOINT_TILE_SHIFT;
+        unsigned int y1 = (ty + 1) << CHECKPOINT_TILE_SHIFT < f->height ? (ty + 1) << CHECKPOINT_TILE_SHIFT : f->height;
+        for (unsigned int y = y0; y < y1; y++) {
+            size_t offset = x0 + (size_t)f->width * y;
+            memcpy(&file_pixels[offset], &f->pixels[offset], (x1 - x0) * sizeof(*file_pixels));
+        }
+        bytes += (unsigned long long)(x1 - x0) * (y1 - y0) * sizeof(*file_pixels);
+    }
+    return bytes;
+}
+
+// continues the running checkpoint with about budget bytes at most
+static void checkpoint_continue(const struct canvas_frame *f, unsigned long long budget) {
+    unsigned long long start = clock_now_us();
+    unsigned long long bytes = 0;
+    for (; cursor < tiles_y && bytes < budget; cursor++) {
+        bytes += write_tile_row(f, cursor);
+    }
+    unsigned long long duration = clock_now_us() - start;
+    checkpoint_us += duration;
+    stats.bytes_written += bytes;
+    if (duration > stats.max_frame_us) {
+        stats.max_frame_us = duration;
+    }
+    if (cursor == tiles_y) {
+        header->generation += 1;
+        msync(map, map_size, MS_ASYNC);
+        stats.checkpoints += 1;
+        stats.total_us += checkpoint_us;
+        writing = 0;
+    }
+}
+
+static void checkpoint_begin(void) {
+    writing = 1;
+    cursor = 0;
+    checkpoint_us = 0;
+}
+
+static void checkpoint_frame(const struct canvas_frame *f) {
+    last_frame = f;
+    for (size_t i = 0; i < f->num_rects; i++) {
+        mark_rect(&f->rects[i]);
+    }
+    unsigned long long now = clock_now_us();
+    if (!writing && now - last_checkpoint_us >= params.checkpoint_interval * 1000ULL) {
+        checkpoint_begin();
+        last_checkpoint_us = now;
+    }
+    if (writing) {
+        checkpoint_continue(f, CHECKPOINT_FRAME_BYTES);
+    }
+}
+
+static void checkpoint_stop(void) {
+    if (last_frame != NULL) {
+        // everything, other sinks may have taken the rects of the last changes already
+        memset(dirty, 1, (size_t)tiles_x * tiles_y);
+        checkpoint_begin();
+        checkpoint_continue(canvas_update_frame(), -1);
+    }
+    msync(map, map_size, MS_SYNC);
+    munmap(map, map_size);
+    close(fd);
+    free(dirty);
+    map = NULL;
+    dirty = NULL;
+    fd = -1;
+}
+
+void checkpoint_get_stats(struct checkpoint_stats *s) {
+    *s = stats;
+}
+
+const struct sink sink_checkpoint = {
+    .name = "checkpoints",
+    .start = checkpoint_start,
+    .frame = checkpoint_frame,
+    .stop = checkpoint_stop,
+};
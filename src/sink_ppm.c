@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "param.h"
+#include "common.h"
+#include "sink.h"
+
+// Writes the whole frame as a binary PPM (P6) to a temporary file and renames it over params.snapshot_path,
+// so readers never see a half written snapshot. Also writes a last snapshot when the server stops.
+
+static unsigned long long last_write_us;
+static const struct canvas_frame *last_frame;
+static unsigned char *row; // one row of rgb
+
+static void ppm_write(const struct canvas_frame *f) {
+    size_t tmp_len = strlen(params.snapshot_path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if (tmp_path == NULL) {
+        perror("malloc");
+        exit(1); // TODO
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", params.snapshot_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror(tmp_path);
+        free(tmp_path);
+        return; // try again next time
+    }
+    fprintf(file, "P6\n%u %u\n255\n", f->width, f->height);
+    int ok = 1;
+    for (unsigned int y = 0; y < f->height && ok; y++) {
+        const unsigned int *src = &f->pixels[(size_t)f->width * y];
+        for (unsigned int x = 0; x < f->width; x++) {
+            row[3 * x] = src[x] >> 24;
+            row[3 * x + 1] = src[x] >> 16;
+            row[3 * x + 2] = src[x] >> 8;
+        }
+        ok = fwrite(row, 3, f->width, file) == f->width;
+    }
+    if (fclose(file) != 0 || !ok) {
+        perror(tmp_path);
+    } else if (rename(tmp_path, params.snapshot_path) != 0) {
+        perror("rename");
+    }
+    free(tmp_path);
+}
+
+static void ppm_start(void) {
+    row = malloc((size_t)params.tex_size_x * 3);
+    if (row == NULL) {
+        perror("malloc");
+        exit(1); // TODO
+    }
+    last_write_us = clock_now_us();
+}
+
+static void ppm_frame(const struct canvas_frame *f) {
+    last_frame = f;
+    unsigned long long now = clock_now_us();
+    if (now - last_write_us >= params.snapshot_interval * 1000000ULL) {
+        ppm_write(f);
+        last_write_us = now;
+    }
+}
+
+static void ppm_stop(void) {
+    if (last_frame != NULL) {
+        ppm_write(canvas_update_frame()); // include everything since the last tick
+    }
+    free(row);
+    row = NULL;
+}
+
+const struct sink sink_ppm = {
+    .name = "ppm snapshots",
+    .start = ppm_start,
+    .frame = ppm_frame,
+    .stop = ppm_stop,
+};
@@ -0,0 +1,90 @@
+// https://benedicthenshaw.com/soft_render_sdl2.html
+
+#ifndef PFS_HEADLESS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "SDL.h"
+
+#include "param.h"
+#include "sink.h"
+
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+static SDL_Texture *screen_texture;
+
+static void sdl_stop(void);
+
+#define CLEANUP_AND_EXIT_IF(error_cond, prefix) do { \
+    if (error_cond) {                                \
+        printf("%s: %s\n", prefix, SDL_GetError());  \
+        sdl_stop();                                  \
+        exit(1);                                     \
+    }                                                \
+} while (0)
+
+static void sdl_start(void) {
+    int status = SDL_Init(SDL_INIT_VIDEO);
+    CLEANUP_AND_EXIT_IF(status != 0, "SDL_Init");
+
+    window = SDL_CreateWindow("pixelflut",
+            SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+            params.screen_size_x, params.screen_size_y, 0);
+    CLEANUP_AND_EXIT_IF(window == NULL, "SDL_CreateWindow");
+
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    CLEANUP_AND_EXIT_IF(renderer == NULL, "SDL_CreateRenderer");
+
+    screen_texture = SDL_CreateTexture(renderer,
+            SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+            params.tex_size_x, params.tex_size_y);
+    CLEANUP_AND_EXIT_IF(screen_texture == NULL, "SDL_CreateTexture");
+}
+
+static void sdl_stop(void) {
+    if (screen_texture) {
+        SDL_DestroyTexture(screen_texture);
+        screen_texture = NULL;
+    }
+    if (renderer) {
+        SDL_DestroyRenderer(renderer);
+        renderer = NULL;
+    }
+    if (window) {
+        SDL_DestroyWindow(window);
+        window = NULL;
+    }
+    SDL_Quit();
+}
+
+// uploads only the changed rects
+static void sdl_frame(const struct canvas_frame *f) {
+    // ? SDL_RenderClear(renderer);
+    for (size_t i = 0; i < f->num_rects; i++) {
+        const struct canvas_rect *r = &f->rects[i];
+        SDL_Rect sr = { .x = r->x, .y = r->y, .w = r->w, .h = r->h };
+        SDL_UpdateTexture(screen_texture, &sr, &f->pixels[r->x + (size_t)f->width * r->y], f->width*4);
+    }
+    SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+static int sdl_should_quit(void) {
+    SDL_Event e;
+
+    while (SDL_PollEvent(&e) != 0) {
+        if (e.type == SDL_QUIT)
+            return 1;
+    }
+    return 0;
+}
+
+const struct sink sink_sdl = {
+    .name = "sdl",
+    .start = sdl_start,
+    .frame = sdl_frame,
+    .should_quit = sdl_should_quit,
+    .stop = sdl_stop,
+};
+
+#endif
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "param.h"
+#include "common.h"
+#include "connection.h"
+#include "sink.h"
+
+// Live view of the canvas for viewers on params.stream_port (see README for the format).
+// Every frame, the changed rects are encoded once into a message that all viewers share, so the cost of a frame
+// hardly depends on the number of viewers. New viewers and viewers that fell too far behind get a keyframe with
+// the whole canvas instead, also encoded once per frame for all of them. Everything runs on the frame thread with
+// nonblocking sockets.
+
+#define STREAM_MAX_VIEWERS 256
+#define STREAM_QUEUE_LEN 32 // messages queued per viewer, a viewer with more is resynced with a keyframe
+#define STREAM_MAX_PENDING (32 * 1024 * 1024) // bytes queued per viewer, same
+
+#define MSG_KEYFRAME 'K'
+#define MSG_DELTA 'D'
+#define MSG_HEADER_SIZE 17
+#define RECT_HEADER_SIZE 12
+
+// an encoded frame, shared by the queues of all viewers
+struct stream_msg {
+    unsigned int refs;
+    size_t size;
+    unsigned char data[];
+};
+
+struct viewer {
+    int fd; // -1 = free
+    int need_key;
+    struct stream_msg *queue[STREAM_QUEUE_LEN];
+    unsigned int head;
+    unsigned int count;
+    size_t offset; // bytes of queue[head] already sent
+    size_t pending; // bytes in the queue that were not sent yet
+};
+
+static int listen_fd = -1;
+static struct viewer viewers[STREAM_MAX_VIEWERS];
+static unsigned int num_viewers;
+static unsigned int frame_number;
+
+static void msg_unref(struct stream_msg *m) {
+    m->refs -= 1;
+    if (m->refs == 0) {
+        free(m);
+    }
+}
+
+static void put_le16(unsigned char *p, unsigned int v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, unsigned int v) {
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static unsigned char *put_rgb(unsigned char *out, unsigned int value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    return out + 3;
+}
+
+// run-length encoding of a row as r g b, runs never cross rows. A control byte c < 128 is followed by c + 1
+// literal pixels, a control byte c >= 128 by one pixel that repeats c - 126 times.
+static unsigned char *encode_row(unsigned char *out, const unsigned int *row, unsigned int n) {
+    unsigned int i = 0;
+    while (i < n) {
+        unsigned int run = 1;
+        while (i + run < n && run < 129 && row[i + run] == row[i]) {
+            run += 1;
+        }
+        if (run >= 2) {
+            *out++ = 126 + run;
+            out = put_rgb(out, row[i]);
+            i += run;
+            continue;
+        }
+        // literals up to the next run of two
+        unsigned int start = i;
+        for (i += 1; i < n && i - start < 128 && !(i + 1 < n && row[i] == row[i + 1]); i++) {
+        }
+        *out++ = i - start - 1;
+        for (unsigned int j = start; j < i; j++) {
+            out = put_rgb(out, row[j]);
+        }
+    }
+    return out;
+}
+
+static size_t max_encoded_size(const struct canvas_rect *rects, size_t num_rects) {
+    size_t size = MSG_HEADER_SIZE;
+    for (size_t i = 0; i < num_rects; i++) {
+        // every row: all literals with one control byte per 128 pixels, runs only make it smaller
+        size += RECT_HEADER_SIZE + (size_t)rects[i].h * (3 * rects[i].w + (rects[i].w + 127) / 128 + 1);
+    }
+    return size;
+}
+
+static struct stream_msg *encode(const struct canvas_frame *f, int type, const struct canvas_rect *rects,
+        size_t num_rects) {
+    struct stream_msg *m = malloc(sizeof(*m) + max_encoded_size(rects, num_rects));
+    if (m == NULL) {
+        perror("malloc");
+        exit(1); // TODO
+    }
+    unsigned char *out = m->data + MSG_HEADER_SIZE;
+    for (size_t i = 0; i < num_rects; i++) {
+        const struct canvas_rect *r = &rects[i];
+        unsigned char *rect_header = out;
+        put_le16(rect_header, r->x);
+        put_le16(rect_header + 2, r->y);
+        put_le16(rect_header + 4, r->w);
+        put_le16(rect_header + 6, r->h);
+        out += RECT_HEADER_SIZE;
+        for (unsigned int y = r->y; y < r->y + r->h; y++) {
+            out = encode_row(out, &f->pixels[r->x + (size_t)f->width * y], r->w);
+        }
+        put_le32(rect_header + 8, out - rect_header - RECT_HEADER_SIZE);
+    }
+    m->refs = 1;
+    m->size = out - m->data;
+    put_le32(m->data, m->size - 4);
+    m->data[4] = type;
+    put_le32(m->data + 5, frame_number);
+    put_le16(m->data + 9, f->width);
+    put_le16(m->data + 11, f->height);
+    put_le32(m->data + 13, num_rects);
+    struct stream_msg *shrunk = realloc(m, sizeof(*m) + m->size);
+    return shrunk != NULL ? shrunk : m;
+}
+
+static void viewer_clear(struct viewer *v) {
+    while (v->count > 0) {
+        msg_unref(v->queue[v->head]);
+        v->head = (v->head + 1) % STREAM_QUEUE_LEN;
+        v->count -= 1;
+    }
+    v->offset = 0;
+    v->pending = 0;
+}
+
+static void viewer_close(struct viewer *v) {
+    viewer_clear(v);
+    close(v->fd);
+    v->fd = -1;
+    num_viewers -= 1;
+}
+
+// only whole messages are dropped, a partly sent one stays
+static void viewer_resync(struct viewer *v) {
+    while (v->count > (v->offset > 0)) {
+        unsigned int last = (v->head + v->count - 1) % STREAM_QUEUE_LEN;
+        v->pending -= v->queue[last]->size;
+        msg_unref(v->queue[last]);
+        v->count -= 1;
+    }
+    v->need_key = 1;
+}
+
+// an empty queue takes any message, a keyframe of a large noisy canvas can be bigger than STREAM_MAX_PENDING
+static void viewer_push(struct viewer *v, struct stream_msg *m) {
+    if (v->count == STREAM_QUEUE_LEN || (v->count > 0 && v->pending + m->size > STREAM_MAX_PENDING)) {
+        viewer_resync(v); // gets a keyframe with the next frame
+        return;
+    }
+    m->refs += 1;
+    v->queue[(v->head + v->count) % STREAM_QUEUE_LEN] = m;
+    v->count += 1;
+    v->pending += m->size;
+}
+
+// returns -1 if the viewer is gone
+static int viewer_flush(struct viewer *v) {
+    while (v->count > 0) {
+        struct stream_msg *m = v->queue[v->head];
+        ssize_t status = send(v->fd, m->data + v->offset, m->size - v->offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (WOULD_BLOCK(status)) {
+            return 0;
+        } else if (status < 0) {
+            return -1;
+        }
+        v->offset += status;
+        v->pending -= status;
+        if (v->offset == m->size) {
+            msg_unref(m);
+            v->head = (v->head + 1) % STREAM_QUEUE_LEN;
+            v->count -= 1;
+            v->offset = 0;
+        }
+    }
+    return 0;
+}
+
+// viewers don't send anything, reading only notices when they are gone
+static int viewer_alive(struct viewer *v) {
+    unsigned char scratch[256];
+    ssize_t status;
+    while ((status = recv(v->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0) {
+    }
+    return status != 0 && !IS_REAL_ERROR(status);
+}
+
+static void accept_viewers(void) {
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            return; // wouldblock, or an error of that connection
+        }
+        if (num_viewers == STREAM_MAX_VIEWERS) {
+            printf("WARNING: all viewer slots occupied!\n"); // TODO
+            close(fd);
+            continue;
+        }
+        struct viewer *v = viewers;
+        while (v->fd != -1) {
+            v++;
+        }
+        memset(v, 0, sizeof(*v));
+        v->fd = fd;
+        v->need_key = 1;
+        num_viewers += 1;
+    }
+}
+
+static void stream_start(void) {
+    for (int i = 0; i < STREAM_MAX_VIEWERS; i++) {
+        viewers[i].fd = -1;
+    }
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int should_reuse_address = 1;
+    if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &should_reuse_address,
+                sizeof(should_reuse_address)) != 0) {
+        perror("stream socket");
+        exit(1);
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(params.stream_port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+        perror("stream bind");
+        exit(1);
+    }
+    set_nonblocking(listen_fd);
+    printf("streaming on port %d\n", params.stream_port);
+}
+
+static void stream_frame(const struct canvas_frame *f) {
+    accept_viewers();
+    if (num_viewers == 0) {
+        return; // nothing to encode for
+    }
+    frame_number += 1;
+    struct stream_msg *key = NULL;
+    struct stream_msg *delta = NULL;
+    for (int i = 0; i < STREAM_MAX_VIEWERS; i++) {
+        struct viewer *v = &viewers[i];
+        if (v->fd == -1) {
+            continue;
+        }
+        if (!viewer_alive(v)) {
+            viewer_close(v);
+            continue;
+        }
+        // a viewer waiting for a keyframe gets it as soon as its partly sent message is done
+        if (v->need_key && v->count == 0) {
+            if (key == NULL) {
+                struct canvas_rect all = { .x = 0, .y = 0, .w = f->width, .h = f->height };
+                key = encode(f, MSG_KEYFRAME, &all, 1);
+            }
+            v->need_key = 0;
+            viewer_push(v, key);
+        } else if (!v->need_key && f->num_rects > 0) {
+            if (delta == NULL) {
+                delta = encode(f, MSG_DELTA, f->rects, f->num_rects);
+            }
+            viewer_push(v, delta);
+        }
+        if (viewer_flush(v) != 0) {
+            viewer_close(v);
+        }
+    }
+    if (key != NULL) {
+        msg_unref(key);
+    }
+    if (delta != NULL) {
+        msg_unref(delta);
+    }
+}
+
+static void stream_stop(void) {
+    for (int i = 0; i < STREAM_MAX_VIEWERS; i++) {
+        if (viewers[i].fd != -1) {
+            viewer_close(&viewers[i]);
+        }
+    }
+    close(listen_fd);
+    listen_fd = -1;
+}
+
+const struct sink sink_stream = {
+    .name = "stream",
+    .start = stream_start,
+    .frame = stream_frame,
+    .stop = stream_stop,
+};
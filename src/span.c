@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "span.h"
+
+// dst of fill and convert is always the live canvas (or a row of it), and so are the sources of encode and
+// resolve and the accumulators. The scalar versions use relaxed atomics like the rest of the canvas. The vector
+// versions use plain vector loads/stores: on x86 every aligned 32 bit element of a vector access is read or written
+// as a whole, so readers still never see torn pixels.
+
+static void fill_scalar(unsigned int *dst, unsigned int color, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        __atomic_store_n(&dst[i], color, __ATOMIC_RELAXED);
+    }
+}
+
+static void convert_scalar(unsigned int *dst, const unsigned char *src, size_t n) {
+    for (size_t i = 0; i < n; i++, src += 4) {
+        __atomic_store_n(&dst[i], (src[0] << 24) | (src[1] << 16) | (src[2] << 8) | 0xff, __ATOMIC_RELAXED);
+    }
+}
+
+static void encode_scalar(unsigned char *dst, const unsigned int *src, size_t n) {
+    for (size_t i = 0; i < n; i++, dst += 4) {
+        unsigned int value = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        dst[0] = value >> 24;
+        dst[1] = value >> 16;
+        dst[2] = value >> 8;
+        dst[3] = 1;
+    }
+}
+
+// rounded to the nearest value. The sums stay below 2^31 (see canvas.c), so they convert to float the same way as
+// in the vector versions, and all versions round the same.
+static inline unsigned int average_channel(unsigned int sum, unsigned int weight) {
+    unsigned int c = (int)((float)(int)sum / (float)(int)weight + 0.5f);
+    return c < 255 ? c : 255; // the sum may be ahead of the weight while a draw is under way
+}
+
+static void resolve_average_scalar(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    for (size_t i = index; i < index + n; i++) {
+        unsigned int w = __atomic_load_n(&acc->weight[i], __ATOMIC_RELAXED);
+        if (w == 0) {
+            *dst++ = 0xff;
+            continue;
+        }
+        *dst++ = (average_channel(__atomic_load_n(&acc->r[i], __ATOMIC_RELAXED), w) << 24)
+            | (average_channel(__atomic_load_n(&acc->g[i], __ATOMIC_RELAXED), w) << 16)
+            | (average_channel(__atomic_load_n(&acc->b[i], __ATOMIC_RELAXED), w) << 8) | 0xff;
+    }
+}
+
+static void resolve_blend_scalar(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    for (size_t i = index; i < index + n; i++) {
+        *dst++ = ((__atomic_load_n(&acc->r[i], __ATOMIC_RELAXED) & 0xff00) << 16)
+            | ((__atomic_load_n(&acc->g[i], __ATOMIC_RELAXED) & 0xff00) << 8)
+            | (__atomic_load_n(&acc->b[i], __ATOMIC_RELAXED) & 0xff00) | 0xff;
+    }
+}
+
+// a plain read-modify-write, a concurrent draw to the same pixel may get lost (like with last writer wins)
+static inline unsigned int acc_add(unsigned int *a, unsigned int v) {
+    unsigned int sum = __atomic_load_n(a, __ATOMIC_RELAXED) + v;
+    __atomic_store_n(a, sum, __ATOMIC_RELAXED);
+    return sum;
+}
+
+static unsigned int average_fill_scalar(const struct span_acc *acc, size_t index, unsigned int color, size_t n) {
+    unsigned int r = (color >> 24) * 255;
+    unsigned int g = ((color >> 16) & 0xff) * 255;
+    unsigned int b = ((color >> 8) & 0xff) * 255;
+    unsigned int max_weight = 0;
+    for (size_t i = index; i < index + n; i++) {
+        acc_add(&acc->r[i], r);
+        acc_add(&acc->g[i], g);
+        acc_add(&acc->b[i], b);
+        unsigned int w = acc_add(&acc->weight[i], 255);
+        max_weight = w > max_weight ? w : max_weight;
+    }
+    return max_weight;
+}
+
+static unsigned int average_print_scalar(const struct span_acc *acc, size_t index, const unsigned char *src,
+        int alpha, size_t n) {
+    unsigned int max_weight = 0;
+    for (size_t i = index; i < index + n; i++, src += 4) {
+        unsigned int weight = alpha ? src[3] : 255;
+        acc_add(&acc->r[i], src[0] * weight);
+        acc_add(&acc->g[i], src[1] * weight);
+        acc_add(&acc->b[i], src[2] * weight);
+        unsigned int w = acc_add(&acc->weight[i], weight);
+        max_weight = w > max_weight ? w : max_weight;
+    }
+    return max_weight;
+}
+
+static void blend_print_scalar(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n) {
+    for (size_t i = index; i < index + n; i++, src += 4) {
+        __atomic_store_n(&acc->r[i], src[0] << 8, __ATOMIC_RELAXED);
+        __atomic_store_n(&acc->g[i], src[1] << 8, __ATOMIC_RELAXED);
+        __atomic_store_n(&acc->b[i], src[2] << 8, __ATOMIC_RELAXED);
+    }
+}
+
+static const struct span_kernels kernels_scalar = {
+    .name = "scalar",
+    .fill = fill_scalar,
+    .convert = convert_scalar,
+    .encode = encode_scalar,
+    .resolve_average = resolve_average_scalar,
+    .resolve_blend = resolve_blend_scalar,
+    .average_fill = average_fill_scalar,
+    .average_print = average_print_scalar,
+    .blend_print = blend_print_scalar,
+};
+
+#ifdef HAVE_X86_SIMD
+// as little-endian words, r g b x is 0xxxbbggrr and RGBA8888 is 0xrrggbbff: the byte order is reversed and the
+// lowest byte is replaced by alpha (or the inside flag of GET)
+#define SHUF_CONVERT -1, 2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12
+#define SHUF_ENCODE 3, 2, 1, -1, 7, 6, 5, -1, 11, 10, 9, -1, 15, 14, 13, -1
+
+__attribute__((target("sse4.1")))
+static void fill_sse41(unsigned int *dst, unsigned int color, size_t n) {
+    const __m128i c = _mm_set1_epi32(color);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)&dst[i], c);
+    }
+    fill_scalar(dst + i, color, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void convert_sse41(unsigned int *dst, const unsigned char *src, size_t n) {
+    const __m128i shuf = _mm_setr_epi8(SHUF_CONVERT);
+    const __m128i alpha = _mm_set1_epi32(0xff);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+    }
+    convert_scalar(dst + i, src + 4 * i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void encode_sse41(unsigned char *dst, const unsigned int *src, size_t n) {
+    const __m128i shuf = _mm_setr_epi8(SHUF_ENCODE);
+    const __m128i inside = _mm_set1_epi32(0x01000000);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_or_si128(_mm_shuffle_epi8(v, shuf), inside));
+    }
+    encode_scalar(dst + 4 * i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(unsigned int *dst, unsigned int color, size_t n) {
+    const __m256i c = _mm256_set1_epi32(color);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)&dst[i], c);
+    }
+    fill_scalar(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_avx2(unsigned int *dst, const unsigned char *src, size_t n) {
+    const __m256i shuf = _mm256_setr_epi8(SHUF_CONVERT, SHUF_CONVERT);
+    const __m256i alpha = _mm256_set1_epi32(0xff);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha));
+    }
+    convert_scalar(dst + i, src + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(unsigned char *dst, const unsigned int *src, size_t n) {
+    const __m256i shuf = _mm256_setr_epi8(SHUF_ENCODE, SHUF_ENCODE);
+    const __m256i inside = _mm256_set1_epi32(0x01000000);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), inside));
+    }
+    encode_scalar(dst + 4 * i, src + i, n - i);
+}
+
+// sum / weight rounded per lane, a weight of 0 divides to garbage that is masked out by the caller
+#define AVERAGE_CHANNEL_SSE41(sum, weight) \
+    _mm_min_epu32(_mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(sum), weight), _mm_set1_ps(0.5f))), \
+            _mm_set1_epi32(255))
+
+__attribute__((target("sse4.1")))
+static void resolve_average_sse41(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    const __m128i alpha = _mm_set1_epi32(0xff);
+    size_t i = index;
+    for (; i + 4 <= index + n; i += 4, dst += 4) {
+        __m128i w = _mm_loadu_si128((const __m128i *)&acc->weight[i]);
+        __m128 wf = _mm_cvtepi32_ps(w);
+        __m128i vr = AVERAGE_CHANNEL_SSE41(_mm_loadu_si128((const __m128i *)&acc->r[i]), wf);
+        __m128i vg = AVERAGE_CHANNEL_SSE41(_mm_loadu_si128((const __m128i *)&acc->g[i]), wf);
+        __m128i vb = AVERAGE_CHANNEL_SSE41(_mm_loadu_si128((const __m128i *)&acc->b[i]), wf);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(vr, 24), _mm_slli_epi32(vg, 16)), _mm_slli_epi32(vb, 8));
+        v = _mm_andnot_si128(_mm_cmpeq_epi32(w, _mm_setzero_si128()), v);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(v, alpha));
+    }
+    resolve_average_scalar(dst, acc, i, index + n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void resolve_blend_sse41(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    const __m128i mask = _mm_set1_epi32(0xff00);
+    const __m128i alpha = _mm_set1_epi32(0xff);
+    size_t i = index;
+    for (; i + 4 <= index + n; i += 4, dst += 4) {
+        __m128i vr = _mm_and_si128(_mm_loadu_si128((const __m128i *)&acc->r[i]), mask);
+        __m128i vg = _mm_and_si128(_mm_loadu_si128((const __m128i *)&acc->g[i]), mask);
+        __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i *)&acc->b[i]), mask);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(vr, 16), _mm_slli_epi32(vg, 8)), vb);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(v, alpha));
+    }
+    resolve_blend_scalar(dst, acc, i, index + n - i);
+}
+
+// adds v to the 4 accumulators at a and returns the sums
+__attribute__((target("sse4.1")))
+static inline __m128i acc_add_sse41(unsigned int *a, __m128i v) {
+    __m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i *)a), v);
+    _mm_storeu_si128((__m128i *)a, sum);
+    return sum;
+}
+
+__attribute__((target("sse4.1")))
+static unsigned int max_lane_sse41(__m128i v) {
+    v = _mm_max_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_epu32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1")))
+static unsigned int average_fill_sse41(const struct span_acc *acc, size_t index, unsigned int color, size_t n) {
+    const __m128i r = _mm_set1_epi32((color >> 24) * 255);
+    const __m128i g = _mm_set1_epi32(((color >> 16) & 0xff) * 255);
+    const __m128i b = _mm_set1_epi32(((color >> 8) & 0xff) * 255);
+    const __m128i weight = _mm_set1_epi32(255);
+    __m128i max_weight = _mm_setzero_si128();
+    size_t i = index;
+    for (; i + 4 <= index + n; i += 4) {
+        acc_add_sse41(&acc->r[i], r);
+        acc_add_sse41(&acc->g[i], g);
+        acc_add_sse41(&acc->b[i], b);
+        max_weight = _mm_max_epu32(max_weight, acc_add_sse41(&acc->weight[i], weight));
+    }
+    unsigned int max = average_fill_scalar(acc, i, color, index + n - i);
+    unsigned int lanes = max_lane_sse41(max_weight);
+    return lanes > max ? lanes : max;
+}
+
+// r g b x as little-endian words is 0xxxbbggrr (0xaabbggrr with alpha). The products of two bytes fit into 16
+// bits, so they are done with 16 bit multiplies on the low halves of the words.
+__attribute__((target("sse4.1")))
+static unsigned int average_print_sse41(const struct span_acc *acc, size_t index, const unsigned char *src,
+        int alpha, size_t n) {
+    const __m128i byte = _mm_set1_epi32(0xff);
+    __m128i max_weight = _mm_setzero_si128();
+    size_t i = index;
+    for (; i + 4 <= index + n; i += 4, src += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i weight = alpha ? _mm_srli_epi32(v, 24) : byte;
+        acc_add_sse41(&acc->r[i], _mm_mullo_epi16(_mm_and_si128(v, byte), weight));
+        acc_add_sse41(&acc->g[i], _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), byte), weight));
+        acc_add_sse41(&acc->b[i], _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 16), byte), weight));
+        max_weight = _mm_max_epu32(max_weight, acc_add_sse41(&acc->weight[i], weight));
+    }
+    unsigned int max = average_print_scalar(acc, i, src, alpha, index + n - i);
+    unsigned int lanes = max_lane_sse41(max_weight);
+    return lanes > max ? lanes : max;
+}
+
+__attribute__((target("sse4.1")))
+static void blend_print_sse41(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n) {
+    const __m128i mask = _mm_set1_epi32(0xff00);
+    size_t i = index;
+    for (; i + 4 <= index + n; i += 4, src += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)&acc->r[i], _mm_and_si128(_mm_slli_epi32(v, 8), mask));
+        _mm_storeu_si128((__m128i *)&acc->g[i], _mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i *)&acc->b[i], _mm_and_si128(_mm_srli_epi32(v, 8), mask));
+    }
+    blend_print_scalar(acc, i, src, index + n - i);
+}
+
+#define AVERAGE_CHANNEL_AVX2(sum, weight) \
+    _mm256_min_epu32(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(_mm256_cvtepi32_ps(sum), weight), \
+            _mm256_set1_ps(0.5f))), _mm256_set1_epi32(255))
+
+__attribute__((target("avx2")))
+static void resolve_average_avx2(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    const __m256i alpha = _mm256_set1_epi32(0xff);
+    size_t i = index;
+    for (; i + 8 <= index + n; i += 8, dst += 8) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)&acc->weight[i]);
+        __m256 wf = _mm256_cvtepi32_ps(w);
+        __m256i vr = AVERAGE_CHANNEL_AVX2(_mm256_loadu_si256((const __m256i *)&acc->r[i]), wf);
+        __m256i vg = AVERAGE_CHANNEL_AVX2(_mm256_loadu_si256((const __m256i *)&acc->g[i]), wf);
+        __m256i vb = AVERAGE_CHANNEL_AVX2(_mm256_loadu_si256((const __m256i *)&acc->b[i]), wf);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(vr, 24), _mm256_slli_epi32(vg, 16)),
+                _mm256_slli_epi32(vb, 8));
+        v = _mm256_andnot_si256(_mm256_cmpeq_epi32(w, _mm256_setzero_si256()), v);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(v, alpha));
+    }
+    resolve_average_scalar(dst, acc, i, index + n - i);
+}
+
+__attribute__((target("avx2")))
+static void resolve_blend_avx2(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    const __m256i mask = _mm256_set1_epi32(0xff00);
+    const __m256i alpha = _mm256_set1_epi32(0xff);
+    size_t i = index;
+    for (; i + 8 <= index + n; i += 8, dst += 8) {
+        __m256i vr = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&acc->r[i]), mask);
+        __m256i vg = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&acc->g[i]), mask);
+        __m256i vb = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&acc->b[i]), mask);
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(vr, 16), _mm256_slli_epi32(vg, 8)), vb);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(v, alpha));
+    }
+    resolve_blend_scalar(dst, acc, i, index + n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i acc_add_avx2(unsigned int *a, __m256i v) {
+    __m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)a), v);
+    _mm256_storeu_si256((__m256i *)a, sum);
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static unsigned int max_lane_avx2(__m256i v) {
+    __m128i m = _mm_max_epu32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(m);
+}
+
+__attribute__((target("avx2")))
+static unsigned int average_fill_avx2(const struct span_acc *acc, size_t index, unsigned int color, size_t n) {
+    const __m256i r = _mm256_set1_epi32((color >> 24) * 255);
+    const __m256i g = _mm256_set1_epi32(((color >> 16) & 0xff) * 255);
+    const __m256i b = _mm256_set1_epi32(((color >> 8) & 0xff) * 255);
+    const __m256i weight = _mm256_set1_epi32(255);
+    __m256i max_weight = _mm256_setzero_si256();
+    size_t i = index;
+    for (; i + 8 <= index + n; i += 8) {
+        acc_add_avx2(&acc->r[i], r);
+        acc_add_avx2(&acc->g[i], g);
+        acc_add_avx2(&acc->b[i], b);
+        max_weight = _mm256_max_epu32(max_weight, acc_add_avx2(&acc->weight[i], weight));
+    }
+    unsigned int max = average_fill_scalar(acc, i, color, index + n - i);
+    unsigned int lanes = max_lane_avx2(max_weight);
+    return lanes > max ? lanes : max;
+}
+
+__attribute__((target("avx2")))
+static unsigned int average_print_avx2(const struct span_acc *acc, size_t index, const unsigned char *src,
+        int alpha, size_t n) {
+    const __m256i byte = _mm256_set1_epi32(0xff);
+    __m256i max_weight = _mm256_setzero_si256();
+    size_t i = index;
+    for (; i + 8 <= index + n; i += 8, src += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        __m256i weight = alpha ? _mm256_srli_epi32(v, 24) : byte;
+        acc_add_avx2(&acc->r[i], _mm256_mullo_epi16(_mm256_and_si256(v, byte), weight));
+        acc_add_avx2(&acc->g[i], _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(v, 8), byte), weight));
+        acc_add_avx2(&acc->b[i], _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(v, 16), byte), weight));
+        max_weight = _mm256_max_epu32(max_weight, acc_add_avx2(&acc->weight[i], weight));
+    }
+    unsigned int max = average_print_scalar(acc, i, src, alpha, index + n - i);
+    unsigned int lanes = max_lane_avx2(max_weight);
+    return lanes > max ? lanes : max;
+}
+
+__attribute__((target("avx2")))
+static void blend_print_avx2(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n) {
+    const __m256i mask = _mm256_set1_epi32(0xff00);
+    size_t i = index;
+    for (; i + 8 <= index + n; i += 8, src += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)&acc->r[i], _mm256_and_si256(_mm256_slli_epi32(v, 8), mask));
+        _mm256_storeu_si256((__m256i *)&acc->g[i], _mm256_and_si256(v, mask));
+        _mm256_storeu_si256((__m256i *)&acc->b[i], _mm256_and_si256(_mm256_srli_epi32(v, 8), mask));
+    }
+    blend_print_scalar(acc, i, src, index + n - i);
+}
+
+static const struct span_kernels kernels_sse41 = {
+    .name = "sse4.1",
+    .fill = fill_sse41,
+    .convert = convert_sse41,
+    .encode = encode_sse41,
+    .resolve_average = resolve_average_sse41,
+    .resolve_blend = resolve_blend_sse41,
+    .average_fill = average_fill_sse41,
+    .average_print = average_print_sse41,
+    .blend_print = blend_print_sse41,
+};
+
+static const struct span_kernels kernels_avx2 = {
+    .name = "avx2",
+    .fill = fill_avx2,
+    .convert = convert_avx2,
+    .encode = encode_avx2,
+    .resolve_average = resolve_average_avx2,
+    .resolve_blend = resolve_blend_avx2,
+    .average_fill = average_fill_avx2,
+    .average_print = average_print_avx2,
+    .blend_print = blend_print_avx2,
+};
+
+const struct span_kernels *const span_sse41 = &kernels_sse41;
+const struct span_kernels *const span_avx2 = &kernels_avx2;
+#else
+const struct span_kernels *const span_sse41 = NULL;
+const struct span_kernels *const span_avx2 = NULL;
+#endif
+
+const struct span_kernels *const span_scalar = &kernels_scalar;
+
+static const struct span_kernels *impl = &kernels_scalar;
+
+int span_cpu_supports(const struct span_kernels *k) {
+    if (k == NULL) {
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (k == span_avx2) {
+        return __builtin_cpu_supports("avx2");
+    } else if (k == span_sse41) {
+        return __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return 1;
+}
+
+void span_init(void) {
+    if (span_cpu_supports(span_avx2)) {
+        impl = span_avx2;
+    } else if (span_cpu_supports(span_sse41)) {
+        impl = span_sse41;
+    } else {
+        impl = span_scalar;
+    }
+}
+
+const char *span_impl_name(void) {
+    return impl->name;
+}
+
+void span_fill(unsigned int *dst, unsigned int color, size_t n) {
+    impl->fill(dst, color, n);
+}
+
+void span_convert(unsigned int *dst, const unsigned char *src, size_t n) {
+    impl->convert(dst, src, n);
+}
+
+void span_encode(unsigned char *dst, const unsigned int *src, size_t n) {
+    impl->encode(dst, src, n);
+}
+
+void span_resolve_average(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    impl->resolve_average(dst, acc, index, n);
+}
+
+void span_resolve_blend(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n) {
+    impl->resolve_blend(dst, acc, index, n);
+}
+
+unsigned int span_average_fill(const struct span_acc *acc, size_t index, unsigned int color, size_t n) {
+    return impl->average_fill(acc, index, color, n);
+}
+
+unsigned int span_average_print(const struct span_acc *acc, size_t index, const unsigned char *src, int alpha,
+        size_t n) {
+    return impl->average_print(acc, index, src, alpha, n);
+}
+
+void span_blend_print(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n) {
+    impl->blend_print(acc, index, src, n);
+}
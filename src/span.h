@@ -0,0 +1,65 @@
+#ifndef PFS_SPAN_H
+#define PFS_SPAN_H
+
+#include <stddef.h>
+
+// Row kernels for the rectangle commands, used by the span functions of the canvas (see canvas.h).
+// Colors on the wire are 4 bytes r g b x, canvas pixels are RGBA8888 (see decode.h).
+
+typedef void (*span_fill_fn)(unsigned int *dst, unsigned int color, size_t n);
+// r g b x -> RGBA8888
+typedef void (*span_convert_fn)(unsigned int *dst, const unsigned char *src, size_t n);
+// RGBA8888 -> r g b 1, the response format of GET
+typedef void (*span_encode_fn)(unsigned char *dst, const unsigned int *src, size_t n);
+
+// The accumulators of the draw modes other than overwrite, one array per channel (see canvas.c). Every kernel works
+// on the n pixels starting at index.
+// - average: r, g, b are sums of channel * weight, weight the sum of the weights
+// - blend: r, g, b are the color in 8.8 fixed point, weight is not used
+struct span_acc {
+    unsigned int *r;
+    unsigned int *g;
+    unsigned int *b;
+    unsigned int *weight;
+};
+
+// accumulators -> RGBA8888. average: every channel is sum / weight rounded, black if the weight is 0.
+typedef void (*span_resolve_fn)(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n);
+// average: adds an RGBA8888 color with weight 255 to every pixel. Returns the largest weight of the span afterwards.
+typedef unsigned int (*span_average_fill_fn)(const struct span_acc *acc, size_t index, unsigned int color, size_t n);
+// average: adds the colors r g b x with weight 255, or r g b a with weight a if alpha is set. Returns the same.
+typedef unsigned int (*span_average_print_fn)(const struct span_acc *acc, size_t index, const unsigned char *src,
+        int alpha, size_t n);
+// blend: sets the pixels to the opaque colors r g b x
+typedef void (*span_blend_print_fn)(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n);
+
+struct span_kernels {
+    const char *name;
+    span_fill_fn fill;
+    span_convert_fn convert;
+    span_encode_fn encode;
+    span_resolve_fn resolve_average;
+    span_resolve_fn resolve_blend;
+    span_average_fill_fn average_fill;
+    span_average_print_fn average_print;
+    span_blend_print_fn blend_print;
+};
+
+void span_init(void); // selects the best implementation for this cpu
+const char *span_impl_name(void);
+void span_fill(unsigned int *dst, unsigned int color, size_t n);
+void span_convert(unsigned int *dst, const unsigned char *src, size_t n);
+void span_encode(unsigned char *dst, const unsigned int *src, size_t n);
+void span_resolve_average(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n);
+void span_resolve_blend(unsigned int *dst, const struct span_acc *acc, size_t index, size_t n);
+unsigned int span_average_fill(const struct span_acc *acc, size_t index, unsigned int color, size_t n);
+unsigned int span_average_print(const struct span_acc *acc, size_t index, const unsigned char *src, int alpha, size_t n);
+void span_blend_print(const struct span_acc *acc, size_t index, const unsigned char *src, size_t n);
+
+// individual implementations, exported for benchmarks. NULL if not supported by cpu or compiler.
+extern const struct span_kernels *const span_scalar;
+extern const struct span_kernels *const span_sse41;
+extern const struct span_kernels *const span_avx2;
+int span_cpu_supports(const struct span_kernels *k);
+
+#endif
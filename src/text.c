@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "text.h"
+
+const char TEXT_HELP_RESPONSE[] =
+    "HELP pixelflut text protocol, one command per line:\n"
+    "HELP PX x y rrggbb      draw a pixel, rrggbbaa draws with alpha\n"
+    "HELP PX x y             read a pixel, the response is PX x y rrggbb\n"
+    "HELP SIZE               the response is SIZE width height\n"
+    "HELP OFFSET x y         added to the coordinates of the following commands\n";
+
+// hex digit + 1, 0 for everything else
+static const unsigned char hex_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// at least one space. returns the position after them, NULL if there is none
+static inline const unsigned char *skip_spaces(const unsigned char *p, const unsigned char *end) {
+    if (p == end || *p != ' ') {
+        return NULL;
+    }
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+// 1 to 5 digits, larger numbers are invalid. returns the position after them, NULL if invalid
+static inline const unsigned char *parse_decimal(const unsigned char *p, const unsigned char *end, unsigned int *v) {
+    const unsigned char *start = p;
+    unsigned int x = 0;
+    while (p < end && (unsigned int)(*p - '0') < 10) {
+        x = x * 10 + (*p - '0');
+        p++;
+    }
+    if (p == start || p - start > 5) {
+        return NULL;
+    }
+    *v = x;
+    return p;
+}
+
+// rrggbb or rrggbbaa up to end. All digits are looked up before the one check, so there is no branch per digit.
+static inline int parse_color(const unsigned char *p, const unsigned char *end, unsigned int *color) {
+    size_t n = end - p;
+    if (n != 6 && n != 8) {
+        return 0;
+    }
+    unsigned int v = 0;
+    unsigned int bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned int t = hex_table[p[i]] - 1u; // 0..15, or all bits set
+        bad |= t;
+        v = (v << 4) | (t & 0xf);
+    }
+    if (bad > 0xf) {
+        return 0;
+    }
+    *color = n == 6 ? (v << 8) | 0xff : v;
+    return 1;
+}
+
+// the line without its newline is p[0..end)
+static void parse_line(const unsigned char *p, const unsigned char *end, struct text_cmd *cmd) {
+    cmd->type = TEXT_INVALID;
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ')) {
+        end--;
+    }
+    size_t n = end - p;
+    if (n > 2 && p[0] == 'P' && p[1] == 'X') {
+        p += 2;
+        if ((p = skip_spaces(p, end)) == NULL || (p = parse_decimal(p, end, &cmd->x)) == NULL
+                || (p = skip_spaces(p, end)) == NULL || (p = parse_decimal(p, end, &cmd->y)) == NULL) {
+            return;
+        }
+        if (p == end) {
+            cmd->type = TEXT_PX_GET;
+        } else if ((p = skip_spaces(p, end)) != NULL && parse_color(p, end, &cmd->color)) {
+            cmd->type = TEXT_PX_SET;
+        }
+    } else if (n == 4 && memcmp(p, "SIZE", 4) == 0) {
+        cmd->type = TEXT_SIZE;
+    } else if (n == 4 && memcmp(p, "HELP", 4) == 0) {
+        cmd->type = TEXT_HELP;
+    } else if (n > 6 && memcmp(p, "OFFSET", 6) == 0) {
+        p += 6;
+        if ((p = skip_spaces(p, end)) != NULL && (p = parse_decimal(p, end, &cmd->x)) != NULL
+                && (p = skip_spaces(p, end)) != NULL && (p = parse_decimal(p, end, &cmd->y)) != NULL && p == end) {
+            cmd->type = TEXT_OFFSET;
+        }
+    }
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// SWAR: the 8 bytes of a word are looked at in parallel, the first byte of the text is the lowest one.
+#define ONES 0x0101010101010101ULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+static inline unsigned long long load_word(const unsigned char *p) {
+    unsigned long long w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+// high bit of every byte of w (all bytes < 0x80) that is in lo..hi
+static inline unsigned long long bytes_between(unsigned long long w, unsigned int lo, unsigned int hi) {
+    return (w + ONES * (0x80 - lo)) & ~(w + ONES * (0x7f - hi)) & HIGH_BITS;
+}
+
+// combines the k (1..5) decimal digits in the highest bytes of w, the other bytes are cleared first. Three multiply
+// steps combine neighbours.
+static inline unsigned int combine_digits(unsigned long long w, size_t k) {
+    unsigned long long d = w & (ONES * 0x0f) & (~0ULL << (8 * (8 - k)));
+    d = (d * 2561) >> 8; // 10 * 256 + 1
+    d = ((d & 0x00ff00ff00ff00ffULL) * 6553601) >> 16; // 100 * 65536 + 1
+    return ((d & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32; // 10000 * 2^32 + 1
+}
+
+// the decimal number at the start of w, followed by a space. Returns its number of digits (1..5), 0 otherwise.
+static inline size_t word_decimal(unsigned long long w, unsigned int *v) {
+    unsigned long long other = ~bytes_between(w, '0', '9') & HIGH_BITS;
+    if ((w & HIGH_BITS) || other == 0) {
+        return 0; // 8 digits, like "PX 12345678 1 ffffff"
+    }
+    size_t k = __builtin_ctzll(other) / 8;
+    if (k == 0 || k > 5 || ((w >> (8 * k)) & 0xff) != ' ') {
+        return 0;
+    }
+    *v = combine_digits(w << (8 * (8 - k)), k);
+    return k;
+}
+
+// the decimal number at the end of w, after a space. Returns its number of digits (1..5), 0 otherwise.
+static inline size_t word_decimal_end(unsigned long long w, unsigned int *v) {
+    unsigned long long other = ~bytes_between(w, '0', '9') & HIGH_BITS;
+    if ((w & HIGH_BITS) || other == 0) {
+        return 0;
+    }
+    size_t j = (63 - __builtin_clzll(other)) / 8;
+    size_t k = 7 - j;
+    if (k == 0 || k > 5 || ((w >> (8 * j)) & 0xff) != ' ') {
+        return 0;
+    }
+    *v = combine_digits(w, k);
+    return k;
+}
+
+// n = 6 or 8 hex digits at the start of w
+static inline int word_hex(unsigned long long w, size_t n, unsigned int *color) {
+    unsigned long long lower = w | (ONES * 0x20);
+    unsigned long long valid = bytes_between(w, '0', '9') | bytes_between(lower, 'a', 'f');
+    unsigned long long want = n == 8 ? HIGH_BITS : HIGH_BITS >> 16;
+    if ((w & HIGH_BITS) || (valid & want) != want) {
+        return 0;
+    }
+    unsigned long long nib = (w & (ONES * 0x0f)) + ((w >> 6) & ONES) * 9; // letters have bit 6 set
+    unsigned long long pairs = (nib << 4) | (nib >> 8); // byte 2i is digit 2i and 2i + 1
+    unsigned int v = ((pairs & 0xff) << 24) | (((pairs >> 16) & 0xff) << 16) | (((pairs >> 32) & 0xff) << 8);
+    *color = v | (n == 8 ? (pairs >> 48) & 0xff : 0xff);
+    return 1;
+}
+
+// "PX x y color" with single spaces, the line is p[0..nl) and at least 2 bytes can be read after it.
+// Everything else is left to parse_line. The line end is known, so the color and y are found from the end and x from
+// the start, and the three words are loaded and decoded independently of each other. The lengths have to add up to
+// the line in the end.
+static inline int parse_px_fast(const unsigned char *p, const unsigned char *nl, struct text_cmd *cmd) {
+    size_t n = nl[-7] == ' ' ? 6 : 8;
+    const unsigned char *color = nl - n;
+    if (color - 9 < p || p[0] != 'P' || p[1] != 'X' || p[2] != ' ' || color[-1] != ' ') {
+        return 0; // too short to load the y word inside the line, like "PX 1 2 rrggbb"
+    }
+    size_t kx = word_decimal(load_word(p + 3), &cmd->x);
+    size_t ky = word_decimal_end(load_word(color - 9), &cmd->y);
+    return kx != 0 && ky != 0 && 3 + kx + 1 + ky + 1 == (size_t)(color - p)
+        && word_hex(load_word(color), n, &cmd->color);
+}
+#else
+static inline int parse_px_fast(const unsigned char *p, const unsigned char *nl, struct text_cmd *cmd) {
+    (void)p;
+    (void)nl;
+    (void)cmd;
+    return 0;
+}
+#endif
+
+int text_sniff(const unsigned char *p, size_t len) {
+    static const char *const prefixes[] = { "PX ", "SIZE", "HELP", "OFFSET" };
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        size_t k = strlen(prefixes[i]);
+        if (memcmp(p, prefixes[i], len < k ? len : k) == 0) {
+            return len < k ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+void text_parse(const unsigned char *p, size_t len, struct text_cmd *cmd) {
+    const unsigned char *nl = memchr(p, '\n', len < TEXT_MAX_LINE ? len : TEXT_MAX_LINE);
+    if (nl == NULL) {
+        cmd->type = len < TEXT_MAX_LINE ? TEXT_INCOMPLETE : TEXT_INVALID;
+        return;
+    }
+    cmd->length = nl - p + 1;
+    parse_line(p, nl, cmd);
+}
+
+size_t text_print_run_with(text_scan_fn scan, const unsigned char *p, size_t len, size_t max_cmds,
+        unsigned int offset_x, unsigned int offset_y, const struct print_area *a, struct print_batch *b, size_t *used) {
+    if (max_cmds > PRINT_BATCH_MAX) {
+        max_cmds = PRINT_BATCH_MAX;
+    }
+    if (len > max_cmds * TEXT_MAX_LINE) {
+        len = max_cmds * TEXT_MAX_LINE; // enough for max_cmds valid lines, and the offsets fit into 16 bits
+    }
+    unsigned short ends[PRINT_BATCH_MAX];
+    size_t num_lines = scan(p, len, ends, max_cmds);
+    struct text_cmd cmd;
+    size_t start = 0;
+    size_t i;
+    b->n = 0;
+    for (i = 0; i < num_lines; i++) {
+        if (ends[i] - start >= TEXT_MAX_LINE) {
+            break; // invalid, text_parse reports it
+        }
+        if ((size_t)ends[i] + 2 > len || !parse_px_fast(p + start, p + ends[i], &cmd)) {
+            parse_line(p + start, p + ends[i], &cmd);
+            if (cmd.type != TEXT_PX_SET) {
+                break;
+            }
+        }
+        unsigned int x = cmd.x + offset_x;
+        unsigned int y = cmd.y + offset_y;
+        if (x < a->width && y < a->height) {
+            b->index[b->n] = a->offset + x + a->stride * y;
+            b->color[b->n] = cmd.color;
+            b->n += 1;
+        }
+        start = ends[i] + 1;
+    }
+    *used = start;
+    return i;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static inline unsigned char *format_hex(unsigned char *dst, unsigned int v) {
+    dst[0] = hex_digits[v >> 4];
+    dst[1] = hex_digits[v & 0xf];
+    return dst + 2;
+}
+
+size_t text_format_px(unsigned char *dst, unsigned int x, unsigned int y, unsigned int r, unsigned int g,
+        unsigned int b) {
+    int n = snprintf((char *)dst, TEXT_MAX_RESPONSE, "PX %u %u ", x, y);
+    unsigned char *wp = dst + n;
+    wp = format_hex(wp, r);
+    wp = format_hex(wp, g);
+    wp = format_hex(wp, b);
+    *wp++ = '\n';
+    return wp - dst;
+}
+
+size_t text_format_size(unsigned char *dst, unsigned int w, unsigned int h) {
+    return snprintf((char *)dst, TEXT_MAX_RESPONSE, "SIZE %u %u\n", w, h);
+}
+
+static size_t scan_generic(const unsigned char *p, size_t len, unsigned short *ends, size_t max) {
+    size_t n = 0;
+    const unsigned char *q = p;
+    while (n < max && (q = memchr(q, '\n', p + len - q)) != NULL) {
+        ends[n++] = q - p;
+        q++;
+    }
+    return n;
+}
+
+#ifdef HAVE_X86_SIMD
+// one compare per 16 or 32 bytes, then the bits of the mask are the newlines in order
+__attribute__((target("sse2")))
+static size_t scan_sse2(const unsigned char *p, size_t len, unsigned short *ends, size_t max) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 16 <= len && n < max; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+        for (; mask != 0 && n < max; mask &= mask - 1) {
+            ends[n++] = i + __builtin_ctz(mask);
+        }
+    }
+    return n + (n < max ? scan_generic(p + i, len - i, ends + n, max - n) : 0);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const unsigned char *p, size_t len, unsigned short *ends, size_t max) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0;
+    size_t i = 0;
+    for (; i + 32 <= len && n < max; i += 32) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+        for (; mask != 0 && n < max; mask &= mask - 1) {
+            ends[n++] = i + __builtin_ctz(mask);
+        }
+    }
+    return n + (n < max ? scan_generic(p + i, len - i, ends + n, max - n) : 0);
+}
+
+const text_scan_fn text_scan_sse2 = scan_sse2;
+const text_scan_fn text_scan_avx2 = scan_avx2;
+#else
+const text_scan_fn text_scan_sse2 = NULL;
+const text_scan_fn text_scan_avx2 = NULL;
+#endif
+
+const text_scan_fn text_scan_generic = scan_generic;
+
+static text_scan_fn scan_impl = scan_generic;
+
+int text_cpu_supports(text_scan_fn fn) {
+    if (fn == NULL) {
+        return 0;
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (fn == text_scan_avx2) {
+        return __builtin_cpu_supports("avx2");
+    } else if (fn == text_scan_sse2) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return 1;
+}
+
+void text_init(void) {
+    if (text_cpu_supports(text_scan_avx2)) {
+        scan_impl = text_scan_avx2;
+    } else if (text_cpu_supports(text_scan_sse2)) {
+        scan_impl = text_scan_sse2;
+    } else {
+        scan_impl = text_scan_generic;
+    }
+}
+
+const char *text_impl_name(void) {
+    if (scan_impl == text_scan_avx2) {
+        return "avx2";
+    } else if (scan_impl == text_scan_sse2) {
+        return "sse2";
+    }
+    return "generic";
+}
+
+size_t text_print_run(const unsigned char *p, size_t len, size_t max_cmds, unsigned int offset_x, unsigned int offset_y,
+        const struct print_area *a, struct print_batch *b, size_t *used) {
+    return text_print_run_with(scan_impl, p, len, max_cmds, offset_x, offset_y, a, b, used);
+}
@@ -0,0 +1,72 @@
+#ifndef PFS_TEXT_H
+#define PFS_TEXT_H
+
+#include <stddef.h>
+
+#include "decode.h"
+
+// Parser for the classic text pixelflut protocol, one command per line ending in "\n" or "\r\n", fields separated by
+// one or more spaces:
+//   PX x y rrggbb     draw, x and y decimal, the color in hex
+//   PX x y rrggbbaa   draw with alpha, like ALPHA RECTANGLE PRINT
+//   PX x y            read, the response is "PX x y rrggbb\n"
+//   SIZE              the response is "SIZE w h\n"
+//   HELP              the response is TEXT_HELP_RESPONSE
+//   OFFSET x y        added to the coordinates of all following PX commands of the connection
+// A connection speaks text if its first bytes are "PX ", "SIZE", "HELP" or "OFFSET" (see connection_step). Only a
+// binary PRINT to x = 8280 starts like "PX ", and no binary opcode starts like the others.
+//
+// Runs of draws are parsed in bulk like binary PRINT runs (see decode.h): the newlines of the run are found with SIMD
+// first, then every line is checked and decoded between known bounds, without looking for its end byte by byte.
+
+#define TEXT_MAX_LINE 64 // longer lines are invalid
+#define TEXT_MAX_RESPONSE 32 // "PX 99999 99999 rrggbb\n" or "SIZE 65535 65535\n"
+
+#define TEXT_INCOMPLETE 0 // no newline yet
+#define TEXT_INVALID 1
+#define TEXT_PX_SET 2
+#define TEXT_PX_GET 3
+#define TEXT_SIZE 4
+#define TEXT_HELP 5
+#define TEXT_OFFSET 6
+
+struct text_cmd {
+    int type;
+    size_t length; // of the line including the newline
+    unsigned int x;
+    unsigned int y;
+    unsigned int color; // RGBA8888
+};
+
+extern const char TEXT_HELP_RESPONSE[];
+
+// finds the newlines in p[0..len), stores up to max offsets in ends and returns their number
+typedef size_t (*text_scan_fn)(const unsigned char *p, size_t len, unsigned short *ends, size_t max);
+
+void text_init(void); // selects the best newline scanner for this cpu
+const char *text_impl_name(void);
+// whether p starts like a text command, -1 if there are not enough bytes to tell yet
+int text_sniff(const unsigned char *p, size_t len);
+// parses the first line of p[0..len). cmd->type is TEXT_INCOMPLETE if there is no newline in the first
+// TEXT_MAX_LINE bytes yet, TEXT_INVALID if there is none at all.
+void text_parse(const unsigned char *p, size_t len, struct text_cmd *cmd);
+// parses up to max_cmds consecutive draws, stops at the first line that is something else or incomplete. The
+// coordinates are shifted by (offset_x, offset_y), pixels inside the area are appended to the batch (at most
+// PRINT_BATCH_MAX). Returns the number of draws and sets *used to their length in bytes.
+size_t text_print_run(const unsigned char *p, size_t len, size_t max_cmds, unsigned int offset_x, unsigned int offset_y,
+        const struct print_area *a, struct print_batch *b, size_t *used);
+// formats the response of a read or of SIZE into dst (TEXT_MAX_RESPONSE bytes), returns its length
+size_t text_format_px(unsigned char *dst, unsigned int x, unsigned int y, unsigned int r, unsigned int g,
+        unsigned int b);
+size_t text_format_size(unsigned char *dst, unsigned int w, unsigned int h);
+
+// individual scanners, exported for benchmarks. NULL if not supported by the compiler.
+extern const text_scan_fn text_scan_generic;
+extern const text_scan_fn text_scan_sse2;
+extern const text_scan_fn text_scan_avx2;
+int text_cpu_supports(text_scan_fn fn);
+// text_print_run with the given scanner
+size_t text_print_run_with(text_scan_fn scan, const unsigned char *p, size_t len, size_t max_cmds,
+        unsigned int offset_x, unsigned int offset_y, const struct print_area *a, struct print_batch *b, size_t *used);
+
+#endif
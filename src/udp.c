@@ -0,0 +1,237 @@
+#define _GNU_SOURCE // recvmmsg
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+
+#include "param.h"
+#include "common.h"
+#include "canvas.h"
+#include "decode.h"
+#include "metrics.h"
+#include "region.h"
+#include "sched.h"
+#include "udp.h"
+
+// how long recvmmsg blocks at most, this is how long it takes to notice udp_stop
+#define UDP_TIMEOUT_MS 100
+#define UDP_SOCKET_BUF (8 * 1024 * 1024) // requested receive buffer, the kernel caps it at net.core.rmem_max
+#define UDP_REGION_RETRY_US 1000000 // how often a source without a region looks again, a tcp client may claim one
+
+// A source ip and its token bucket. The table is direct mapped and only touched by its worker: an ip takes
+// over the slot of another one with the same hash and starts with a full bucket. That is cheaper than a real hash
+// table and bounds the memory, a sender with many addresses can get around the rate either way.
+struct udp_source {
+    in_addr_t addr;
+    int used;
+    struct token_bucket pixels;
+    struct region region; // cached, region_find takes a lock
+    unsigned long long region_time; // clock_now_us() of the lookup
+};
+
+struct udp_worker {
+    pthread_t thread;
+    int fd;
+    struct udp_source *sources; // UDP_RATE_SLOTS
+    struct metrics metrics; // the worker is the only writer, like a network worker
+    struct udp_stats stats; // same
+} __attribute__((aligned(64)));
+
+static struct udp_worker *udp_workers;
+static int num_udp_workers;
+static volatile int udp_quit = 0;
+
+static struct udp_source *source_get(struct udp_worker *w, in_addr_t addr, unsigned long long now_us) {
+    struct udp_source *s = &w->sources[((addr * 2654435761U) >> 16) % UDP_RATE_SLOTS];
+    if (!s->used || s->addr != addr) {
+        s->used = 1;
+        s->addr = addr;
+        token_bucket_init(&s->pixels, quota_config.udp_pixels, now_us);
+        s->region_time = now_us - UDP_REGION_RETRY_US;
+        s->region.w = 0;
+    }
+    // udp never claims a split screen cell (see region_find), it only uses the one of a tcp client of the ip
+    if (s->region.w == 0 && now_us - s->region_time >= UDP_REGION_RETRY_US) {
+        s->region = region_find(addr);
+        s->region_time = now_us;
+    }
+    return s;
+}
+
+static void handle_datagram(struct udp_worker *w, const unsigned char *rp, size_t len, in_addr_t addr,
+        unsigned long long now_us, struct metrics_counters *m) {
+    struct udp_source *s = source_get(w, addr, now_us);
+    size_t num_cmds = len / 8;
+    size_t allowed = token_bucket_take(&s->pixels, num_cmds, now_us);
+    struct print_area area = { s->region.w, s->region.h, params.tex_size_x,
+        s->region.x + params.tex_size_x * s->region.y };
+    struct print_batch batch;
+    size_t done = 0;
+    while (done < allowed) {
+        size_t n = decode_print_run(rp + 8 * done, allowed - done, &area, &batch);
+        if (n == 0) {
+            break; // not a PRINT, the rest is dropped
+        }
+        canvas_set_batch(&batch);
+        done += n;
+    }
+    token_bucket_refund(&s->pixels, allowed - done);
+    if (allowed < num_cmds) {
+        metrics_inc(&w->stats.limited_pixels, num_cmds - allowed);
+    }
+    m->bytes_in += len;
+    m->pixels_drawn += done;
+    m->commands[metrics_opcode_index['P']] += done;
+}
+
+static void *udp_thread_main(void *arg) {
+    struct udp_worker *w = arg;
+    unsigned char *data = malloc((size_t)UDP_BATCH * UDP_MAX_DATAGRAM);
+    if (data == NULL) {
+        perror("malloc");
+        exit(1); // TODO
+    }
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = data + (size_t)i * UDP_MAX_DATAGRAM;
+        iovs[i].iov_len = UDP_MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+    }
+
+    while (!udp_quit) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]); // overwritten by recvmmsg
+        }
+        // blocks until the first datagram (or the timeout), then takes whatever else is already queued
+        int n = recvmmsg(w->fd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        metrics_inc(&w->stats.syscalls, 1);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror("recvmmsg");
+            exit(1); // TODO
+        }
+        unsigned long long now = clock_now_us();
+        struct metrics_counters step = {0};
+        for (int i = 0; i < n; i++) {
+            handle_datagram(w, iovs[i].iov_base, msgs[i].msg_len, addrs[i].sin_addr.s_addr, now, &step);
+        }
+        metrics_inc(&w->stats.datagrams, n);
+        metrics_counters_add(&w->metrics.counters, &step);
+    }
+    free(data);
+    return NULL;
+}
+
+static int open_socket(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("udp socket");
+        exit(1);
+    }
+    int should_reuse_port = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &should_reuse_port, sizeof(should_reuse_port)) != 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+    int buf_size = UDP_SOCKET_BUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size)); // best effort
+    struct timeval timeout = { 0, UDP_TIMEOUT_MS * 1000 };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(params.udp_port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        perror("udp bind");
+        exit(1);
+    }
+    return fd;
+}
+
+// without the filter the kernel picks the socket by the hash of source ip and port, so a sender with several ports
+// would get the rate of several workers. The filter returns the index of the socket in bind order.
+static void steer_by_source_ip(int fd, int n) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 }, // source address of the ip header
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        perror("udp steering filter");
+        exit(1);
+    }
+}
+
+void udp_start(void) {
+    num_udp_workers = params.udp_workers;
+    udp_workers = aligned_alloc(64, num_udp_workers * sizeof(*udp_workers)); // the size is a multiple of 64
+    if (udp_workers == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(udp_workers, 0, num_udp_workers * sizeof(*udp_workers));
+    // all sockets are bound before the filter is attached and before any worker starts
+    for (int i = 0; i < num_udp_workers; i++) {
+        udp_workers[i].fd = open_socket();
+        udp_workers[i].sources = calloc(UDP_RATE_SLOTS, sizeof(struct udp_source));
+        if (udp_workers[i].sources == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+    if (num_udp_workers > 1) {
+        steer_by_source_ip(udp_workers[0].fd, num_udp_workers);
+    }
+    udp_quit = 0;
+    for (int i = 0; i < num_udp_workers; i++) {
+        if (pthread_create(&udp_workers[i].thread, NULL, udp_thread_main, &udp_workers[i]) != 0) {
+            printf("pthread_create\n");
+            exit(1);
+        }
+    }
+    printf("udp on port %d (%d worker(s))\n", params.udp_port, num_udp_workers);
+}
+
+void udp_stop(void) {
+    udp_quit = 1;
+    for (int i = 0; i < num_udp_workers; i++) {
+        pthread_join(udp_workers[i].thread, NULL);
+        close(udp_workers[i].fd);
+        free(udp_workers[i].sources);
+    }
+    free(udp_workers);
+    udp_workers = NULL;
+    num_udp_workers = 0;
+}
+
+void udp_get_stats(struct udp_stats *s) {
+    memset(s, 0, sizeof(*s));
+    for (int i = 0; i < num_udp_workers; i++) {
+        const struct udp_stats *ws = &udp_workers[i].stats;
+        s->datagrams += __atomic_load_n(&ws->datagrams, __ATOMIC_RELAXED);
+        s->syscalls += __atomic_load_n(&ws->syscalls, __ATOMIC_RELAXED);
+        s->limited_pixels += __atomic_load_n(&ws->limited_pixels, __ATOMIC_RELAXED);
+    }
+}
+
+void udp_get_metrics(struct metrics *sum) {
+    for (int i = 0; i < num_udp_workers; i++) {
+        metrics_sum(sum, &udp_workers[i].metrics);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef PFS_UDP_H
+#define PFS_UDP_H
+
+struct metrics;
+
+// UDP ingest on params.udp_port: every datagram is a batch of 8 byte PRINT commands, applied to the canvas without
+// any per-client state besides a token bucket per source ip (quota_config.udp_pixels). There are no responses and
+// nothing is retransmitted, datagrams that don't fit into the socket buffer are lost.
+//
+// Every udp worker thread drains its own SO_REUSEPORT socket with recvmmsg, UDP_BATCH datagrams per syscall. A
+// socket filter steers all datagrams of a source ip to the same worker, so the token buckets are per worker and
+// need no locking. Datagrams stop at the first command that is not a PRINT, the rest of the datagram and a trailing
+// partial command are ignored.
+
+#define UDP_BATCH 64
+#define UDP_MAX_DATAGRAM 65536
+#define UDP_RATE_SLOTS 4096 // source ips with their own token bucket, see udp.c
+
+struct udp_stats {
+    unsigned long long datagrams;
+    unsigned long long syscalls; // recvmmsg
+    unsigned long long limited_pixels; // dropped because the source ip was over its rate
+};
+
+// started and stopped by net_start and net_stop if params.udp_port is set, with params.udp_workers threads
+void udp_start(void);
+void udp_stop(void);
+// sums the counters of all udp workers
+void udp_get_stats(struct udp_stats *s);
+// adds the counters of the udp workers to sum (see metrics.h)
+void udp_get_metrics(struct metrics *sum);
+
+#endif
@@ -0,0 +1,410 @@
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "connection.h"
+#include "uring.h"
+
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+
+// user_data of every request: pointer to the struct uring_conn (8 byte aligned) plus tag in the low bits
+#define TAG_ACCEPT 1
+#define TAG_RECV 2
+#define TAG_SEND 3
+#define TAG_CANCEL 4
+#define TAG_MASK 7ULL
+
+struct uring_conn {
+    struct uring *u;
+    struct connection *c; // NULL once the connection is closed, the struct lives until all its requests completed
+    struct connection *slot; // slot of a closed connection, released once all requests completed
+    unsigned int inflight; // requests with a final cqe still to come
+    // end of the bytes the kernel received into recvbuf. The ones past recvbuf.write_pos are not handed to the
+    // connection yet, so its byte budget still applies to them.
+    size_t recv_pos;
+    int recv_armed;
+    int send_inflight;
+    int eof;
+    int error;
+    struct uring_conn *next_free;
+};
+
+struct uring {
+    int fd;
+    int sockfd;
+    unsigned int to_submit;
+    // submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    // completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    size_t num_uconns; // struct uring_conn in use, including closed ones with requests in flight
+    struct uring_conn *free_uconns; // recycled to keep allocations out of accepting
+    unsigned long long enters; // io_uring_enter() syscalls
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void uring_enter(struct uring *u, unsigned min_complete, int timeout_ms) {
+    struct __kernel_timespec ts = {0};
+    struct io_uring_getevents_arg arg = {0};
+    unsigned flags = 0;
+    if (min_complete > 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    }
+    int ret = sys_io_uring_enter(u->fd, u->to_submit, min_complete, flags, min_complete > 0 ? &arg : NULL, sizeof(arg));
+    u->enters += 1;
+    if (ret >= 0) {
+        u->to_submit -= ret;
+    } else if (errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter");
+        exit(1); // TODO
+    }
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+        uring_enter(u, 0, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries) {
+            printf("io_uring submission queue stuck\n");
+            exit(1); // TODO
+        }
+    }
+    unsigned index = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    // the kernel only looks at the queue in io_uring_enter, so publishing right away is fine
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit += 1;
+    return sqe;
+}
+
+static uint64_t make_user_data(struct uring_conn *uc, uint64_t tag) {
+    return (uint64_t)(uintptr_t)uc | tag;
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (p == MAP_FAILED) {
+        perror("mmap io_uring");
+        exit(1);
+    }
+    return p;
+}
+
+static void arm_accept(struct uring *u) {
+    struct io_uring_sqe *sqe = get_sqe(u);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+struct uring *uring_create(int sockfd) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (u == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    u->sockfd = sockfd;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd == -1 && errno == EINVAL) { // older kernel, retry without the optimization flags
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd == -1) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        printf("io_uring: kernel too old\n");
+        exit(1);
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = u->sq_ring_size;
+    u->sq_ring = map_ring(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring; // IORING_FEAT_SINGLE_MMAP
+    u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_entries = *(unsigned *)((char *)u->sq_ring + p.sq_off.ring_entries);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = map_ring(u->fd, u->sqes_size, IORING_OFF_SQES);
+
+    arm_accept(u);
+    return u;
+}
+
+static void uconn_free(struct uring_conn *uc) {
+    struct uring *u = uc->u;
+    u->num_uconns -= 1;
+    uc->next_free = u->free_uconns;
+    u->free_uconns = uc;
+}
+
+// receives directly into the free space of recvbuf, which the ring keeps contiguous
+static void maybe_arm_recv(struct uring_conn *uc) {
+    struct connection *c = uc->c;
+    if (c == NULL || uc->recv_armed || uc->eof || uc->error) {
+        return;
+    }
+    size_t space = c->recvbuf.capacity - (uc->recv_pos - c->recvbuf.read_pos);
+    if (space == 0) {
+        return; // armed again by uring_recv once the connection consumed something
+    }
+    struct io_uring_sqe *sqe = get_sqe(uc->u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer_at(&c->recvbuf, uc->recv_pos);
+    sqe->len = space;
+    sqe->user_data = make_user_data(uc, TAG_RECV);
+    uc->recv_armed = 1;
+    uc->inflight += 1;
+}
+
+static void cancel(struct uring_conn *uc, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(uc->u);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(uc, tag);
+    sqe->user_data = make_user_data(uc, TAG_CANCEL);
+    uc->inflight += 1;
+}
+
+void uring_conn_open(struct uring *u, struct connection *c) {
+    struct uring_conn *uc = u->free_uconns;
+    if (uc != NULL) {
+        u->free_uconns = uc->next_free;
+        memset(uc, 0, sizeof(*uc));
+    } else if ((uc = calloc(1, sizeof(*uc))) == NULL) {
+        perror("calloc");
+        exit(1); // TODO
+    }
+    uc->u = u;
+    uc->c = c;
+    c->uring = uc;
+    c->readable = 0; // only set by completions
+    u->num_uconns += 1;
+    maybe_arm_recv(uc);
+}
+
+int uring_conn_close(struct connection *c) {
+    struct uring_conn *uc = c->uring;
+    if (uc->recv_armed) {
+        cancel(uc, TAG_RECV);
+    }
+    if (uc->send_inflight) {
+        cancel(uc, TAG_SEND);
+    }
+    uc->c = NULL;
+    c->uring = NULL;
+    if (uc->inflight == 0) {
+        uconn_free(uc);
+        return 0;
+    }
+    // the kernel may still access the buffers of the slot
+    uc->slot = c;
+    return 1;
+}
+
+int uring_recv(struct connection *c, size_t max) {
+    struct uring_conn *uc = c->uring;
+    size_t received = uc->recv_pos - c->recvbuf.write_pos;
+    if (received == 0) {
+        maybe_arm_recv(uc);
+        c->readable = 0;
+        if (uc->error) {
+            return CONNECTION_ERR;
+        } else if (uc->eof) {
+            return CONNECTION_END;
+        }
+        return CONNECTION_OK;
+    }
+    c->recvbuf.write_pos += received < max ? received : max;
+    maybe_arm_recv(uc);
+    // without a recv in flight the next call has to arm it, after the connection consumed some data
+    c->readable = uc->recv_pos != c->recvbuf.write_pos || uc->eof || uc->error || !uc->recv_armed;
+    return CONNECTION_OK;
+}
+
+int uring_send(struct connection *c) {
+    struct uring_conn *uc = c->uring;
+    if (uc->error) {
+        return CONNECTION_ERR;
+    }
+    if (uc->send_inflight || buffer_size(&c->sendbuf) == 0) {
+        return CONNECTION_OK;
+    }
+    struct io_uring_sqe *sqe = get_sqe(uc->u);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer_at(&c->sendbuf, c->sendbuf.read_pos);
+    sqe->len = buffer_size(&c->sendbuf);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(uc, TAG_SEND);
+    uc->send_inflight = 1;
+    uc->inflight += 1;
+    c->writable = 0; // until the completion arrives
+    return CONNECTION_OK;
+}
+
+static void handle_recv(struct uring_conn *uc, const struct io_uring_cqe *cqe) {
+    uc->recv_armed = 0;
+    uc->inflight -= 1;
+    if (uc->c == NULL) {
+        return;
+    }
+    if (cqe->res > 0) {
+        uc->recv_pos += cqe->res;
+    } else if (cqe->res == 0) {
+        uc->eof = 1;
+    } else if (cqe->res != -ECANCELED) {
+        uc->error = 1;
+    }
+    uc->c->readable = 1;
+    maybe_arm_recv(uc);
+}
+
+static void handle_send(struct uring_conn *uc, const struct io_uring_cqe *cqe) {
+    uc->send_inflight = 0;
+    uc->inflight -= 1;
+    struct connection *c = uc->c;
+    if (c == NULL) {
+        return;
+    }
+    if (cqe->res < 0) {
+        uc->error = 1;
+        c->readable = 1; // report the error from the next receive
+        return;
+    }
+    c->sendbuf.read_pos += cqe->res;
+    c->writable = 1;
+}
+
+void uring_poll(struct uring *u, int timeout_ms, uring_accept_fn on_accept, uring_ready_fn on_ready,
+        uring_release_fn on_release, void *arg) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) && timeout_ms > 0) {
+        uring_enter(u, 1, timeout_ms);
+    } else if (u->to_submit > 0) {
+        uring_enter(u, 0, 0);
+    }
+
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        uint64_t tag = cqe->user_data & TAG_MASK;
+        struct uring_conn *uc = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~TAG_MASK);
+        if (tag == TAG_ACCEPT) {
+            if (cqe->res >= 0) {
+                on_accept(arg, cqe->res);
+            } else if (cqe->res != -ECANCELED) {
+                errno = -cqe->res;
+                perror("accept");
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                arm_accept(u);
+            }
+            continue;
+        } else if (tag == TAG_RECV) {
+            handle_recv(uc, cqe);
+        } else if (tag == TAG_SEND) {
+            handle_send(uc, cqe);
+        } else if (tag == TAG_CANCEL) {
+            uc->inflight -= 1;
+        }
+        if (uc->c != NULL) {
+            on_ready(arg, uc->c);
+        } else if (uc->inflight == 0) {
+            on_release(arg, uc->slot);
+            uconn_free(uc);
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void ignore_accept(void *arg, int connfd) {
+    (void)arg;
+    close(connfd);
+}
+
+static void ignore_ready(void *arg, struct connection *c) {
+    (void)arg;
+    (void)c;
+}
+
+static void ignore_release(void *arg, struct connection *c) {
+    (void)arg;
+    (void)c;
+}
+
+void uring_destroy(struct uring *u) {
+    // wait (bounded) for the requests of closed connections, so their state can be freed
+    for (int i = 0; i < 10 && u->num_uconns > 0; i++) {
+        uring_poll(u, 10, ignore_accept, ignore_ready, ignore_release, NULL);
+    }
+    close(u->fd);
+    while (u->free_uconns != NULL) {
+        struct uring_conn *uc = u->free_uconns;
+        u->free_uconns = uc->next_free;
+        free(uc);
+    }
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    free(u);
+}
+
+unsigned long long uring_enter_count(const struct uring *u) {
+    return u->enters;
+}
@@ -0,0 +1,36 @@
+#ifndef PFS_URING_H
+#define PFS_URING_H
+
+#include <stddef.h>
+
+// io_uring backend for a network worker, used instead of epoll + read()/write() if selected at startup.
+// - incoming connections are accepted with a multishot accept
+// - every connection keeps a recv posted that receives directly into the free space of its recvbuf. The received
+//   bytes are handed to the connection on demand, within its byte budget, without copying them again.
+// - sends are queued while stepping the connections and submitted in one io_uring_enter() per round.
+
+struct connection;
+struct uring;
+struct uring_conn;
+
+typedef void (*uring_accept_fn)(void *arg, int connfd);
+typedef void (*uring_ready_fn)(void *arg, struct connection *c);
+// the kernel is done with the buffers of a closed connection, see uring_conn_close
+typedef void (*uring_release_fn)(void *arg, struct connection *c);
+
+struct uring *uring_create(int sockfd);
+void uring_destroy(struct uring *u);
+// submit queued requests and handle all completions. Blocks up to timeout_ms if nothing completed yet.
+void uring_poll(struct uring *u, int timeout_ms, uring_accept_fn on_accept, uring_ready_fn on_ready,
+        uring_release_fn on_release, void *arg);
+// io_uring_enter() syscalls so far
+unsigned long long uring_enter_count(const struct uring *u);
+
+void uring_conn_open(struct uring *u, struct connection *c);
+// returns 1 if requests are still in flight, the slot of c is handed to on_release once they completed
+int uring_conn_close(struct connection *c);
+// same contracts as the corresponding read()/write() paths in connection.c
+int uring_recv(struct connection *c, size_t max);
+int uring_send(struct connection *c);
+
+#endif
@@ -0,0 +1,423 @@
+// Load generator: K connections replay a mix of P/G/p/f/g commands as fast as possible.
+//
+// usage: bench [--host 127.0.0.1] [--port 1337] [--conns 8] [--seconds 5] [--pid <server pid>]
+//              [--mix P=1] [--rect 16] [--batch 1024] [--inflight 4] [--json <file>] [--label <text>]
+//              [--udp <port>]
+//
+// --mix     relative weights of the commands, e.g. P=70,G=10,p=10,f=5,g=5
+// --rect    width and height of the rectangles for p, f and g. b (BATCH PRINT) sends rect * rect records.
+// --batch   commands per write(). GET latency is measured from the write of the batch to the response.
+// --inflight  batches with responses that may be outstanding before the connection waits for the server.
+//           without a limit, the latency would mostly measure how much fits into the socket buffers.
+// --json    append the results as one JSON line to the file, so runs can be compared over time
+// --udp     send the PRINT commands as datagrams of --batch commands to this udp port of the server instead. Only
+//           P is allowed in the mix. Datagrams the server could not take are counted from the Udp RcvbufErrors of
+//           /proc/net/snmp (so nothing else should use udp on the machine) and not counted as drawn.
+//
+// With --pid, the CPU time the server spent during the run is read from /proc and reported per pixel.
+// Run it once against `server` and once against `server -u` to compare the network backends.
+
+use std::io::{Read, Write};
+use std::net::{TcpStream, UdpSocket};
+use std::sync::mpsc;
+use std::time::{Duration, Instant};
+
+const OPCODES: [u8; 6] = [b'P', b'G', b'p', b'f', b'g', b'b'];
+
+struct Args {
+    host: String,
+    port: u16,
+    conns: usize,
+    seconds: f64,
+    pid: Option<u32>,
+    mix: [u32; 6], // weights in the order of OPCODES
+    rect: u16,
+    batch: usize,
+    inflight: usize,
+    json: Option<String>,
+    label: String,
+    udp: Option<u16>,
+}
+
+fn parse_mix(text: &str) -> [u32; 6] {
+    let mut mix = [0u32; 6];
+    for part in text.split(',') {
+        let (op, weight) = part.split_once('=').expect("--mix: expected op=weight");
+        let index = OPCODES.iter().position(|&o| op.as_bytes() == [o]).expect("--mix: unknown opcode");
+        mix[index] = weight.parse().expect("--mix: weight");
+    }
+    assert!(mix.iter().sum::<u32>() > 0, "--mix: all weights are 0");
+    mix
+}
+
+fn parse_args() -> Args {
+    let mut args = Args {
+        host: "127.0.0.1".to_string(),
+        port: 1337,
+        conns: 8,
+        seconds: 5.0,
+        pid: None,
+        mix: parse_mix("P=1"),
+        rect: 16,
+        batch: 1024,
+        inflight: 4,
+        json: None,
+        label: String::new(),
+        udp: None,
+    };
+    let argv: Vec<String> = std::env::args().collect();
+    let mut i = 1;
+    while i < argv.len() {
+        let value = argv.get(i + 1).cloned().unwrap_or_default();
+        match argv[i].as_str() {
+            "--host" => args.host = value,
+            "--port" => args.port = value.parse().expect("--port"),
+            "--conns" => args.conns = value.parse().expect("--conns"),
+            "--seconds" => args.seconds = value.parse().expect("--seconds"),
+            "--pid" => args.pid = Some(value.parse().expect("--pid")),
+            "--mix" => args.mix = parse_mix(&value),
+            "--rect" => args.rect = value.parse().expect("--rect"),
+            "--batch" => args.batch = value.parse().expect("--batch"),
+            "--inflight" => args.inflight = value.parse().expect("--inflight"),
+            "--json" => args.json = Some(value),
+            "--label" => args.label = value,
+            "--udp" => args.udp = Some(value.parse().expect("--udp")),
+            other => panic!("unknown argument {}", other),
+        }
+        i += 2;
+    }
+    assert!(args.rect > 0 && args.rect < 4096, "--rect must be in 1..4096");
+    if args.udp.is_some() {
+        assert!(args.mix[1..].iter().all(|&w| w == 0), "--udp: only P is allowed in the mix");
+        assert!(args.batch > 0 && args.batch * 8 <= 65507, "--udp: a datagram holds at most 8188 commands");
+    }
+    args
+}
+
+// utime + stime of a process in seconds
+fn cpu_seconds(pid: u32) -> f64 {
+    let stat = std::fs::read_to_string(format!("/proc/{}/stat", pid)).expect("read /proc/<pid>/stat");
+    // the command name may contain spaces, fields are counted after the closing parenthesis
+    let rest = &stat[stat.rfind(')').unwrap() + 2..];
+    let fields: Vec<&str> = rest.split_whitespace().collect();
+    let utime: u64 = fields[11].parse().unwrap();
+    let stime: u64 = fields[12].parse().unwrap();
+    (utime + stime) as f64 / 100.0 // USER_HZ is 100 on all common linux configurations
+}
+
+// datagrams the kernel dropped because a socket buffer was full, for all udp sockets of the machine
+fn udp_rcvbuf_errors() -> u64 {
+    let snmp = std::fs::read_to_string("/proc/net/snmp").expect("read /proc/net/snmp");
+    let mut lines = snmp.lines().filter(|line| line.starts_with("Udp:"));
+    let (names, values) = (lines.next().unwrap(), lines.next().unwrap());
+    let index = names.split_whitespace().position(|name| name == "RcvbufErrors").unwrap();
+    values.split_whitespace().nth(index).unwrap().parse().unwrap()
+}
+
+fn decode_u32(data: &[u8]) -> u32 {
+    (data[0] as u32) | ((data[1] as u32) << 8) | ((data[2] as u32) << 16) | ((data[3] as u32) << 24)
+}
+
+fn server_size(stream: &mut TcpStream) -> std::io::Result<(u32, u32)> {
+    let mut data = [0u8; 8];
+    data[0] = b'I';
+    stream.write_all(&data)?;
+    let mut response = [0u8; 16];
+    stream.read_exact(&mut response)?;
+    Ok((decode_u32(&response[0..4]), decode_u32(&response[4..8])))
+}
+
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+}
+
+// generates batches of commands with pseudo random coordinates inside the canvas
+struct Generator {
+    rng: Rng,
+    width: u32,
+    height: u32,
+    mix: [u32; 6],
+    rect: u16,
+}
+
+// what a batch of commands adds to the totals, and what the reader has to expect
+#[derive(Default)]
+struct BatchInfo {
+    drawn: u64, // pixels written by P, p, f
+    read: u64, // pixels read by G, g
+    response_bytes: usize,
+    gets: usize, // number of G commands, their responses are timed
+}
+
+impl Generator {
+    fn opcode(&mut self) -> u8 {
+        let total: u32 = self.mix.iter().sum();
+        let mut r = (self.rng.next() % total as u64) as u32;
+        for (i, &weight) in self.mix.iter().enumerate() {
+            if r < weight {
+                return OPCODES[i];
+            }
+            r -= weight;
+        }
+        unreachable!()
+    }
+
+    fn batch(&mut self, count: usize, data: &mut Vec<u8>) -> BatchInfo {
+        data.clear();
+        let mut info = BatchInfo::default();
+        let rect = self.rect as u32;
+        for _ in 0..count {
+            let op = self.opcode();
+            let state = self.rng.next();
+            if op == b'b' {
+                // records anywhere in the 256x256 window of a base inside the canvas
+                let count = (rect * rect).min(65535);
+                let (x, y) = (state % self.width as u64, (state >> 24) % self.height as u64);
+                data.push(op);
+                data.extend_from_slice(&(count as u16).to_le_bytes());
+                data.extend_from_slice(&(x as u16).to_le_bytes());
+                data.extend_from_slice(&(y as u16).to_le_bytes());
+                data.push(0);
+                for _ in 0..count {
+                    data.extend_from_slice(&self.rng.next().to_le_bytes()[..5]);
+                }
+                info.drawn += count as u64;
+                continue;
+            }
+            let (x, y) = if op == b'P' || op == b'G' {
+                (state % self.width as u64, (state >> 24) % self.height as u64)
+            } else {
+                // rects stay inside the canvas where possible
+                (state % self.width.saturating_sub(rect).max(1) as u64,
+                 (state >> 24) % self.height.saturating_sub(rect).max(1) as u64)
+            };
+            let color = (state >> 40) as u32;
+            data.push(op);
+            data.extend_from_slice(&(x as u16).to_le_bytes());
+            data.extend_from_slice(&(y as u16).to_le_bytes());
+            match op {
+                b'P' => {
+                    data.extend_from_slice(&color.to_le_bytes()[..3]);
+                    info.drawn += 1;
+                }
+                b'G' => {
+                    data.extend_from_slice(&[0, 0, 0]);
+                    info.read += 1;
+                    info.response_bytes += 4;
+                    info.gets += 1;
+                }
+                _ => {
+                    data.push(rect as u8);
+                    data.push(rect as u8);
+                    data.push((((rect >> 8) & 0x0f) | ((rect >> 4) & 0xf0)) as u8);
+                    let pixels = (rect * rect) as u64;
+                    if op == b'p' {
+                        for i in 0..pixels as u32 {
+                            data.extend_from_slice(&color.wrapping_add(i).to_le_bytes());
+                        }
+                        info.drawn += pixels;
+                    } else if op == b'f' {
+                        data.extend_from_slice(&color.to_le_bytes());
+                        info.drawn += pixels;
+                    } else {
+                        info.read += pixels;
+                        info.response_bytes += 4 * pixels as usize;
+                    }
+                }
+            }
+        }
+        info
+    }
+}
+
+#[derive(Default)]
+struct ConnResult {
+    drawn: u64,
+    read: u64,
+    latencies_us: Vec<u32>, // one per G command
+}
+
+// the writer sends the batches, the reader receives the responses of each batch in order and times the GETs.
+// they are separate threads, so large RECTANGLE GET responses can't deadlock against our own writes.
+fn run_connection(id: usize, addr: &str, args: &Args, duration: Duration) -> std::io::Result<ConnResult> {
+    let mut stream = TcpStream::connect(addr)?;
+    stream.set_nodelay(true)?;
+    let (width, height) = server_size(&mut stream)?;
+    let mut reader = stream.try_clone()?;
+    let (tx, rx) = mpsc::sync_channel::<(Instant, BatchInfo)>(args.inflight.max(1) - 1);
+
+    let reader_thread = std::thread::spawn(move || -> std::io::Result<Vec<u32>> {
+        let mut latencies = Vec::new();
+        let mut buf = vec![0u8; 1 << 16];
+        for (sent, info) in rx {
+            let mut remaining = info.response_bytes;
+            while remaining > 0 {
+                let n = remaining.min(buf.len());
+                reader.read_exact(&mut buf[..n])?;
+                remaining -= n;
+            }
+            // all GETs of a batch are answered once the whole response arrived
+            let latency = sent.elapsed().as_micros().min(u32::MAX as u128) as u32;
+            latencies.extend(std::iter::repeat(latency).take(info.gets));
+        }
+        Ok(latencies)
+    });
+
+    let mut generator = Generator {
+        rng: Rng((id as u64 + 1) * 0x9e3779b97f4a7c15),
+        width,
+        height,
+        mix: args.mix,
+        rect: args.rect,
+    };
+    let mut result = ConnResult::default();
+    let mut data = Vec::new();
+    let start = Instant::now();
+    while start.elapsed() < duration {
+        let info = generator.batch(args.batch, &mut data);
+        result.drawn += info.drawn;
+        result.read += info.read;
+        let sent = Instant::now();
+        stream.write_all(&data)?;
+        if info.response_bytes > 0 {
+            tx.send((sent, info)).unwrap();
+        }
+    }
+    // the answer to a GET arrives after all previous commands were processed
+    stream.write_all(&[b'G', 0, 0, 0, 0, 0, 0, 0])?;
+    tx.send((Instant::now(), BatchInfo { response_bytes: 4, ..Default::default() })).unwrap();
+    drop(tx);
+    result.latencies_us = reader_thread.join().unwrap()?;
+    Ok(result)
+}
+
+// fire and forget: sends datagrams of --batch PRINT commands until the time is up
+fn run_udp_connection(id: usize, addr: &str, port: u16, args: &Args, duration: Duration) -> std::io::Result<ConnResult> {
+    let mut stream = TcpStream::connect(addr)?;
+    let (width, height) = server_size(&mut stream)?;
+    let socket = UdpSocket::bind("0.0.0.0:0")?;
+    socket.connect((args.host.as_str(), port))?;
+    let mut generator = Generator {
+        rng: Rng((id as u64 + 1) * 0x9e3779b97f4a7c15),
+        width,
+        height,
+        mix: args.mix,
+        rect: args.rect,
+    };
+    let mut result = ConnResult::default();
+    let mut data = Vec::new();
+    let start = Instant::now();
+    while start.elapsed() < duration {
+        let info = generator.batch(args.batch, &mut data);
+        socket.send(&data)?;
+        result.drawn += info.drawn;
+    }
+    Ok(result)
+}
+
+fn percentile(sorted: &[u32], p: f64) -> u32 {
+    if sorted.is_empty() {
+        return 0;
+    }
+    let index = ((sorted.len() - 1) as f64 * p / 100.0).round() as usize;
+    sorted[index]
+}
+
+fn main() {
+    let args = parse_args();
+    let addr = format!("{}:{}", args.host, args.port);
+    let duration = Duration::from_secs_f64(args.seconds);
+
+    let cpu_before = args.pid.map(cpu_seconds);
+    let udp_errors_before = args.udp.map(|_| udp_rcvbuf_errors());
+    let start = Instant::now();
+    let results: Vec<ConnResult> = std::thread::scope(|scope| {
+        let threads: Vec<_> = (0..args.conns)
+            .map(|id| {
+                let (addr, args) = (&addr, &args);
+                scope.spawn(move || match args.udp {
+                    Some(port) => run_udp_connection(id, addr, port, args, duration).expect("udp connection"),
+                    None => run_connection(id, addr, args, duration).expect("connection"),
+                })
+            })
+            .collect();
+        threads.into_iter().map(|t| t.join().unwrap()).collect()
+    });
+    let elapsed = start.elapsed().as_secs_f64();
+    // the server drains its socket in well below this time
+    let dropped = udp_errors_before.map(|before| {
+        std::thread::sleep(Duration::from_millis(200));
+        (udp_rcvbuf_errors() - before) * args.batch as u64
+    });
+    let server_cpu = match (args.pid, cpu_before) {
+        (Some(pid), Some(before)) => Some(cpu_seconds(pid) - before),
+        _ => None,
+    };
+
+    let sent: u64 = results.iter().map(|r| r.drawn).sum();
+    let drawn = sent - dropped.unwrap_or(0).min(sent);
+    let read: u64 = results.iter().map(|r| r.read).sum();
+    let mut latencies: Vec<u32> = results.iter().flat_map(|r| r.latencies_us.iter().copied()).collect();
+    latencies.sort_unstable();
+    // fairness: share of each connection in the total work, relative to an equal share
+    let work: Vec<u64> = results.iter().map(|r| r.drawn + r.read).collect();
+    let mean = (drawn + read) as f64 / args.conns as f64;
+    let min_share = *work.iter().min().unwrap() as f64 / mean;
+    let max_share = *work.iter().max().unwrap() as f64 / mean;
+    let mix: Vec<String> = OPCODES.iter().zip(args.mix.iter()).filter(|(_, &w)| w > 0)
+        .map(|(&op, w)| format!("{}={}", op as char, w)).collect();
+    let mix = mix.join(",");
+    let p = [50.0, 90.0, 99.0, 99.9];
+
+    println!("connections:   {}", args.conns);
+    println!("mix:           {} (rect {}x{}, batch {}, inflight {})", mix, args.rect, args.rect, args.batch,
+        args.inflight);
+    println!("pixels:        {}", drawn);
+    if let Some(dropped) = dropped {
+        println!("udp:           {} sent, {} dropped ({:.1}%)", sent, dropped, dropped as f64 * 100.0 / sent.max(1) as f64);
+    }
+    println!("elapsed:       {:.3} s", elapsed);
+    println!("pixels/s:      {:.0}", drawn as f64 / elapsed);
+    println!("read pixels/s: {:.0}", read as f64 / elapsed);
+    if !latencies.is_empty() {
+        println!("GET latency:   p50 {} us, p90 {} us, p99 {} us, p99.9 {} us, max {} us",
+            percentile(&latencies, p[0]), percentile(&latencies, p[1]), percentile(&latencies, p[2]),
+            percentile(&latencies, p[3]), latencies[latencies.len() - 1]);
+    }
+    println!("fairness:      min share {:.3}, max share {:.3}", min_share, max_share);
+    if let Some(cpu) = server_cpu {
+        println!("server cpu:    {:.3} s", cpu);
+        println!("cpu ns/pixel:  {:.1}", cpu * 1e9 / (drawn + read).max(1) as f64);
+    }
+
+    if let Some(path) = &args.json {
+        let unix_time = std::time::SystemTime::now().duration_since(std::time::UNIX_EPOCH).unwrap().as_secs();
+        let mut line = format!(
+            "{{\"time\":{},\"label\":\"{}\",\"conns\":{},\"mix\":\"{}\",\"rect\":{},\"batch\":{},\"inflight\":{},\"seconds\":{:.3},\
+             \"pixels\":{},\"pixels_per_s\":{:.0},\"read_pixels\":{},\"read_pixels_per_s\":{:.0},\
+             \"get_latency_us\":{{\"p50\":{},\"p90\":{},\"p99\":{},\"p999\":{},\"max\":{},\"count\":{}}},\
+             \"fairness\":{{\"min_share\":{:.4},\"max_share\":{:.4},\"per_conn\":[{}]}}",
+            unix_time, args.label.replace('\\', "\\\\").replace('"', "\\\""), args.conns, mix, args.rect,
+            args.batch, args.inflight, elapsed, drawn, drawn as f64 / elapsed, read, read as f64 / elapsed,
+            percentile(&latencies, p[0]), percentile(&latencies, p[1]), percentile(&latencies, p[2]),
+            percentile(&latencies, p[3]), latencies.last().copied().unwrap_or(0), latencies.len(),
+            min_share, max_share, work.iter().map(|w| w.to_string()).collect::<Vec<_>>().join(","));
+        if let Some(cpu) = server_cpu {
+            line += &format!(",\"server_cpu_s\":{:.3},\"cpu_ns_per_pixel\":{:.2}", cpu,
+                cpu * 1e9 / (drawn + read).max(1) as f64);
+        }
+        if let Some(dropped) = dropped {
+            line += &format!(",\"udp_sent\":{},\"udp_dropped\":{}", sent, dropped);
+        }
+        line += "}\n";
+        let mut file = std::fs::OpenOptions::new().create(true).append(true).open(path).expect("--json");
+        file.write_all(line.as_bytes()).expect("--json");
+    }
+}
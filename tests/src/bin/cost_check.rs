@@ -0,0 +1,88 @@
+// Checks that programs and kernels can't hang a connection with a low pixel quota.
+//
+// usage: cost_check [--host 127.0.0.1] [--port 1337]
+//
+// Run it against `server --conn-pixels 10`: a full bucket then holds 1 pixel. A program of 64 instructions costs 8
+// pixels per pixel and a kernel of 25 taps 4, so the server has to reject both uploads instead of throttling the run
+// forever. A program of 8 instructions (cost 1) still has to run.
+
+use std::io::{Read, Write};
+use std::net::TcpStream;
+use std::time::{Duration, Instant};
+
+fn parse_args() -> String {
+    let mut host = "127.0.0.1".to_string();
+    let mut port = 1337u16;
+    let mut it = std::env::args().skip(1);
+    while let Some(arg) = it.next() {
+        let value = it.next().unwrap_or_else(|| panic!("{} needs a value", arg));
+        match arg.as_str() {
+            "--host" => host = value,
+            "--port" => port = value.parse().expect("--port"),
+            _ => panic!("unknown argument {}", arg),
+        }
+    }
+    format!("{}:{}", host, port)
+}
+
+fn rect_command(op: u8, x: u16, y: u16, w: u16, h: u16) -> [u8; 8] {
+    let wh = ((w >> 8) & 0x0f) as u8 | ((h >> 4) & 0xf0) as u8;
+    [op, x as u8, (x >> 8) as u8, y as u8, (y >> 8) as u8, w as u8, h as u8, wh]
+}
+
+// sends the commands followed by INFO, returns whether the INFO response arrived before the server closed
+fn run(addr: &str, data: &[u8]) -> std::io::Result<bool> {
+    let mut stream = TcpStream::connect(addr)?;
+    stream.set_read_timeout(Some(Duration::from_secs(10)))?;
+    stream.write_all(data)?;
+    stream.write_all(&[b'I', 0, 0, 0, 0, 0, 0, 0])?;
+    let mut response = [0u8; 16];
+    match stream.read_exact(&mut response) {
+        Ok(()) => Ok(true),
+        Err(e) if e.kind() == std::io::ErrorKind::UnexpectedEof || e.kind() == std::io::ErrorKind::ConnectionReset => {
+            Ok(false)
+        }
+        Err(e) => Err(e), // a timeout means the run hangs
+    }
+}
+
+fn program(num_insns: u8) -> Vec<u8> {
+    let mut data = vec![b'u', num_insns, 0, 0, 0, 0, 0, 0];
+    for _ in 0..num_insns {
+        data.extend_from_slice(&[0x00, 3, 0, 0]); // r3 = 0
+    }
+    data.extend_from_slice(&rect_command(b'x', 0, 0, 4, 4));
+    data
+}
+
+fn kernel() -> Vec<u8> {
+    let mut data = vec![b'k', 5, 0, 0, 0, 0, 0, 0];
+    for _ in 0..25 {
+        data.extend_from_slice(&1i16.to_le_bytes());
+    }
+    data.extend_from_slice(&rect_command(b'c', 0, 0, 4, 4));
+    data
+}
+
+fn main() {
+    let addr = parse_args();
+    let checks: [(&str, Vec<u8>, bool); 3] = [
+        ("program of 8 instructions runs", program(8), true),
+        ("program of 64 instructions is rejected", program(64), false),
+        ("kernel of 25 taps is rejected", kernel(), false),
+    ];
+    let mut failed = 0;
+    for (name, data, expected) in checks.iter() {
+        let start = Instant::now();
+        let ok = match run(&addr, data) {
+            Ok(answered) => answered == *expected,
+            Err(e) => {
+                println!("{}: {}", name, e);
+                false
+            }
+        };
+        println!("{}: {} ({:.1} s)", name, if ok { "ok" } else { "FAILED" }, start.elapsed().as_secs_f64());
+        failed += !ok as i32;
+    }
+    std::process::exit(failed);
+}